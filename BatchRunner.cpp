@@ -0,0 +1,399 @@
+#include "BatchRunner.h"
+#include "Benchmark.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+/*
+ * getTokens function
+ * Splits a command line into whitespace separated tokens.
+ * Takes a string parameter str representing the command line.
+ * Returns the tokens in order.
+ */
+std::vector<std::string> getTokens(const std::string& str) {
+    std::vector<std::string> tokens;
+    size_t start = 0;
+
+    while (start < str.length()) {
+        while (start < str.length() && std::isspace(str[start])) {
+            ++start; // Skip whitespace characters
+        }
+
+        size_t end = start;
+        while (end < str.length() && !std::isspace(str[end])) {
+            ++end; // Find the next space or end of the string
+        }
+
+        if (start < end) {
+            tokens.push_back(str.substr(start, end - start));
+        }
+        start = end;
+    }
+
+    return tokens;
+}
+
+/*
+ * overlaps function
+ * Tells whether two resources may refer to the same file.
+ * Paths overlap when they are equal, when one is a directory containing the other,
+ * or when either is the "*" wildcard.
+ */
+static bool overlaps(bool remoteA, const std::string& a, bool remoteB, const std::string& b) {
+    if (remoteA != remoteB) {
+        return false;
+    }
+    if (a == "*" || b == "*" || a == b) {
+        return true;
+    }
+    const std::string& shorter = a.size() < b.size() ? a : b;
+    const std::string& longer = a.size() < b.size() ? b : a;
+    return longer.compare(0, shorter.size(), shorter) == 0 && longer[shorter.size()] == '/';
+}
+
+/*
+ * Constructor for the BatchRunner class.
+ * Takes parameters:
+ * - serverAddress: the IP address of the server
+ * - serverPort: the port number of the server
+ * - username: the username every session logs in with
+ * - password: the password every session logs in with
+ * - sessions: the maximum number of concurrent sessions
+ */
+BatchRunner::BatchRunner(const std::string& serverAddress, int serverPort,
+                         const std::string& username, const std::string& password, unsigned sessions)
+    : serverAddress(serverAddress), serverPort(serverPort), username(username), password(password),
+      sessions(std::max(1u, sessions)) {}
+
+/*
+ * setDownloadCache function
+ * Selects the download cache every session of the run shares.
+ * Takes a parameter cache, null to download every file.
+ * Returns void.
+ */
+void BatchRunner::setDownloadCache(std::shared_ptr<DownloadCache> cache) {
+    downloadCache = std::move(cache);
+}
+
+/*
+ * setPrefetch function
+ * Lets every session stage the files of its listings for the downloads after them.
+ * Takes a parameter budgetBytes representing the staging budget of each session, 0 for none.
+ * Returns void.
+ */
+void BatchRunner::setPrefetch(uint64_t budgetBytes) {
+    prefetchBytes = budgetBytes;
+}
+
+/*
+ * isNumber function
+ * Tells whether a token is a non-empty run of decimal digits.
+ */
+static bool isNumber(const std::string& token) {
+    return !token.empty() && token.size() <= 19 &&
+           std::all_of(token.begin(), token.end(), [](unsigned char c) { return std::isdigit(c) != 0; });
+}
+
+/*
+ * describe function
+ * Validates a command and records the files it reads and writes.
+ * Takes a parameter command whose tokens are filled in.
+ * Returns true if the command is valid, false otherwise.
+ */
+bool BatchRunner::describe(Command& command) {
+    const std::vector<std::string>& t = command.tokens;
+
+    if (t[0] == "list" && t.size() == 1) {
+        command.reads.push_back({true, "*"});
+    } else if ((t[0] == "stor" || t[0] == "delta" || t[0] == "storall") && t.size() == 3) {
+        command.reads.push_back({false, t[1]});
+        command.writes.push_back({true, t[2]});
+    } else if ((t[0] == "retr" || t[0] == "retrall") && t.size() == 3) {
+        command.reads.push_back({true, t[1]});
+        command.writes.push_back({false, t[2]});
+    } else if (t[0] == "pread" && t.size() == 5 && isNumber(t[2]) && isNumber(t[3])) {
+        command.reads.push_back({true, t[1]});
+        command.writes.push_back({false, t[4]});
+    } else if ((t[0] == "bench" && t.size() >= 3) || (t[0] == "readbench" && t.size() >= 4 && t.size() <= 5)) {
+        // Benchmarks run alone so concurrent commands do not skew the numbers
+        command.reads.push_back({true, "*"});
+        command.writes.push_back({false, "*"});
+        command.writes.push_back({true, "*"});
+    } else if (t[0] == "mirror" && t.size() >= 4) {
+        command.reads.push_back({true, t[1]});
+        command.writes.push_back({false, t[2]});
+    } else if (t[0] == "mget" && t.size() >= 2) {
+        for (size_t i = 1; i < t.size(); ++i) {
+            command.reads.push_back({true, t[i]});
+            command.writes.push_back({false, t[i]});
+        }
+    } else if (t[0] == "push" && t.size() == 1) {
+        command.reads.push_back({false, "*"});
+        command.writes.push_back({true, "*"});
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * conflicts function
+ * Tells whether a later command has to wait for an earlier one,
+ * which is the case when either writes a file the other reads or writes.
+ */
+bool BatchRunner::conflicts(const Command& earlier, const Command& later) {
+    for (const Resource& written : earlier.writes) {
+        for (const Resource& other : later.reads) {
+            if (overlaps(written.remote, written.path, other.remote, other.path)) {
+                return true;
+            }
+        }
+        for (const Resource& other : later.writes) {
+            if (overlaps(written.remote, written.path, other.remote, other.path)) {
+                return true;
+            }
+        }
+    }
+    for (const Resource& read : earlier.reads) {
+        for (const Resource& other : later.writes) {
+            if (overlaps(read.remote, read.path, other.remote, other.path)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+ * parse function
+ * Reads the script, one command per line, skipping blank lines and # comments,
+ * and builds the dependencies between the commands.
+ * Takes a parameter input representing the script.
+ * Returns true if every line is a valid command, false otherwise.
+ */
+bool BatchRunner::parse(std::istream& input) {
+    bool valid = true;
+    std::string line;
+    size_t lineNumber = 0;
+
+    while (std::getline(input, line)) {
+        ++lineNumber;
+        Command command;
+        command.line = lineNumber;
+        command.text = line;
+        command.tokens = getTokens(line);
+        if (command.tokens.empty() || command.tokens[0][0] == '#') {
+            continue;
+        }
+        if (!describe(command)) {
+            std::cerr << "Line " << lineNumber << ": invalid command or incorrect arguments: " << line << std::endl;
+            valid = false;
+            continue;
+        }
+        commands.push_back(std::move(command));
+    }
+
+    for (size_t later = 0; later < commands.size(); ++later) {
+        for (size_t earlier = 0; earlier < later; ++earlier) {
+            if (conflicts(commands[earlier], commands[later])) {
+                commands[earlier].dependents.push_back(later);
+                ++commands[later].pendingDependencies;
+            }
+        }
+    }
+    return valid;
+}
+
+/*
+ * execute function
+ * Runs a single command on a session.
+ * Returns true if the command succeeded, false otherwise.
+ */
+bool BatchRunner::execute(ServerController& session, const Command& command) {
+    const std::vector<std::string>& t = command.tokens;
+
+    if (t[0] == "list") {
+        return session.listFiles();
+    } else if (t[0] == "stor") {
+        return session.uploadFile(t[1], t[2]);
+    } else if (t[0] == "delta") {
+        return session.uploadFileDelta(t[1], t[2]);
+    } else if (t[0] == "storall") {
+        return session.uploadDirectory(t[1], t[2]);
+    } else if (t[0] == "retr") {
+        return session.downloadFile(t[1], t[2]);
+    } else if (t[0] == "bench") {
+        return Benchmark::runCommand(session, t);
+    } else if (t[0] == "readbench") {
+        return Benchmark::runReadCommand(session, t);
+    } else if (t[0] == "pread") {
+        return session.readRemote(t[1], std::stoull(t[2]), std::stoull(t[3]), t[4]);
+    } else if (t[0] == "mirror") {
+        return session.downloadFromMirrors(std::vector<std::string>(t.begin() + 3, t.end()), t[1], t[2]);
+    } else if (t[0] == "mget") {
+        return session.downloadFiles(std::vector<std::string>(t.begin() + 1, t.end()));
+    } else if (t[0] == "retrall") {
+        return session.downloadDirectory(t[1], t[2]);
+    } else if (t[0] == "push") {
+        return session.pushChanged();
+    }
+    return false;
+}
+
+/*
+ * report function
+ * Prints the outcome of a command. Must be called with the mutex held.
+ * Returns void.
+ */
+void BatchRunner::report(const Command& command) {
+    std::cout << "[batch] line " << command.line << " exit=" << command.exitCode
+              << " time=" << command.seconds << "s " << command.text << std::endl;
+}
+
+/*
+ * complete function
+ * Records the outcome of a command and releases the commands waiting for it.
+ * When the command did not succeed, everything depending on it is skipped with exit code 2.
+ * Takes parameters:
+ * - index: the command that finished
+ * - exitCode: 0 on success, 1 on failure
+ * - seconds: how long the command ran
+ * Returns void.
+ */
+void BatchRunner::complete(size_t index, int exitCode, double seconds) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::vector<size_t> toSkip;
+    commands[index].exitCode = exitCode;
+    commands[index].seconds = seconds;
+    ++finished;
+    report(commands[index]);
+
+    for (size_t dependent : commands[index].dependents) {
+        if (exitCode != 0) {
+            toSkip.push_back(dependent);
+        } else if (--commands[dependent].pendingDependencies == 0 && commands[dependent].exitCode == -1) {
+            ready.push_back(dependent);
+        }
+    }
+
+    while (!toSkip.empty()) {
+        size_t skipped = toSkip.back();
+        toSkip.pop_back();
+        if (commands[skipped].exitCode != -1) {
+            continue;
+        }
+        commands[skipped].exitCode = 2;
+        ++finished;
+        report(commands[skipped]);
+        toSkip.insert(toSkip.end(), commands[skipped].dependents.begin(), commands[skipped].dependents.end());
+    }
+
+    changed.notify_all();
+}
+
+/*
+ * workerLoop function
+ * Body of a session thread: connects, logs in and runs ready commands until all finished.
+ * If the last session fails to connect, the commands that never ran are failed.
+ * Returns void.
+ */
+void BatchRunner::workerLoop() {
+    std::unique_ptr<ServerController> session;
+    try {
+        session = std::make_unique<ServerController>(serverAddress, serverPort);
+        session->setDownloadCache(downloadCache);
+        if (prefetchBytes > 0) {
+            session->setPrefetch(prefetchBytes);
+        }
+        if (!session->login(username, password)) {
+            session.reset();
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << "Failed to open session: " << ex.what() << std::endl;
+        session.reset();
+    }
+
+    if (!session) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--liveWorkers == 0) {
+            for (Command& command : commands) {
+                if (command.exitCode == -1) {
+                    command.exitCode = 1;
+                    ++finished;
+                    report(command);
+                }
+            }
+            changed.notify_all();
+        }
+        return;
+    }
+
+    while (true) {
+        size_t index;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] { return !ready.empty() || finished == commands.size(); });
+            if (ready.empty()) {
+                break;
+            }
+            index = ready.front();
+            ready.pop_front();
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        bool ok = execute(*session, commands[index]);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        complete(index, ok ? 0 : 1, seconds);
+    }
+
+    session->logout();
+}
+
+/*
+ * run function
+ * Reads a script and runs it to completion.
+ * Takes a parameter input representing the script.
+ * Returns 0 if every command succeeded, 1 if any failed or was skipped, 2 if the script is invalid.
+ */
+int BatchRunner::run(std::istream& input) {
+    if (!parse(input)) {
+        return 2;
+    }
+    if (commands.empty()) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < commands.size(); ++i) {
+        if (commands[i].pendingDependencies == 0) {
+            ready.push_back(i);
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    unsigned workerCount = static_cast<unsigned>(std::min<size_t>(sessions, commands.size()));
+    liveWorkers = workerCount;
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < workerCount; ++i) {
+        workers.emplace_back(&BatchRunner::workerLoop, this);
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t succeeded = std::count_if(commands.begin(), commands.end(), [](const Command& c) { return c.exitCode == 0; });
+    size_t skipped = std::count_if(commands.begin(), commands.end(), [](const Command& c) { return c.exitCode == 2; });
+    std::cout << "[batch] " << commands.size() << " commands: " << succeeded << " succeeded, "
+              << commands.size() - succeeded - skipped << " failed, " << skipped << " skipped in "
+              << seconds << "s on " << workerCount << " sessions" << std::endl;
+    if (downloadCache) {
+        downloadCache->printStats(std::cout);
+    }
+
+    return succeeded == commands.size() ? 0 : 1;
+}
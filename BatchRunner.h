@@ -0,0 +1,72 @@
+#pragma once
+
+#include "ServerController.h"
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+std::vector<std::string> getTokens(const std::string& str);
+
+/*
+ * BatchRunner class
+ * Runs a script of shell commands (list, stor, retr, ...) non-interactively.
+ * Commands that touch the same local or remote files keep their order,
+ * independent commands run concurrently on a pool of sessions.
+ * Every command is reported with an exit code and its run time.
+ */
+class BatchRunner {
+public:
+    BatchRunner(const std::string& serverAddress, int serverPort,
+                const std::string& username, const std::string& password, unsigned sessions);
+
+    void setDownloadCache(std::shared_ptr<DownloadCache> cache);
+    void setPrefetch(uint64_t budgetBytes);
+    int run(std::istream& input);
+
+private:
+    // A file a command reads or writes, "*" stands for every file on that side
+    struct Resource {
+        bool remote;
+        std::string path;
+    };
+
+    struct Command {
+        size_t line = 0;
+        std::string text;
+        std::vector<std::string> tokens;
+        std::vector<Resource> reads;
+        std::vector<Resource> writes;
+        std::vector<size_t> dependents;
+        size_t pendingDependencies = 0;
+        int exitCode = -1;
+        double seconds = 0;
+    };
+
+    std::string serverAddress;
+    int serverPort;
+    std::string username;
+    std::string password;
+    unsigned sessions;
+    std::shared_ptr<DownloadCache> downloadCache;
+    uint64_t prefetchBytes = 0;
+
+    std::vector<Command> commands;
+    std::deque<size_t> ready;
+    size_t finished = 0;
+    unsigned liveWorkers = 0;
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    bool parse(std::istream& input);
+    static bool describe(Command& command);
+    static bool conflicts(const Command& earlier, const Command& later);
+    static bool execute(ServerController& session, const Command& command);
+    void workerLoop();
+    void complete(size_t index, int exitCode, double seconds);
+    void report(const Command& command);
+};
@@ -0,0 +1,283 @@
+#include "Benchmark.h"
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+/*
+ * cpuSeconds function
+ * Returns the user and system CPU time used by the process so far.
+ */
+static void cpuSeconds(double& user, double& system, long& voluntary, long& involuntary) {
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    system = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    voluntary = usage.ru_nvcsw;
+    involuntary = usage.ru_nivcsw;
+}
+
+/*
+ * percentile function
+ * Returns the value below which the given fraction of the values fall (nearest rank).
+ */
+double Benchmark::percentile(std::vector<double> values, double fraction) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t rank = static_cast<size_t>(fraction * (values.size() - 1) + 0.5);
+    return values[std::min(rank, values.size() - 1)];
+}
+
+/*
+ * readBaseline function
+ * Reads the throughput and CPU cost from a result saved by an earlier run.
+ * Takes parameters:
+ * - path: the saved result
+ * - mbPerSecond: receives the recorded throughput
+ * - cpuPerMb: receives the recorded CPU seconds per MB
+ * Returns true if both values were found, false otherwise.
+ */
+bool Benchmark::readBaseline(const std::string& path, double& mbPerSecond, double& cpuPerMb) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        return false;
+    }
+    std::stringstream content;
+    content << file.rdbuf();
+    std::string json = content.str();
+
+    auto number = [&json](const std::string& key, double& value) {
+        size_t position = json.find("\"" + key + "\":");
+        if (position == std::string::npos) {
+            return false;
+        }
+        value = std::strtod(json.c_str() + position + key.size() + 3, nullptr);
+        return true;
+    };
+    return number("mb_per_s", mbPerSecond) && number("cpu_s_per_mb", cpuPerMb);
+}
+
+/*
+ * run function
+ * Downloads every file the given number of times and reports the result.
+ * The local copy is removed before each download so nothing is skipped as up to date.
+ * Takes parameters:
+ * - session: the logged-in session to download with
+ * - files: the remote files to download
+ * - runs: how often each file is downloaded
+ * - baselinePath: an earlier result to compare with, or empty
+ * - savePath: where to save this result as the next baseline, or empty
+ * Returns false if a download failed or the result regressed beyond TOLERANCE, true otherwise.
+ */
+bool Benchmark::run(ServerController& session, const std::vector<std::string>& files, unsigned runs,
+                    const std::string& baselinePath, const std::string& savePath) {
+    std::vector<double> latencies;
+    uint64_t totalBytes = 0;
+    size_t failures = 0;
+
+    double userBefore, systemBefore;
+    long voluntaryBefore, involuntaryBefore;
+    cpuSeconds(userBefore, systemBefore, voluntaryBefore, involuntaryBefore);
+    TlsChannel::Stats tlsBefore = TlsChannel::stats();
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned run = 0; run < runs; ++run) {
+        for (const std::string& file : files) {
+            std::string localPath = "drive/" + file;
+            std::remove(localPath.c_str());
+
+            auto fileStart = std::chrono::steady_clock::now();
+            if (!session.downloadFile(file, file)) {
+                ++failures;
+                continue;
+            }
+            latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() -
+                                                                          fileStart).count());
+            struct stat localStat = {};
+            if (stat(localPath.c_str(), &localStat) == 0) {
+                totalBytes += static_cast<uint64_t>(localStat.st_size);
+            }
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double userAfter, systemAfter;
+    long voluntaryAfter, involuntaryAfter;
+    cpuSeconds(userAfter, systemAfter, voluntaryAfter, involuntaryAfter);
+    TlsChannel::Stats tlsAfter = TlsChannel::stats();
+    uint64_t handshakes = (tlsAfter.controlHandshakes - tlsBefore.controlHandshakes) +
+                          (tlsAfter.dataHandshakes - tlsBefore.dataHandshakes);
+    uint64_t resumed = (tlsAfter.controlResumed - tlsBefore.controlResumed) +
+                       (tlsAfter.dataResumed - tlsBefore.dataResumed);
+
+    double megabytes = totalBytes / 1e6;
+    double mbPerSecond = seconds > 0 ? megabytes / seconds : 0;
+    double cpu = (userAfter - userBefore) + (systemAfter - systemBefore);
+    double cpuPerMb = megabytes > 0 ? cpu / megabytes : 0;
+
+    std::ostringstream json;
+    json << "{\"files\":" << files.size() << ",\"runs\":" << runs << ",\"failures\":" << failures
+         << ",\"bytes\":" << totalBytes << ",\"seconds\":" << seconds << ",\"mb_per_s\":" << mbPerSecond
+         << ",\"p50_ms\":" << percentile(latencies, 0.5) << ",\"p99_ms\":" << percentile(latencies, 0.99)
+         << ",\"cpu_user_s\":" << (userAfter - userBefore) << ",\"cpu_sys_s\":" << (systemAfter - systemBefore)
+         << ",\"cpu_s_per_mb\":" << cpuPerMb << ",\"voluntary_switches\":" << (voluntaryAfter - voluntaryBefore)
+         << ",\"involuntary_switches\":" << (involuntaryAfter - involuntaryBefore)
+         << ",\"tls_handshakes\":" << handshakes << ",\"tls_resumed\":" << resumed << "}";
+    std::cout << json.str() << std::endl;
+
+    if (!savePath.empty()) {
+        std::ofstream out(savePath, std::ios::trunc);
+        if (!out.is_open()) {
+            std::cerr << "Failed to save benchmark result: " << savePath << std::endl;
+        } else {
+            out << json.str() << "\n";
+        }
+    }
+
+    bool ok = failures == 0;
+    if (!baselinePath.empty()) {
+        double baselineMbPerSecond = 0;
+        double baselineCpuPerMb = 0;
+        if (!readBaseline(baselinePath, baselineMbPerSecond, baselineCpuPerMb)) {
+            std::cerr << "Failed to read benchmark baseline: " << baselinePath << std::endl;
+            return false;
+        }
+        if (mbPerSecond < baselineMbPerSecond * (1 - TOLERANCE)) {
+            std::cerr << "Throughput regressed: " << mbPerSecond << " MB/s, baseline " << baselineMbPerSecond
+                      << " MB/s" << std::endl;
+            ok = false;
+        }
+        if (baselineCpuPerMb > 0 && cpuPerMb > baselineCpuPerMb * (1 + TOLERANCE)) {
+            std::cerr << "CPU cost regressed: " << cpuPerMb << " s/MB, baseline " << baselineCpuPerMb << " s/MB"
+                      << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/*
+ * runCommand function
+ * Handles the bench command of the shell and of batch scripts:
+ *   bench <runs> <file>... [--baseline <result.json>] [--save <result.json>]
+ * Returns true if the benchmark passed, false if it failed, regressed or was malformed.
+ */
+bool Benchmark::runCommand(ServerController& session, const std::vector<std::string>& tokens) {
+    std::vector<std::string> files;
+    std::string baselinePath, savePath;
+    for (size_t i = 2; i < tokens.size(); ++i) {
+        if (tokens[i] == "--baseline" && i + 1 < tokens.size()) {
+            baselinePath = tokens[++i];
+        } else if (tokens[i] == "--save" && i + 1 < tokens.size()) {
+            savePath = tokens[++i];
+        } else {
+            files.push_back(tokens[i]);
+        }
+    }
+
+    unsigned runs = 0;
+    try {
+        runs = static_cast<unsigned>(std::stoul(tokens[1]));
+    } catch (const std::exception&) {
+        runs = 0;
+    }
+    if (runs == 0 || files.empty()) {
+        std::cout << "Usage: bench <runs> <file>... [--baseline <result.json>] [--save <result.json>]" << std::endl;
+        return false;
+    }
+    return run(session, files, runs, baselinePath, savePath);
+}
+
+/*
+ * runReads function
+ * Reads parts of a remote file through a RemoteFile with a cold block cache and reports
+ * the latency of each read, the throughput and how many transfers the reads took.
+ * Takes parameters:
+ * - session: the logged-in session whose server holds the file
+ * - file: the remote file
+ * - sequential: read one part after the other from the start, else at random offsets
+ * - reads: the number of reads; sequential reads stop early at the end of the file
+ * - readSize: the bytes per read
+ * Returns false if the file cannot be opened or a read failed, true otherwise.
+ */
+bool Benchmark::runReads(ServerController& session, const std::string& file, bool sequential, unsigned reads,
+                         size_t readSize) {
+    auto cache = std::make_shared<BlockCache>(READ_CACHE_BYTES);
+    std::unique_ptr<RemoteFile> remoteFile = session.openRemoteFile(file, cache);
+    if (!remoteFile) {
+        return false;
+    }
+    uint64_t size = remoteFile->size();
+    // A fixed seed reads the same offsets in every run, so runs are comparable
+    std::mt19937_64 random(42);
+    std::uniform_int_distribution<uint64_t> offsets(0, size > readSize ? size - readSize : 0);
+
+    std::vector<char> buffer(readSize);
+    std::vector<double> latencies;
+    uint64_t totalBytes = 0;
+    bool failed = false;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < reads; ++i) {
+        uint64_t offset = sequential ? totalBytes : offsets(random);
+        if (offset >= size) {
+            break;
+        }
+        auto readStart = std::chrono::steady_clock::now();
+        try {
+            totalBytes += remoteFile->pread(buffer.data(), readSize, offset);
+        } catch (const std::exception& ex) {
+            std::cerr << "Read at offset " << offset << " failed: " << ex.what() << std::endl;
+            failed = true;
+            break;
+        }
+        latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() -
+                                                                      readStart).count());
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    RemoteFile::Stats fileStats = remoteFile->stats();
+    BlockCache::Stats cacheStats = cache->stats();
+    uint64_t lookups = cacheStats.hits + cacheStats.misses;
+    std::cout << "{\"file\":\"" << file << "\",\"pattern\":\"" << (sequential ? "sequential" : "random")
+              << "\",\"reads\":" << latencies.size() << ",\"read_size\":" << readSize
+              << ",\"bytes\":" << totalBytes << ",\"seconds\":" << seconds
+              << ",\"mb_per_s\":" << (seconds > 0 ? totalBytes / 1e6 / seconds : 0)
+              << ",\"p50_ms\":" << percentile(latencies, 0.5) << ",\"p99_ms\":" << percentile(latencies, 0.99)
+              << ",\"transfers\":" << fileStats.transfers << ",\"continued\":" << fileStats.continued
+              << ",\"bytes_fetched\":" << fileStats.bytesFetched
+              << ",\"block_hit_rate\":" << (lookups ? static_cast<double>(cacheStats.hits) / lookups : 0.0) << "}"
+              << std::endl;
+    return !failed;
+}
+
+/*
+ * runReadCommand function
+ * Handles the readbench command of the shell and of batch scripts:
+ *   readbench <file> random|sequential <reads> [read size in bytes, default 4096]
+ * Returns true if the benchmark ran, false if a read failed or the command was malformed.
+ */
+bool Benchmark::runReadCommand(ServerController& session, const std::vector<std::string>& tokens) {
+    unsigned reads = 0;
+    size_t readSize = 4096;
+    try {
+        reads = static_cast<unsigned>(std::stoul(tokens[3]));
+        if (tokens.size() == 5) {
+            readSize = std::stoul(tokens[4]);
+        }
+    } catch (const std::exception&) {
+        reads = 0;
+    }
+    if (reads == 0 || readSize == 0 || (tokens[2] != "random" && tokens[2] != "sequential")) {
+        std::cout << "Usage: readbench <file> random|sequential <reads> [read size]" << std::endl;
+        return false;
+    }
+    return runReads(session, tokens[1], tokens[2] == "sequential", reads, readSize);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "ServerController.h"
+#include <string>
+#include <vector>
+
+/*
+ * Benchmark class
+ * Measures download throughput of the current build against the connected server,
+ * so a change to the copy loops can be compared with an earlier recorded run.
+ * Results are one JSON object: MB/s, per-file latency percentiles, CPU time and
+ * context switches. A baseline is such an object saved from an earlier run.
+ * The read benchmark measures RemoteFile instead: many small reads of one remote
+ * file, at random offsets or one after the other.
+ */
+class Benchmark {
+public:
+    // Allowed drop in MB/s or rise in CPU per MB before a run counts as a regression
+    static constexpr double TOLERANCE = 0.10;
+    // Block cache of a read benchmark, which starts empty every run
+    static constexpr uint64_t READ_CACHE_BYTES = 64ULL * 1024 * 1024;
+
+    static bool runCommand(ServerController& session, const std::vector<std::string>& tokens);
+    static bool run(ServerController& session, const std::vector<std::string>& files, unsigned runs,
+                    const std::string& baselinePath, const std::string& savePath);
+    static bool runReadCommand(ServerController& session, const std::vector<std::string>& tokens);
+    static bool runReads(ServerController& session, const std::string& file, bool sequential, unsigned reads,
+                         size_t readSize);
+
+private:
+    static bool readBaseline(const std::string& path, double& mbPerSecond, double& cpuPerMb);
+    static double percentile(std::vector<double> values, double fraction);
+};
@@ -0,0 +1,123 @@
+#include "BlockCache.h"
+
+/*
+ * Constructor for the BlockCache class.
+ * Takes a parameter budgetBytes representing the most block data the cache holds.
+ */
+BlockCache::BlockCache(uint64_t budgetBytes) : shardBudget(budgetBytes / SHARDS) {
+}
+
+/*
+ * KeyHash function
+ * Mixes the file id and block index (splitmix64 finalizer), so consecutive blocks spread over the shards.
+ */
+size_t BlockCache::KeyHash::operator()(const Key& key) const {
+    uint64_t x = key.file ^ (key.index * 0x9e3779b97f4a7c15ULL);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return static_cast<size_t>(x ^ (x >> 31));
+}
+
+/*
+ * shardFor function
+ * Returns the shard holding the given block.
+ */
+BlockCache::Shard& BlockCache::shardFor(const Key& key) {
+    return shards[KeyHash()(key) % SHARDS];
+}
+
+/*
+ * get function
+ * Looks up a block and marks it as the most recently used of its shard.
+ * Takes parameters:
+ * - file: the id of the file
+ * - index: the index of the block in the file
+ * Returns the block, or nullptr if it is not cached.
+ */
+BlockCache::Block BlockCache::get(uint64_t file, uint64_t index) {
+    Key key{file, index};
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.entries.find(key);
+    if (found == shard.entries.end()) {
+        ++misses;
+        return nullptr;
+    }
+    shard.order.splice(shard.order.begin(), shard.order, found->second);
+    ++hits;
+    return found->second->second;
+}
+
+/*
+ * contains function
+ * Checks whether a block is cached, without counting a hit or changing its use order.
+ * Takes parameters:
+ * - file: the id of the file
+ * - index: the index of the block in the file
+ * Returns true if the block is cached, false otherwise.
+ */
+bool BlockCache::contains(uint64_t file, uint64_t index) {
+    Key key{file, index};
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.entries.count(key) != 0;
+}
+
+/*
+ * put function
+ * Adds or replaces a block and evicts the least recently used blocks of its shard while
+ * the shard is over its budget. The new block itself is kept even if it alone exceeds it.
+ * Takes parameters:
+ * - file: the id of the file
+ * - index: the index of the block in the file
+ * - block: the block data
+ * Returns void.
+ */
+void BlockCache::put(uint64_t file, uint64_t index, Block block) {
+    Key key{file, index};
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.entries.find(key);
+    if (found != shard.entries.end()) {
+        shard.bytes -= found->second->second->size();
+        shard.order.erase(found->second);
+        shard.entries.erase(found);
+    }
+    shard.bytes += block->size();
+    shard.order.emplace_front(key, std::move(block));
+    shard.entries[key] = shard.order.begin();
+
+    while (shard.bytes > shardBudget && shard.order.size() > 1) {
+        auto& oldest = shard.order.back();
+        shard.bytes -= oldest.second->size();
+        shard.entries.erase(oldest.first);
+        shard.order.pop_back();
+        ++evicted;
+    }
+}
+
+/*
+ * stats function
+ * Returns the hit, miss and eviction counts since the cache was created.
+ */
+BlockCache::Stats BlockCache::stats() const {
+    Stats result;
+    result.hits = hits.load();
+    result.misses = misses.load();
+    result.evicted = evicted.load();
+    return result;
+}
+
+/*
+ * printStats function
+ * Prints the counts and the block hit rate on one line.
+ * Takes a parameter out representing the stream to print to.
+ * Returns void.
+ */
+void BlockCache::printStats(std::ostream& out) const {
+    Stats current = stats();
+    uint64_t lookups = current.hits + current.misses;
+    double rate = lookups > 0 ? 100.0 * current.hits / lookups : 0;
+    out << "[blocks] hits=" << current.hits << " misses=" << current.misses << " (" << rate
+        << "% hit rate) evicted=" << current.evicted << std::endl;
+}
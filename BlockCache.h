@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * BlockCache class
+ * An in-memory cache of fixed-size blocks of remote files, for readers that only need
+ * parts of a file. A block is named by a file id and its index in the file.
+ * The cache is split into shards by a hash of the name, each with its own lock and its
+ * own least-recently-used order, so readers on different threads rarely wait for each
+ * other; neighbouring blocks land in different shards. Each shard holds an equal part of
+ * the budget and evicts its least recently used blocks once it is over it.
+ * Blocks are shared and immutable, so a block evicted while a reader copies from it stays
+ * valid until the reader lets go of it.
+ */
+class BlockCache {
+public:
+    using Block = std::shared_ptr<const std::vector<char>>;
+
+    static constexpr size_t SHARDS = 16;
+
+    // Counts since the cache was created
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evicted = 0;
+    };
+
+    explicit BlockCache(uint64_t budgetBytes);
+
+    BlockCache(const BlockCache&) = delete;
+    BlockCache& operator=(const BlockCache&) = delete;
+
+    Block get(uint64_t file, uint64_t index);
+    bool contains(uint64_t file, uint64_t index);
+    void put(uint64_t file, uint64_t index, Block block);
+    Stats stats() const;
+    void printStats(std::ostream& out) const;
+
+private:
+    struct Key {
+        uint64_t file;
+        uint64_t index;
+
+        bool operator==(const Key& other) const { return file == other.file && index == other.index; }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        // Most recently used first
+        std::list<std::pair<Key, Block>> order;
+        std::unordered_map<Key, std::list<std::pair<Key, Block>>::iterator, KeyHash> entries;
+        uint64_t bytes = 0;
+    };
+
+    uint64_t shardBudget;
+    Shard shards[SHARDS];
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> evicted{0};
+
+    Shard& shardFor(const Key& key);
+};
@@ -0,0 +1,123 @@
+#include "BufferRing.h"
+#include <stdexcept>
+
+/*
+ * Constructor for the BufferRing class.
+ * Allocates every slot up front, so the transfer itself never allocates.
+ * Takes parameters:
+ * - depth: the number of slots, at least 2 so both stages can work at once
+ * - slotSize: the capacity of each slot in bytes
+ * Throws an invalid_argument if depth is below 2 or slotSize is 0.
+ */
+BufferRing::BufferRing(size_t depth, size_t slotSize) : slots(depth) {
+    if (depth < 2 || slotSize == 0) {
+        throw std::invalid_argument("A buffer ring needs at least 2 slots of non-zero size");
+    }
+    for (Slot& slot : slots) {
+        slot.data.resize(slotSize);
+    }
+}
+
+/*
+ * acquire function
+ * Producer side: returns the next slot to fill, waiting while every slot is still queued.
+ * Returns the slot, or nullptr if the ring was aborted.
+ */
+BufferRing::Slot* BufferRing::acquire() {
+    size_t position = head.load(std::memory_order_relaxed);
+    auto hasRoom = [&] {
+        return stopped.load(std::memory_order_seq_cst) ||
+               position - tail.load(std::memory_order_seq_cst) < slots.size();
+    };
+    if (!hasRoom()) {
+        std::unique_lock<std::mutex> lock(mutex);
+        producerWaiting.store(true, std::memory_order_seq_cst);
+        producerWake.wait(lock, hasRoom);
+        producerWaiting.store(false, std::memory_order_relaxed);
+    }
+    if (stopped.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+    Slot* slot = &slots[position % slots.size()];
+    slot->length = 0;
+    return slot;
+}
+
+/*
+ * publish function
+ * Producer side: hands the slot returned by acquire to the consumer.
+ * Returns void.
+ */
+void BufferRing::publish() {
+    head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+    wake(consumerWaiting, consumerWake);
+}
+
+/*
+ * finish function
+ * Producer side: marks the end of the data; the consumer sees it once the queued slots are drained.
+ * Returns void.
+ */
+void BufferRing::finish() {
+    finished.store(true, std::memory_order_seq_cst);
+    wake(consumerWaiting, consumerWake);
+}
+
+/*
+ * next function
+ * Consumer side: returns the oldest published slot, waiting while none is queued.
+ * Returns the slot, or nullptr at the end of the data or if the ring was aborted.
+ */
+BufferRing::Slot* BufferRing::next() {
+    size_t position = tail.load(std::memory_order_relaxed);
+    auto hasData = [&] {
+        return stopped.load(std::memory_order_seq_cst) || head.load(std::memory_order_seq_cst) != position ||
+               finished.load(std::memory_order_seq_cst);
+    };
+    if (!hasData()) {
+        std::unique_lock<std::mutex> lock(mutex);
+        consumerWaiting.store(true, std::memory_order_seq_cst);
+        consumerWake.wait(lock, hasData);
+        consumerWaiting.store(false, std::memory_order_relaxed);
+    }
+    // The producer may finish right after publishing, so queued slots come first
+    if (stopped.load(std::memory_order_acquire) || head.load(std::memory_order_acquire) == position) {
+        return nullptr;
+    }
+    return &slots[position % slots.size()];
+}
+
+/*
+ * release function
+ * Consumer side: returns the slot returned by next to the producer.
+ * Returns void.
+ */
+void BufferRing::release() {
+    tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+    wake(producerWaiting, producerWake);
+}
+
+/*
+ * abort function
+ * Stops the ring from either side; both sides then get nullptr from acquire and next.
+ * Returns void.
+ */
+void BufferRing::abort() {
+    stopped.store(true, std::memory_order_seq_cst);
+    std::lock_guard<std::mutex> lock(mutex);
+    producerWake.notify_one();
+    consumerWake.notify_one();
+}
+
+/*
+ * wake function
+ * Signals the other side if it went to sleep. It sets its flag under the mutex before
+ * checking the indices, so either it sees the update or this sees the flag.
+ * Returns void.
+ */
+void BufferRing::wake(std::atomic<bool>& waiting, std::condition_variable& condition) {
+    if (waiting.load(std::memory_order_seq_cst)) {
+        std::lock_guard<std::mutex> lock(mutex);
+        condition.notify_one();
+    }
+}
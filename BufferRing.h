@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+/*
+ * BufferRing class
+ * A single-producer/single-consumer ring of large preallocated buffers joining the
+ * disk and network stages of a transfer, each running on its own thread.
+ * The producer fills the slot at the head and publishes it, the consumer drains the
+ * slot at the tail and releases it. The indices are atomics each written by one side
+ * only, so handing over a slot takes no lock. A side only blocks when the ring is full
+ * (backpressure on the producer) or empty; then it sleeps on a condition variable the
+ * other side signals only if it sees it waiting.
+ * Either side can abort the ring, which wakes the other with nothing to do.
+ */
+class BufferRing {
+public:
+    struct Slot {
+        std::vector<char> data;
+        size_t length = 0;
+    };
+
+    BufferRing(size_t depth, size_t slotSize);
+
+    BufferRing(const BufferRing&) = delete;
+    BufferRing& operator=(const BufferRing&) = delete;
+
+    Slot* acquire();
+    void publish();
+    void finish();
+    Slot* next();
+    void release();
+    void abort();
+    bool aborted() const { return stopped.load(std::memory_order_acquire); }
+
+private:
+    std::vector<Slot> slots;
+    // Slots published so far, written by the producer only
+    alignas(64) std::atomic<size_t> head{0};
+    // Slots released so far, written by the consumer only
+    alignas(64) std::atomic<size_t> tail{0};
+    alignas(64) std::atomic<bool> finished{false};
+    std::atomic<bool> stopped{false};
+    std::atomic<bool> producerWaiting{false};
+    std::atomic<bool> consumerWaiting{false};
+    std::mutex mutex;
+    std::condition_variable producerWake;
+    std::condition_variable consumerWake;
+
+    void wake(std::atomic<bool>& waiting, std::condition_variable& condition);
+};
@@ -0,0 +1,189 @@
+#include "Chunker.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+// Where the chunk manifests of uploaded files are kept
+const std::string MANIFEST_FOLDER = ".ftpstate/manifests";
+// Size of the reads while chunking a file
+const size_t CHUNK_READ_SIZE = 1024 * 1024;
+
+// Below the average size a cut needs more zero bits, above it fewer (normalized chunking)
+const uint64_t MASK_SMALL = ~0ULL << (64 - 18);
+const uint64_t MASK_LARGE = ~0ULL << (64 - 14);
+
+/*
+ * gearTable function
+ * Returns the table of 256 pseudo-random values fed into the gear hash.
+ * The table is generated with splitmix64 from a fixed seed so chunk boundaries
+ * are stable across runs and machines.
+ */
+static const uint64_t* gearTable() {
+    static const struct Table {
+        uint64_t values[256];
+        Table() {
+            uint64_t state = 0x9E3779B97F4A7C15ULL;
+            for (uint64_t& value : values) {
+                state += 0x9E3779B97F4A7C15ULL;
+                uint64_t z = state;
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+                value = z ^ (z >> 31);
+            }
+        }
+    } table;
+    return table.values;
+}
+
+/*
+ * split function
+ * Splits a file into content-defined chunks.
+ * Takes a string parameter path representing the file to split.
+ * Throws a runtime_error if the file cannot be read.
+ * Returns the manifest holding the file size and its chunks.
+ * The function streams the file once, rolling the gear hash and the
+ * FNV-1a chunk hash over every byte, and cuts a chunk when the top bits of the
+ * gear hash are zero or the chunk reached its maximum size.
+ */
+ChunkManifest Chunker::split(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open file for chunking: " + path);
+    }
+
+    const uint64_t* gear = gearTable();
+    ChunkManifest manifest;
+    std::vector<unsigned char> buffer(CHUNK_READ_SIZE);
+
+    Chunk current;
+    uint64_t fingerprint = 0;
+    current.hash = 14695981039346656037ULL;
+
+    ssize_t bytesRead;
+    while ((bytesRead = read(fd, buffer.data(), buffer.size())) > 0) {
+        for (ssize_t i = 0; i < bytesRead; ++i) {
+            unsigned char byte = buffer[i];
+            fingerprint = (fingerprint << 1) + gear[byte];
+            current.hash = (current.hash ^ byte) * 1099511628211ULL;
+            ++current.length;
+
+            if (current.length < MIN_CHUNK) {
+                continue;
+            }
+            uint64_t mask = current.length < AVG_CHUNK ? MASK_SMALL : MASK_LARGE;
+            if ((fingerprint & mask) == 0 || current.length >= MAX_CHUNK) {
+                manifest.chunks.push_back(current);
+                current.offset += current.length;
+                current.length = 0;
+                current.hash = 14695981039346656037ULL;
+                fingerprint = 0;
+            }
+        }
+    }
+    close(fd);
+
+    if (bytesRead < 0) {
+        throw std::runtime_error("Failed to read file for chunking: " + path);
+    }
+
+    // Whatever is left forms the last chunk
+    if (current.length > 0) {
+        manifest.chunks.push_back(current);
+    }
+    manifest.fileSize = current.offset + current.length;
+    return manifest;
+}
+
+/*
+ * manifestPath function
+ * Maps the location of an uploaded file to the local file holding its manifest.
+ * Takes a string parameter location representing the server and path of the uploaded file.
+ * Returns the path of the manifest file.
+ */
+std::string Chunker::manifestPath(const std::string& location) {
+    // Flatten the location into a single file name
+    std::string name;
+    for (char c : location) {
+        if (c == '/' || c == '%') {
+            name += (c == '/') ? "%2F" : "%25";
+        } else {
+            name += c;
+        }
+    }
+    return MANIFEST_FOLDER + "/" + name;
+}
+
+/*
+ * loadManifest function
+ * Loads the manifest recorded for a file by its last upload.
+ * Takes parameters:
+ * - location: the server and path of the uploaded file
+ * - manifest: receives the loaded manifest
+ * Returns true if a valid manifest was found, false otherwise.
+ * A manifest is only valid if its chunks cover the file size exactly, one after the other,
+ * so a damaged file never reaches the comparison.
+ */
+bool Chunker::loadManifest(const std::string& location, ChunkManifest& manifest) {
+    std::ifstream file(manifestPath(location), std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    uint64_t count = 0;
+    file.read(reinterpret_cast<char*>(&manifest.fileSize), sizeof(manifest.fileSize));
+    file.read(reinterpret_cast<char*>(&manifest.remoteModified), sizeof(manifest.remoteModified));
+    file.read(reinterpret_cast<char*>(&count), sizeof(count));
+    // Every chunk but the last holds at least MIN_CHUNK bytes, which bounds the count
+    if (!file || count > manifest.fileSize / MIN_CHUNK + 1) {
+        return false;
+    }
+
+    manifest.chunks.resize(count);
+    file.read(reinterpret_cast<char*>(manifest.chunks.data()), static_cast<std::streamsize>(count * sizeof(Chunk)));
+    if (!file) {
+        return false;
+    }
+
+    uint64_t end = 0;
+    for (const Chunk& chunk : manifest.chunks) {
+        if (chunk.offset != end || chunk.length == 0 || chunk.length > MAX_CHUNK) {
+            return false;
+        }
+        end += chunk.length;
+    }
+    return end == manifest.fileSize;
+}
+
+/*
+ * saveManifest function
+ * Records the manifest of a file that was just uploaded.
+ * Takes parameters:
+ * - location: the server and path of the uploaded file
+ * - manifest: the manifest of the uploaded contents
+ * Throws a runtime_error if the manifest cannot be written.
+ * Returns void.
+ */
+void Chunker::saveManifest(const std::string& location, const ChunkManifest& manifest) {
+    std::filesystem::create_directories(MANIFEST_FOLDER);
+
+    std::string path = manifestPath(location);
+    std::string tempPath = path + ".tmp";
+    std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to write manifest: " + tempPath);
+    }
+
+    uint64_t count = manifest.chunks.size();
+    file.write(reinterpret_cast<const char*>(&manifest.fileSize), sizeof(manifest.fileSize));
+    file.write(reinterpret_cast<const char*>(&manifest.remoteModified), sizeof(manifest.remoteModified));
+    file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    file.write(reinterpret_cast<const char*>(manifest.chunks.data()), static_cast<std::streamsize>(count * sizeof(Chunk)));
+    file.close();
+    if (!file) {
+        throw std::runtime_error("Failed to write manifest: " + tempPath);
+    }
+
+    std::filesystem::rename(tempPath, path);
+}
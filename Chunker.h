@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Chunk structure
+ * A content-defined chunk of a file: its byte range and a hash of its contents.
+ */
+struct Chunk {
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    uint64_t hash = 0;
+};
+
+/*
+ * ChunkManifest structure
+ * The chunk list of a file as it was last uploaded, kept locally per server and remote path,
+ * with the modification time the server reported for it afterwards (0 if it reports none).
+ */
+struct ChunkManifest {
+    uint64_t fileSize = 0;
+    int64_t remoteModified = 0;
+    std::vector<Chunk> chunks;
+};
+
+/*
+ * Chunker class
+ * Splits files into content-defined chunks using the FastCDC gear rolling hash,
+ * so an edit only changes the chunks around it instead of every chunk after it.
+ * Also loads and stores the manifests used by delta uploads.
+ */
+class Chunker {
+public:
+    static constexpr uint64_t MIN_CHUNK = 16 * 1024;
+    static constexpr uint64_t AVG_CHUNK = 64 * 1024;
+    static constexpr uint64_t MAX_CHUNK = 256 * 1024;
+
+    static ChunkManifest split(const std::string& path);
+
+    static bool loadManifest(const std::string& location, ChunkManifest& manifest);
+    static void saveManifest(const std::string& location, const ChunkManifest& manifest);
+
+private:
+    static std::string manifestPath(const std::string& location);
+};
@@ -0,0 +1,236 @@
+#include "DirectWriter.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+/*
+ * Constructor for the DirectWriter class.
+ * Creates the destination, preallocates it when the size is known and starts the writer thread.
+ * Takes parameters:
+ * - path: the file to write
+ * - expectedSize: the final size of the file, or a negative value if unknown
+ * Throws a runtime_error if the file cannot be created or buffers cannot be allocated.
+ */
+DirectWriter::DirectWriter(const std::string& path, int64_t expectedSize) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+    fd = open(path.c_str(), flags | O_DIRECT, 0644);
+    direct = fd >= 0;
+    if (fd < 0 && errno == EINVAL) {
+        // The filesystem does not support O_DIRECT (tmpfs, some network filesystems)
+        fd = open(path.c_str(), flags, 0644);
+    }
+#else
+    fd = open(path.c_str(), flags, 0644);
+#ifdef F_NOCACHE
+    direct = fd >= 0 && fcntl(fd, F_NOCACHE, 1) == 0;
+#endif
+#endif
+    if (fd < 0) {
+        throw std::runtime_error("Failed to create file: " + path + ": " + std::string(strerror(errno)));
+    }
+
+#ifdef __linux__
+    // Reserve the whole file up front so it is laid out in few extents
+    if (expectedSize > 0) {
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, expectedSize);
+    }
+#else
+    (void)expectedSize;
+#endif
+
+    buffers.resize(BUFFER_COUNT);
+    for (Buffer& buffer : buffers) {
+        void* memory = nullptr;
+        if (posix_memalign(&memory, ALIGNMENT, BUFFER_SIZE) != 0) {
+            for (Buffer& allocated : buffers) {
+                free(allocated.data);
+            }
+            close(fd);
+            throw std::runtime_error("Failed to allocate aligned buffers");
+        }
+        buffer.data = static_cast<char*>(memory);
+        freeBuffers.push_back(&buffer);
+    }
+
+    current = freeBuffers.front();
+    freeBuffers.pop_front();
+    writer = std::thread(&DirectWriter::writerLoop, this);
+}
+
+/*
+ * Destructor for the DirectWriter class.
+ * Stops the writer thread and releases the buffers and the file.
+ */
+DirectWriter::~DirectWriter() {
+    stop();
+    for (Buffer& buffer : buffers) {
+        free(buffer.data);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/*
+ * buffer function
+ * Returns where the next received bytes should be placed.
+ */
+char* DirectWriter::buffer() {
+    return current->data + current->used;
+}
+
+/*
+ * space function
+ * Returns how many bytes fit at buffer().
+ */
+size_t DirectWriter::space() const {
+    return BUFFER_SIZE - current->used;
+}
+
+/*
+ * commit function
+ * Accounts for bytes received into buffer(), queuing the buffer for writing once it is full.
+ * Takes a parameter length representing the number of bytes received.
+ * Throws a runtime_error if an earlier write failed.
+ * Returns void.
+ */
+void DirectWriter::commit(size_t length) {
+    current->used += length;
+    if (current->used == BUFFER_SIZE) {
+        submit(current, BUFFER_SIZE);
+        current = acquire();
+    }
+}
+
+/*
+ * submit function
+ * Queues a buffer for the writer thread at the next file offset.
+ * Returns void.
+ */
+void DirectWriter::submit(Buffer* buffer, size_t writeLength) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!error.empty()) {
+        throw std::runtime_error(error);
+    }
+    buffer->offset = nextOffset;
+    buffer->writeLength = writeLength;
+    nextOffset += buffer->used;
+    fullBuffers.push_back(buffer);
+    changed.notify_all();
+}
+
+/*
+ * acquire function
+ * Takes a free buffer, waiting for the writer thread to release one if needed.
+ * Throws a runtime_error if an earlier write failed.
+ * Returns the buffer to fill next.
+ */
+DirectWriter::Buffer* DirectWriter::acquire() {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this] { return !freeBuffers.empty() || !error.empty(); });
+    if (!error.empty()) {
+        throw std::runtime_error(error);
+    }
+    Buffer* buffer = freeBuffers.front();
+    freeBuffers.pop_front();
+    buffer->used = 0;
+    return buffer;
+}
+
+/*
+ * writerLoop function
+ * Body of the writer thread, writes queued buffers at their offsets.
+ * Without O_DIRECT the written range is dropped from the page cache right away.
+ * Returns void.
+ */
+void DirectWriter::writerLoop() {
+    while (true) {
+        Buffer* buffer;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] { return !fullBuffers.empty() || closing; });
+            if (fullBuffers.empty()) {
+                return;
+            }
+            buffer = fullBuffers.front();
+            fullBuffers.pop_front();
+            ++writing;
+        }
+
+        size_t written = 0;
+        bool ok = true;
+        while (written < buffer->writeLength) {
+            ssize_t n = pwrite(fd, buffer->data + written, buffer->writeLength - written,
+                               static_cast<off_t>(buffer->offset + written));
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ok = false;
+                break;
+            }
+            written += n;
+        }
+
+#ifdef POSIX_FADV_DONTNEED
+        if (ok && !direct) {
+            posix_fadvise(fd, static_cast<off_t>(buffer->offset), static_cast<off_t>(written), POSIX_FADV_DONTNEED);
+        }
+#endif
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!ok && error.empty()) {
+            error = "Failed to write file data: " + std::string(strerror(errno));
+        }
+        --writing;
+        freeBuffers.push_back(buffer);
+        changed.notify_all();
+    }
+}
+
+/*
+ * stop function
+ * Lets the writer thread drain its queue and waits for it to exit.
+ * Returns void.
+ */
+void DirectWriter::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+    }
+    changed.notify_all();
+    if (writer.joinable()) {
+        writer.join();
+    }
+}
+
+/*
+ * finish function
+ * Writes the last, partially filled buffer and completes the file.
+ * The tail is zero-padded to the alignment for the direct write and
+ * the file is then truncated to the number of bytes actually received.
+ * Throws a runtime_error if any write failed.
+ * Returns void.
+ */
+void DirectWriter::finish() {
+    if (current->used > 0) {
+        size_t padded = (current->used + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        std::memset(current->data + current->used, 0, padded - current->used);
+        submit(current, padded);
+        current = nullptr;
+    }
+    stop();
+
+    if (!error.empty()) {
+        throw std::runtime_error(error);
+    }
+    if (ftruncate(fd, static_cast<off_t>(nextOffset)) < 0) {
+        throw std::runtime_error("Failed to truncate file: " + std::string(strerror(errno)));
+    }
+    close(fd);
+    fd = -1;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * DirectWriter class
+ * Writes a download to disk bypassing the page cache (O_DIRECT, F_NOCACHE on macOS).
+ * Data is received straight into a pool of page-aligned buffers; a full buffer is
+ * handed to a writer thread while the next one is being filled, so disk and
+ * network overlap. The unaligned tail is padded to the alignment and the file
+ * is truncated back to its real length when it is finished.
+ * Filesystems that refuse O_DIRECT get buffered writes that are dropped from
+ * the page cache as soon as they are written.
+ */
+class DirectWriter {
+public:
+    static constexpr size_t ALIGNMENT = 4096;
+    static constexpr size_t BUFFER_SIZE = 1024 * 1024;
+    static constexpr unsigned BUFFER_COUNT = 4;
+
+    DirectWriter(const std::string& path, int64_t expectedSize);
+    ~DirectWriter();
+
+    char* buffer();
+    size_t space() const;
+    void commit(size_t length);
+    void finish();
+
+    bool bypassesCache() const { return direct; }
+
+private:
+    struct Buffer {
+        char* data = nullptr;
+        size_t used = 0;
+        size_t writeLength = 0;
+        uint64_t offset = 0;
+    };
+
+    int fd = -1;
+    bool direct = false;
+    uint64_t nextOffset = 0;
+    std::vector<Buffer> buffers;
+    Buffer* current = nullptr;
+
+    std::deque<Buffer*> freeBuffers;
+    std::deque<Buffer*> fullBuffers;
+    size_t writing = 0;
+    bool closing = false;
+    std::string error;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::thread writer;
+
+    void submit(Buffer* buffer, size_t writeLength);
+    Buffer* acquire();
+    void writerLoop();
+    void stop();
+};
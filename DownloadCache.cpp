@@ -0,0 +1,442 @@
+#include "DownloadCache.h"
+#include "DriveIndex.h"
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+// Size of the reads while copying an object where it can be neither cloned nor linked
+const size_t COPY_BUFFER_SIZE = 1024 * 1024;
+// Eviction frees the cache down to this share of its budget, so the objects are listed rarely
+const double EVICTION_TARGET = 0.9;
+
+/*
+ * hashName function
+ * Returns the 64-bit FNV-1a hash of a string as 16 hex digits, to name entries after
+ * sources of any length or character set.
+ */
+static std::string hashName(const std::string& text) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+    return name;
+}
+
+/*
+ * Constructor for the DownloadCache class.
+ * Takes parameters:
+ * - root: the cache directory, created if missing
+ * - budgetBytes: how many bytes of objects are kept before the least recently used are evicted
+ * Throws a runtime_error if the directory cannot be created.
+ */
+DownloadCache::DownloadCache(const std::string& root, uint64_t budgetBytes) : root(root), budgetBytes(budgetBytes) {
+    std::error_code error;
+    std::filesystem::create_directories(root + "/objects", error);
+    std::filesystem::create_directories(root + "/entries", error);
+    if (error) {
+        throw std::runtime_error("Failed to create download cache " + root + ": " + error.message());
+    }
+}
+
+/*
+ * fetch function
+ * Serves a file from the cache if its entry matches what the server reports for it now.
+ * Takes parameters:
+ * - source: the server and remote path the file was downloaded from
+ * - size: the size of the remote file (SIZE)
+ * - modified: the modification time of the remote file (MDTM)
+ * - localPath: where the file is wanted
+ * Returns true if the file was served, false on a miss; then it has to be downloaded.
+ */
+bool DownloadCache::fetch(const std::string& source, int64_t size, time_t modified, const std::string& localPath) {
+    int lockFd = lock(LOCK_SH);
+    if (lockFd < 0) {
+        ++misses;
+        return false;
+    }
+
+    bool served = false;
+    std::string path = entryPath(source);
+    std::ifstream entry(path);
+    std::string entrySource;
+    int64_t entrySize = -1;
+    long long entryModified = 0;
+    unsigned long long hash = 0;
+    if (std::getline(entry, entrySource) && entrySource == source &&
+        entry >> entrySize >> entryModified >> std::hex >> hash && entrySize == size && entryModified == modified) {
+        std::string object = objectPath(hash, size);
+        struct stat objectStat = {};
+        if (stat(object.c_str(), &objectStat) != 0 || objectStat.st_size != size) {
+            // Evicted, or changed through a hard link: the entry is of no use anymore
+            unlink(path.c_str());
+        } else {
+            std::string tempPath = temporaryPath(localPath);
+            // A clone or a copy is a file of its own and gets the remote modification time
+            bool linked = false;
+            bool copied = cloneFile(object, tempPath);
+            if (!copied) {
+                linked = linkFile(object, tempPath);
+                copied = !linked && copyFile(object, tempPath);
+            }
+            if (copied) {
+                timespec times[2] = {{modified, 0}, {modified, 0}};
+                utimensat(AT_FDCWD, tempPath.c_str(), times, 0);
+            }
+            if ((copied || linked) && rename(tempPath.c_str(), localPath.c_str()) == 0) {
+                served = true;
+                // Renaming a link over the same inode does nothing and leaves the temporary name
+                unlink(tempPath.c_str());
+                timespec used[2] = {{0, UTIME_NOW}, {0, UTIME_OMIT}};
+                utimensat(AT_FDCWD, object.c_str(), used, 0);
+            } else {
+                unlink(tempPath.c_str());
+            }
+        }
+    }
+    close(lockFd);
+
+    if (served) {
+        ++hits;
+        bytesSaved += static_cast<uint64_t>(size);
+    } else {
+        ++misses;
+    }
+    return served;
+}
+
+/*
+ * store function
+ * Adds a freshly downloaded file to the cache, then evicts objects beyond the budget.
+ * A file whose contents are cached already only gets an entry pointing to that object.
+ * The cache is only a cache: failures leave it without the file and are not reported.
+ * Takes parameters:
+ * - source: the server and remote path the file was downloaded from
+ * - size: the size of the remote file
+ * - modified: the modification time of the remote file
+ * - localPath: the downloaded file
+ * Returns void.
+ */
+void DownloadCache::store(const std::string& source, int64_t size, time_t modified, const std::string& localPath) {
+    if (size < 0 || static_cast<uint64_t>(size) > budgetBytes) {
+        return;
+    }
+    uint64_t hash;
+    try {
+        hash = DriveIndex::hashFile(localPath);
+    } catch (const std::exception&) {
+        return;
+    }
+
+    int lockFd = lock(LOCK_SH);
+    if (lockFd < 0) {
+        return;
+    }
+    std::string object = objectPath(hash, size);
+    struct stat objectStat = {};
+    bool present = stat(object.c_str(), &objectStat) == 0 && objectStat.st_size == size;
+    bool added = false;
+    if (present) {
+        timespec used[2] = {{0, UTIME_NOW}, {0, UTIME_OMIT}};
+        utimensat(AT_FDCWD, object.c_str(), used, 0);
+    } else {
+        std::error_code error;
+        std::filesystem::create_directories(std::filesystem::path(object).parent_path(), error);
+        std::string tempPath = temporaryPath(object);
+        if (cloneFile(localPath, tempPath) || linkFile(localPath, tempPath) || copyFile(localPath, tempPath)) {
+            present = added = rename(tempPath.c_str(), object.c_str()) == 0;
+        }
+        unlink(tempPath.c_str());
+    }
+
+    if (present) {
+        char fields[64];
+        snprintf(fields, sizeof(fields), "%lld %lld %llx\n", static_cast<long long>(size),
+                 static_cast<long long>(modified), static_cast<unsigned long long>(hash));
+        std::string entry = source + "\n" + fields;
+        std::string path = entryPath(source);
+        std::string tempPath = temporaryPath(path);
+        int entryFd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        bool written = entryFd >= 0 && write(entryFd, entry.data(), entry.size()) == static_cast<ssize_t>(entry.size());
+        if (entryFd >= 0) {
+            written = close(entryFd) == 0 && written;
+        }
+        if (!written || rename(tempPath.c_str(), path.c_str()) != 0) {
+            unlink(tempPath.c_str());
+        }
+    }
+    close(lockFd);
+
+    if (added) {
+        ++stored;
+        account(static_cast<uint64_t>(size));
+    }
+}
+
+/*
+ * stats function
+ * Returns the counts of this process since start.
+ */
+DownloadCache::Stats DownloadCache::stats() const {
+    Stats current;
+    current.hits = hits.load();
+    current.misses = misses.load();
+    current.bytesSaved = bytesSaved.load();
+    current.stored = stored.load();
+    current.evicted = evicted.load();
+    return current;
+}
+
+/*
+ * printStats function
+ * Prints the hit rate and the bytes the cache saved from being downloaded.
+ * Returns void.
+ */
+void DownloadCache::printStats(std::ostream& out) const {
+    Stats current = stats();
+    uint64_t lookups = current.hits + current.misses;
+    out << "[cache] hits=" << current.hits << " misses=" << current.misses << " ("
+        << (lookups ? 100.0 * static_cast<double>(current.hits) / static_cast<double>(lookups) : 0.0)
+        << "% hit rate) bytes_saved=" << current.bytesSaved << " stored=" << current.stored
+        << " evicted=" << current.evicted << std::endl;
+}
+
+/*
+ * detach function
+ * Removes a local file that is a hard link, so writing a new download there creates a
+ * new file instead of changing the object it was served from.
+ * Takes a string parameter localPath representing the file about to be written.
+ * Returns void.
+ */
+void DownloadCache::detach(const std::string& localPath) {
+    struct stat localStat = {};
+    if (lstat(localPath.c_str(), &localStat) == 0 && S_ISREG(localStat.st_mode) && localStat.st_nlink > 1) {
+        unlink(localPath.c_str());
+    }
+}
+
+/*
+ * entryPath function
+ * Returns the file holding the entry of a source, named after its hash; the entry
+ * repeats the source, so a hash collision reads as a miss.
+ */
+std::string DownloadCache::entryPath(const std::string& source) const {
+    return root + "/entries/" + hashName(source);
+}
+
+/*
+ * objectPath function
+ * Returns the file holding the contents with a given hash and size, in one of 256
+ * directories so none grows too large.
+ */
+std::string DownloadCache::objectPath(uint64_t hash, int64_t size) const {
+    char name[64];
+    snprintf(name, sizeof(name), "%02x/%016llx-%lld", static_cast<unsigned>(hash >> 56),
+             static_cast<unsigned long long>(hash), static_cast<long long>(size));
+    return root + "/objects/" + name;
+}
+
+/*
+ * temporaryPath function
+ * Returns a hidden name next to a path, unique across threads and processes, to write
+ * a file under before renaming it into place.
+ */
+std::string DownloadCache::temporaryPath(const std::string& path) const {
+    static std::atomic<uint64_t> counter{0};
+    std::filesystem::path target(path);
+    std::string name = "." + target.filename().string() + "." + std::to_string(getpid()) + "." +
+                       std::to_string(counter++) + ".tmp";
+    return (target.parent_path() / name).string();
+}
+
+/*
+ * lock function
+ * Takes the lock of the cache directory, shared or exclusive.
+ * Takes a parameter operation: LOCK_SH or LOCK_EX.
+ * Returns the descriptor holding the lock, to be closed to release it, or -1 on failure.
+ */
+int DownloadCache::lock(int operation) const {
+    int fd = open((root + "/lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    while (flock(fd, operation) != 0) {
+        if (errno != EINTR) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/*
+ * account function
+ * Adds a new object to the total size of the objects and evicts objects if it passed the budget.
+ * The total is kept in the usage file, rewritten in place under a lock of its own: a process
+ * waiting for the exclusive lock of the directory would wait for every shared holder, so
+ * only eviction takes it.
+ * An empty usage file, in a new cache, is filled in by listing the objects.
+ * Takes a parameter addedBytes representing the size of the new object.
+ * Returns void.
+ */
+void DownloadCache::account(uint64_t addedBytes) {
+    int usageFd = open((root + "/usage").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (usageFd < 0) {
+        return;
+    }
+    while (flock(usageFd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            close(usageFd);
+            return;
+        }
+    }
+    char usageText[32] = {};
+    char* end = usageText;
+    unsigned long long usage = 0;
+    if (pread(usageFd, usageText, sizeof(usageText) - 1, 0) > 0) {
+        usage = strtoull(usageText, &end, 10);
+    }
+
+    usage += addedBytes;
+    if (end == usageText || usage > budgetBytes) {
+        int lockFd = lock(LOCK_EX);
+        if (lockFd >= 0) {
+            usage = evict(static_cast<uint64_t>(static_cast<double>(budgetBytes) * EVICTION_TARGET));
+            close(lockFd);
+        }
+    }
+    // Fixed width, so the old value is always overwritten whole; if this fails, the next eviction corrects it
+    snprintf(usageText, sizeof(usageText), "%020llu\n", usage);
+    pwrite(usageFd, usageText, strlen(usageText), 0);
+    close(usageFd);
+}
+
+/*
+ * evict function
+ * Lists the objects and removes the least recently used until the rest fit a target size.
+ * Entries of removed objects stay and are dropped by the next fetch that finds them.
+ * Must be called with the exclusive lock held.
+ * Takes a parameter targetBytes representing the size the objects may keep.
+ * Returns the total size of the objects left.
+ */
+uint64_t DownloadCache::evict(uint64_t targetBytes) {
+    struct Object {
+        std::string path;
+        uint64_t size;
+        timespec used;
+    };
+
+    std::vector<Object> objects;
+    uint64_t total = 0;
+    std::error_code error;
+    for (auto it = std::filesystem::recursive_directory_iterator(root + "/objects", error);
+         !error && it != std::filesystem::recursive_directory_iterator(); it.increment(error)) {
+        struct stat objectStat = {};
+        std::string path = it->path().string();
+        if (it->path().filename().string()[0] == '.' || lstat(path.c_str(), &objectStat) != 0 ||
+            !S_ISREG(objectStat.st_mode)) {
+            continue;
+        }
+        objects.push_back({path, static_cast<uint64_t>(objectStat.st_size), objectStat.st_atim});
+        total += static_cast<uint64_t>(objectStat.st_size);
+    }
+
+    if (total > budgetBytes) {
+        std::sort(objects.begin(), objects.end(), [](const Object& a, const Object& b) {
+            return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec;
+        });
+        for (const Object& object : objects) {
+            if (total <= targetBytes) {
+                break;
+            }
+            if (unlink(object.path.c_str()) == 0) {
+                total -= object.size;
+                ++evicted;
+            }
+        }
+    }
+    return total;
+}
+
+/*
+ * cloneFile function
+ * Creates a file sharing the extents of another (a reflink), where the file system supports it.
+ * Returns true on success.
+ */
+bool DownloadCache::cloneFile(const std::string& from, const std::string& to) {
+#ifdef FICLONE
+    int fromFd = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fromFd < 0) {
+        return false;
+    }
+    int toFd = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    bool cloned = toFd >= 0 && ioctl(toFd, FICLONE, fromFd) == 0;
+    if (toFd >= 0) {
+        close(toFd);
+        if (!cloned) {
+            unlink(to.c_str());
+        }
+    }
+    close(fromFd);
+    return cloned;
+#else
+    (void)from;
+    (void)to;
+    return false;
+#endif
+}
+
+/*
+ * linkFile function
+ * Creates a hard link to a file, which fails across file systems.
+ * Returns true on success.
+ */
+bool DownloadCache::linkFile(const std::string& from, const std::string& to) {
+    return link(from.c_str(), to.c_str()) == 0;
+}
+
+/*
+ * copyFile function
+ * Copies a file, the last resort when it can be neither cloned nor linked.
+ * Returns true on success.
+ */
+bool DownloadCache::copyFile(const std::string& from, const std::string& to) {
+    int fromFd = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fromFd < 0) {
+        return false;
+    }
+    int toFd = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (toFd < 0) {
+        close(fromFd);
+        return false;
+    }
+    bool ok = true;
+    std::vector<char> buffer(COPY_BUFFER_SIZE);
+    ssize_t bytesRead = 0;
+    while (ok && (bytesRead = read(fromFd, buffer.data(), buffer.size())) > 0) {
+        ok = write(toFd, buffer.data(), bytesRead) == bytesRead;
+    }
+    ok = ok && bytesRead == 0;
+    close(fromFd);
+    if (close(toFd) != 0 || !ok) {
+        unlink(to.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <ostream>
+#include <string>
+
+/*
+ * DownloadCache class
+ * A local, content-addressed cache of downloaded files, shared by every process that
+ * uses the same cache directory.
+ * Each file is stored once as an object named after a hash of its contents. An entry per
+ * server and remote path records the size and modification time the file had on the
+ * server and the object holding its contents, so a file whose SIZE and MDTM still match
+ * is served without a transfer, and identical files reached by different paths or
+ * servers share one object.
+ * A file is served by a reflink of the object where the file system supports it, else
+ * by a hard link, else by a copy. A hard link shares the object's inode, so downloads
+ * replace such a file instead of writing into it, see detach.
+ * Objects are evicted least recently used first once they exceed the size budget; their
+ * access time records the last use. A usage file keeps the total size of the objects, so
+ * the objects are only listed when it passes the budget, and eviction then frees some
+ * room beyond it so that happens rarely. Processes share the directory through flock:
+ * serving and storing take a shared lock, eviction an exclusive one, so an object is
+ * never removed while another process links it. Objects and
+ * entries are written under temporary names and renamed into place, so readers never
+ * see them half written.
+ */
+class DownloadCache {
+public:
+    // Counts since start, for this process
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t bytesSaved = 0;
+        uint64_t stored = 0;
+        uint64_t evicted = 0;
+    };
+
+    DownloadCache(const std::string& root, uint64_t budgetBytes);
+
+    DownloadCache(const DownloadCache&) = delete;
+    DownloadCache& operator=(const DownloadCache&) = delete;
+
+    bool fetch(const std::string& source, int64_t size, time_t modified, const std::string& localPath);
+    void store(const std::string& source, int64_t size, time_t modified, const std::string& localPath);
+    Stats stats() const;
+    void printStats(std::ostream& out) const;
+
+    static void detach(const std::string& localPath);
+
+private:
+    std::string root;
+    uint64_t budgetBytes;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> bytesSaved{0};
+    std::atomic<uint64_t> stored{0};
+    std::atomic<uint64_t> evicted{0};
+
+    std::string entryPath(const std::string& source) const;
+    std::string objectPath(uint64_t hash, int64_t size) const;
+    std::string temporaryPath(const std::string& path) const;
+    int lock(int operation) const;
+    void account(uint64_t addedBytes);
+    uint64_t evict(uint64_t targetBytes);
+    static bool cloneFile(const std::string& from, const std::string& to);
+    static bool linkFile(const std::string& from, const std::string& to);
+    static bool copyFile(const std::string& from, const std::string& to);
+};
@@ -0,0 +1,454 @@
+#include "DriveIndex.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+// Identifies the on-disk index format
+const char INDEX_MAGIC[8] = {'F', 'T', 'P', 'I', 'D', 'X', '0', '1'};
+// Size of the chunks read while hashing a file
+const size_t HASH_BUFFER_SIZE = 65536;
+
+/*
+ * Constructor for the DriveIndex class.
+ * Takes parameters:
+ * - root: the directory whose contents are indexed
+ * - indexPath: the file the index is persisted to
+ */
+DriveIndex::DriveIndex(const std::string& root, const std::string& indexPath) : root(root), indexPath(indexPath) {}
+
+/*
+ * Destructor for the DriveIndex class.
+ * Stops the watcher thread and persists any pending changes.
+ */
+DriveIndex::~DriveIndex() {
+    stopWatching();
+    try {
+        save();
+    } catch (const std::exception&) {
+        // The index is only a cache, losing it costs a rescan
+    }
+}
+
+/*
+ * hashFile function
+ * Computes the 64-bit FNV-1a hash of a file's contents.
+ * Takes a string parameter path representing the file to hash.
+ * Throws a runtime_error if the file cannot be read.
+ * Returns the hash value.
+ */
+uint64_t DriveIndex::hashFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open file for hashing: " + path);
+    }
+
+    uint64_t hash = 14695981039346656037ULL;
+    std::vector<unsigned char> buffer(HASH_BUFFER_SIZE);
+    ssize_t bytesRead;
+    while ((bytesRead = read(fd, buffer.data(), buffer.size())) > 0) {
+        for (ssize_t i = 0; i < bytesRead; ++i) {
+            hash ^= buffer[i];
+            hash *= 1099511628211ULL;
+        }
+    }
+    close(fd);
+
+    if (bytesRead < 0) {
+        throw std::runtime_error("Failed to read file for hashing: " + path);
+    }
+    return hash;
+}
+
+/*
+ * load function
+ * Loads the index from disk by memory-mapping the index file.
+ * A missing or unreadable index is treated as empty, which forces a full scan.
+ * Returns void.
+ */
+void DriveIndex::load() {
+    int fd = open(indexPath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat st = {};
+    if (fstat(fd, &st) < 0 || st.st_size < static_cast<off_t>(sizeof(INDEX_MAGIC) + sizeof(uint64_t))) {
+        close(fd);
+        return;
+    }
+
+    size_t length = static_cast<size_t>(st.st_size);
+    void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return;
+    }
+
+    const char* data = static_cast<const char*>(mapped);
+    const char* end = data + length;
+    if (std::memcmp(data, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0) {
+        munmap(mapped, length);
+        return;
+    }
+
+    // Each record is the fixed-size entry followed by the length-prefixed path
+    const char* cursor = data + sizeof(INDEX_MAGIC);
+    uint64_t count;
+    std::memcpy(&count, cursor, sizeof(count));
+    cursor += sizeof(count);
+
+    // The count comes from disk, so reserve no more records than the file can hold
+    const size_t minRecord = sizeof(DriveEntry) + sizeof(uint32_t);
+    std::unordered_map<std::string, DriveEntry> loaded;
+    loaded.reserve(std::min<uint64_t>(count, static_cast<uint64_t>(end - cursor) / minRecord));
+    for (uint64_t i = 0; i < count; ++i) {
+        DriveEntry entry;
+        uint32_t pathLength;
+        if (end - cursor < static_cast<ptrdiff_t>(sizeof(entry) + sizeof(pathLength))) {
+            break;
+        }
+        std::memcpy(&entry, cursor, sizeof(entry));
+        cursor += sizeof(entry);
+        std::memcpy(&pathLength, cursor, sizeof(pathLength));
+        cursor += sizeof(pathLength);
+        if (end - cursor < static_cast<ptrdiff_t>(pathLength)) {
+            break;
+        }
+        loaded.emplace(std::string(cursor, pathLength), entry);
+        cursor += pathLength;
+    }
+    munmap(mapped, length);
+
+    entries.swap(loaded);
+}
+
+/*
+ * save function
+ * Writes the index to disk if it changed since it was loaded.
+ * The index is written to a temporary file which then replaces the old one,
+ * so a crash never leaves a truncated index behind.
+ * Throws a runtime_error if the index cannot be written.
+ * Returns void.
+ */
+void DriveIndex::save() {
+    if (!modified) {
+        return;
+    }
+
+    std::filesystem::path target(indexPath);
+    if (target.has_parent_path()) {
+        std::filesystem::create_directories(target.parent_path());
+    }
+
+    std::string tempPath = indexPath + ".tmp";
+    std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to write index: " + tempPath);
+    }
+
+    uint64_t count = entries.size();
+    file.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    for (const auto& [path, entry] : entries) {
+        uint32_t pathLength = static_cast<uint32_t>(path.size());
+        file.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+        file.write(reinterpret_cast<const char*>(&pathLength), sizeof(pathLength));
+        file.write(path.data(), pathLength);
+    }
+    file.close();
+    if (!file) {
+        throw std::runtime_error("Failed to write index: " + tempPath);
+    }
+
+    std::filesystem::rename(tempPath, indexPath);
+    modified = false;
+}
+
+/*
+ * examine function
+ * Compares a file on disk against its indexed state.
+ * The content hash is only computed when size, mtime or inode differ,
+ * and a file whose hash still matches just has its metadata refreshed.
+ * Files whose content changed are recorded as pending until they are marked synced.
+ * Takes a string parameter path representing the path relative to the root.
+ * Returns void.
+ */
+void DriveIndex::examine(const std::string& path) {
+    std::string fullPath = root + "/" + path;
+
+    struct stat st = {};
+    if (stat(fullPath.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
+        // The file is gone, forget about it
+        if (entries.erase(path) > 0) {
+            modified = true;
+        }
+        pending.erase(path);
+        return;
+    }
+
+    DriveEntry current;
+    current.size = static_cast<uint64_t>(st.st_size);
+#ifdef __APPLE__
+    current.mtime = static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+    current.mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+    current.inode = static_cast<uint64_t>(st.st_ino);
+
+    auto it = entries.find(path);
+    if (it != entries.end() && it->second.size == current.size &&
+        it->second.mtime == current.mtime && it->second.inode == current.inode) {
+        pending.erase(path);
+        return;
+    }
+
+    current.hash = hashFile(fullPath);
+    if (it != entries.end() && it->second.hash == current.hash) {
+        // Touched but not changed
+        it->second = current;
+        modified = true;
+        pending.erase(path);
+        return;
+    }
+
+    pending[path] = current;
+}
+
+/*
+ * changedFiles function
+ * Finds the files whose content differs from their last pushed state.
+ * Without a watcher, or right after it started, the whole tree is walked once
+ * (files are only rehashed when their metadata changed).
+ * Afterwards only the paths reported by inotify are examined.
+ * A file that cannot be hashed is left out and kept for the next call.
+ * Returns the sorted list of changed paths relative to the root.
+ */
+std::vector<std::string> DriveIndex::changedFiles() {
+    bool fullScan;
+    std::unordered_set<std::string> candidates;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        fullScan = fullScanNeeded || !watching;
+        if (watching) {
+            fullScanNeeded = false;
+        }
+        candidates.swap(dirty);
+    }
+
+    if (fullScan) {
+        candidates.clear();
+        std::error_code ec;
+        if (std::filesystem::is_directory(root, ec)) {
+            auto options = std::filesystem::directory_options::skip_permission_denied;
+            for (auto it = std::filesystem::recursive_directory_iterator(root, options, ec);
+                 it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+                if (ec) {
+                    break;
+                }
+                if (it->is_regular_file(ec)) {
+                    candidates.insert(std::filesystem::relative(it->path(), root, ec).generic_string());
+                }
+            }
+        }
+        // Indexed files that were not seen are checked as well so deletions are noticed
+        for (const auto& [path, entry] : entries) {
+            candidates.insert(path);
+        }
+    }
+
+    std::vector<std::string> failed;
+    for (const std::string& path : candidates) {
+        try {
+            examine(path);
+        } catch (const std::exception&) {
+            // Unreadable for now, e.g. locked or being replaced, so it is examined again next time
+            failed.push_back(path);
+        }
+    }
+    if (!failed.empty()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        dirty.insert(failed.begin(), failed.end());
+    }
+
+    std::vector<std::string> changed;
+    changed.reserve(pending.size());
+    for (const auto& [path, entry] : pending) {
+        changed.push_back(path);
+    }
+    std::sort(changed.begin(), changed.end());
+    return changed;
+}
+
+/*
+ * markSynced function
+ * Records that a changed file has been pushed, making its current state the indexed one.
+ * Takes a string parameter path representing the path relative to the root.
+ * Returns void.
+ */
+void DriveIndex::markSynced(const std::string& path) {
+    auto it = pending.find(path);
+    if (it == pending.end()) {
+        return;
+    }
+    entries[path] = it->second;
+    pending.erase(it);
+    modified = true;
+}
+
+/*
+ * startWatching function
+ * Starts a background thread that collects the paths modified under the root via inotify.
+ * Does nothing when inotify is unavailable, in which case every lookup walks the tree.
+ * Returns void.
+ */
+void DriveIndex::startWatching() {
+#ifdef __linux__
+    std::error_code ec;
+    if (watching || !std::filesystem::is_directory(root, ec)) {
+        return;
+    }
+
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd < 0) {
+        return;
+    }
+
+    try {
+        watchTree("");
+    } catch (const std::exception&) {
+        // Usually the per-user watch limit, fall back to scanning
+        close(inotifyFd);
+        inotifyFd = -1;
+        watches.clear();
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        fullScanNeeded = true;
+    }
+    watching = true;
+    watcher = std::thread(&DriveIndex::watchLoop, this);
+#endif
+}
+
+/*
+ * stopWatching function
+ * Stops the watcher thread and releases the inotify descriptor.
+ * Returns void.
+ */
+void DriveIndex::stopWatching() {
+    if (!watching) {
+        return;
+    }
+    watching = false;
+    if (watcher.joinable()) {
+        watcher.join();
+    }
+    close(inotifyFd);
+    inotifyFd = -1;
+    watches.clear();
+}
+
+/*
+ * watchTree function
+ * Adds inotify watches for a directory and all of its subdirectories.
+ * Takes a string parameter dir representing the directory relative to the root.
+ * Throws a runtime_error if a watch cannot be added.
+ * Returns void.
+ */
+void DriveIndex::watchTree(const std::string& dir) {
+#ifdef __linux__
+    std::string fullPath = dir.empty() ? root : root + "/" + dir;
+    uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ATTRIB;
+    int wd = inotify_add_watch(inotifyFd, fullPath.c_str(), mask);
+    if (wd < 0) {
+        throw std::runtime_error("Failed to watch directory: " + fullPath);
+    }
+    watches[wd] = dir;
+
+    std::error_code ec;
+    for (const auto& child : std::filesystem::directory_iterator(fullPath, ec)) {
+        if (child.is_directory(ec) && !child.is_symlink(ec)) {
+            std::string name = child.path().filename().string();
+            watchTree(dir.empty() ? name : dir + "/" + name);
+        }
+    }
+#else
+    (void)dir;
+#endif
+}
+
+/*
+ * watchLoop function
+ * Body of the watcher thread.
+ * Turns inotify events into dirty paths until stopWatching is called.
+ * Anything it cannot track precisely (queue overflow, directory moves) requests a full scan.
+ * Returns void.
+ */
+void DriveIndex::watchLoop() {
+#ifdef __linux__
+    alignas(inotify_event) char buffer[16384];
+
+    while (watching) {
+        pollfd pfd = {inotifyFd, POLLIN, 0};
+        if (poll(&pfd, 1, 250) <= 0) {
+            continue;
+        }
+
+        ssize_t length = read(inotifyFd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            continue;
+        }
+
+        for (char* ptr = buffer; ptr < buffer + length;) {
+            auto* event = reinterpret_cast<inotify_event*>(ptr);
+            ptr += sizeof(inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                std::lock_guard<std::mutex> lock(mutex);
+                fullScanNeeded = true;
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                watches.erase(event->wd);
+                continue;
+            }
+
+            auto dir = watches.find(event->wd);
+            if (dir == watches.end() || event->len == 0) {
+                continue;
+            }
+            std::string name(event->name);
+            std::string path = dir->second.empty() ? name : dir->second + "/" + name;
+
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    try {
+                        watchTree(path);
+                    } catch (const std::exception&) {
+                        // Without a watch the subtree is only covered by full scans
+                    }
+                }
+                // Whole subtrees appeared or vanished, rescan once
+                std::lock_guard<std::mutex> lock(mutex);
+                fullScanNeeded = true;
+                continue;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            dirty.insert(path);
+        }
+    }
+#endif
+}
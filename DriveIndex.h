@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/*
+ * DriveEntry structure
+ * The state of a single file under the drive directory as recorded in the index.
+ */
+struct DriveEntry {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    uint64_t inode = 0;
+    uint64_t hash = 0;
+};
+
+/*
+ * DriveIndex class
+ * Persistent index of the files under the local 'drive' directory.
+ * Records path, size, mtime, inode and a content hash of every file as of its last push,
+ * so that changed files can be found without rehashing the whole tree.
+ * While the client runs, an inotify watcher (Linux only) collects the paths touched,
+ * which lets changedFiles() look only at those instead of walking the tree.
+ */
+class DriveIndex {
+public:
+    DriveIndex(const std::string& root, const std::string& indexPath);
+    ~DriveIndex();
+
+    void load();
+    void save();
+    void startWatching();
+    void stopWatching();
+
+    std::vector<std::string> changedFiles();
+    void markSynced(const std::string& path);
+
+    static uint64_t hashFile(const std::string& path);
+
+private:
+    std::string root;
+    std::string indexPath;
+
+    std::mutex mutex;
+    std::unordered_map<std::string, DriveEntry> entries;
+    std::unordered_map<std::string, DriveEntry> pending;
+    std::unordered_set<std::string> dirty;
+    bool fullScanNeeded = true;
+    bool modified = false;
+
+    int inotifyFd = -1;
+    std::unordered_map<int, std::string> watches;
+    std::atomic<bool> watching{false};
+    std::thread watcher;
+
+    void examine(const std::string& path);
+    void watchTree(const std::string& dir);
+    void watchLoop();
+};
@@ -2,6 +2,7 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <stdexcept>
 #include <iostream>
@@ -9,9 +10,62 @@
 #include <vector>
 #include <cstring>
 #include <cerrno>
+#include <unordered_map>
 #include <filesystem>
+#include <fcntl.h>
+#include <chrono>
+#include <thread>
+#include "Chunker.h"
+#include "TarStream.h"
+#include "DirectWriter.h"
+#include "SegmentedTransfer.h"
+#include "BufferRing.h"
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstdlib>
+#include <strings.h>
+#include <poll.h>
+#include <deque>
+#include <algorithm>
+#include <ctime>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 const int BUFFER_SIZE = 8192;
+// Files at least this large are downloaded in parallel segments when possible
+const int64_t SEGMENTED_DOWNLOAD_SIZE = 64LL * 1024 * 1024;
+const unsigned SEGMENTED_DOWNLOAD_STREAMS = 4;
+// Files at least this large are uploaded in parallel segments, on up to this many sessions
+const uint64_t SEGMENTED_UPLOAD_SIZE = 64ULL * 1024 * 1024;
+const unsigned SEGMENTED_UPLOAD_STREAMS = 8;
+// Features announced by each server, so later logins can skip FEAT
+const std::string FEATURE_FOLDER = ".ftpstate/features";
+// Data connections a single control connection keeps open at once in downloadFiles
+const size_t MAX_DATA_CHANNELS = 4;
+// Keepalive probing of idle connections: first probe, probe interval, probes before giving up
+const int KEEPALIVE_IDLE_SECONDS = 15;
+const int KEEPALIVE_INTERVAL_SECONDS = 5;
+const int KEEPALIVE_PROBES = 3;
+// Largest piece of a file handed to sendfile at once, so progress and pacing stay fine-grained
+const size_t SENDFILE_CHUNK = 256 * 1024;
+// Block mode framing: a header of a descriptor byte and a 16-bit big-endian byte count per block
+const unsigned char BLOCK_EOF = 0x40;
+const unsigned char BLOCK_RESTART_MARKER = 0x10;
+const size_t BLOCK_HEADER_SIZE = 3;
+const size_t BLOCK_MAX_LENGTH = 65535;
+// RETR commands downloadFiles keeps outstanding on a block mode data connection
+const size_t BLOCK_PIPELINE_DEPTH = 16;
+// Size of each buffer in the ring between the disk and network threads of a transfer
+const size_t PIPELINE_SLOT_SIZE = 1024 * 1024;
+// How often a server-to-server transfer asks the source for its progress with STAT
+const int STAT_INTERVAL_MS = 1000;
+// Listening sockets kept ready for active mode; the server connects to them in turn, so the
+// same address and port are not reused right away while an old connection is in TIME_WAIT
+const size_t ACTIVE_LISTENERS = 8;
+
+FTPClient::Timeouts FTPClient::defaults;
+std::mutex FTPClient::defaultTimeoutsMutex;
 
 /*
  * Constructor for the FTPClient class.
@@ -21,8 +75,15 @@ const int BUFFER_SIZE = 8192;
  * Takes parameters:
  * - address: the IP address of the server
  * - port: the port number of the server
+ * - verbose: print the server's replies to login and logout
  */
-FTPClient::FTPClient(const std::string& address, int port) : serverAddress(address), serverPort(port) {
+FTPClient::FTPClient(const std::string& address, int port, bool verbose)
+    : serverAddress(address), serverPort(port), verbose(verbose) {
+    commandBuffer.reserve(CONTROL_BUFFER_SIZE);
+    reply.reserve(CONTROL_BUFFER_SIZE);
+
+    timeouts = defaultTimeouts();
+
     // Create a new socket
     controlSocket = createSocket();
 
@@ -32,13 +93,29 @@ FTPClient::FTPClient(const std::string& address, int port) : serverAddress(addre
     inet_pton(AF_INET, serverAddress.c_str(), &serverAddr.sin_addr);
     serverAddr.sin_port = htons(serverPort);
 
-    // Connect to the server
-    if (connect(controlSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
-        throw std::runtime_error("Failed to connect: " + std::string(strerror(errno)));
+    // Connect to the server, the destructor does not run if the constructor throws
+    try {
+        connectSocket(controlSocket, serverAddr);
+    } catch (const std::exception&) {
+        close(controlSocket);
+        throw;
     }
 
+    // Commands are small and each one waits for its reply, so never hold them back for coalescing
+    int noDelay = 1;
+    setsockopt(controlSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
     // Print the server's welcome message
-    std::cout << readResponse();
+    std::string welcome;
+    try {
+        welcome = readResponse();
+    } catch (const std::exception&) {
+        close(controlSocket);
+        throw;
+    }
+    if (verbose) {
+        std::cout << welcome;
+    }
 }
 
 /*
@@ -58,6 +135,147 @@ int FTPClient::createSocket() {
     return s;
 }
 
+/*
+ * defaultTimeouts function
+ * Returns the timeouts new sessions start with.
+ */
+FTPClient::Timeouts FTPClient::defaultTimeouts() {
+    std::lock_guard<std::mutex> lock(defaultTimeoutsMutex);
+    return defaults;
+}
+
+/*
+ * setDefaultTimeouts function
+ * Changes the timeouts new sessions start with, e.g. the extra sessions of segmented downloads.
+ * Takes a parameter timeouts with the new values.
+ * Returns void.
+ */
+void FTPClient::setDefaultTimeouts(const Timeouts& timeouts) {
+    std::lock_guard<std::mutex> lock(defaultTimeoutsMutex);
+    defaults = timeouts;
+}
+
+/*
+ * setTimeouts function
+ * Changes the timeouts of this session. Data connections opened later use the new stall timeout.
+ * Takes a parameter timeouts with the new values.
+ * Returns void.
+ */
+void FTPClient::setTimeouts(const Timeouts& timeouts) {
+    this->timeouts = timeouts;
+    configureSocket(controlSocket);
+}
+
+/*
+ * waitFor function
+ * Waits until a socket is ready, so no blocking call on it can hang past the deadline.
+ * Takes parameters:
+ * - fd: the socket
+ * - events: POLLIN or POLLOUT
+ * - timeoutMs: how long to wait, in milliseconds
+ * - what: describes the wait in the error message
+ * Throws a TimeoutError if the socket does not become ready in time.
+ * Returns void.
+ */
+void FTPClient::waitFor(int fd, short events, int timeoutMs, const char* what) {
+    pollfd pfd = {fd, events, 0};
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while (true) {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        int ready = poll(&pfd, 1, static_cast<int>(std::max<int64_t>(remaining.count(), 0)));
+        if (ready > 0) {
+            return;
+        }
+        if (ready == 0) {
+            throw TimeoutError(std::string("Timed out ") + what + " after " + std::to_string(timeoutMs) + " ms");
+        }
+        if (errno != EINTR) {
+            throw std::runtime_error(std::string("Failed waiting ") + what + ": " + strerror(errno));
+        }
+    }
+}
+
+/*
+ * throwSocketError function
+ * Turns a failed send or receive on a data socket into an exception.
+ * Data sockets carry the stall timeout in SO_RCVTIMEO/SO_SNDTIMEO, so EAGAIN means the peer stalled.
+ * Takes a string parameter what describing the operation.
+ * Throws a TimeoutError for a stall and a runtime_error otherwise.
+ */
+void FTPClient::throwSocketError(const std::string& what) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        throw TimeoutError(what + ": transfer stalled");
+    }
+    throw std::runtime_error(what + ": " + std::string(strerror(errno)));
+}
+
+/*
+ * connectSocket function
+ * Connects a socket within the connect timeout and applies the keepalive settings.
+ * Takes parameters:
+ * - fd: the socket to connect
+ * - address: the address to connect to
+ * Throws a TimeoutError if the connection is not established in time,
+ * or a runtime_error if it is refused.
+ * Returns void.
+ */
+void FTPClient::connectSocket(int fd, const sockaddr_in& address) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) {
+        if (errno != EINPROGRESS) {
+            throw std::runtime_error("Failed to connect: " + std::string(strerror(errno)));
+        }
+        waitFor(fd, POLLOUT, timeouts.connectMs, "connecting");
+
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0) {
+            throw std::runtime_error("Failed to connect: " + std::string(strerror(error)));
+        }
+    }
+
+    fcntl(fd, F_SETFL, flags);
+    configureSocket(fd);
+}
+
+/*
+ * configureSocket function
+ * Enables keepalive probes and bounds how long sent data may stay unacknowledged,
+ * so a peer that silently went away is noticed even while nothing is being read.
+ * Takes a parameter fd representing a connected socket.
+ * Returns void.
+ */
+void FTPClient::configureSocket(int fd) const {
+    int enabled = 1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enabled, sizeof(enabled));
+#ifdef __linux__
+    int idle = KEEPALIVE_IDLE_SECONDS;
+    int interval = KEEPALIVE_INTERVAL_SECONDS;
+    int count = KEEPALIVE_PROBES;
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+    unsigned userTimeout = static_cast<unsigned>(timeouts.stallMs);
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &userTimeout, sizeof(userTimeout));
+#endif
+}
+
+/*
+ * configureDataSocket function
+ * Applies the stall timeout to every blocking send and receive on a data socket.
+ * The kernel enforces it, so the copy loops need no extra poll per buffer.
+ * Takes a parameter fd representing a connected data socket.
+ * Returns void.
+ */
+void FTPClient::configureDataSocket(int fd) const {
+    timeval stall = {timeouts.stallMs / 1000, (timeouts.stallMs % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &stall, sizeof(stall));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &stall, sizeof(stall));
+}
+
 /*
  * sendCommand function
  * Sends a command to the server over the control socket.
@@ -66,27 +284,174 @@ int FTPClient::createSocket() {
  * Returns void.
  */
 void FTPClient::sendCommand(const std::string& cmd) const {
-    // Append \r\n to the command and send it to the server
-    std::string message = cmd + "\r\n";
-    // Send the command to the server and check for errors
-    if (send(controlSocket, message.c_str(), message.length(), 0) < 0) {
-        // Throw an exception if the send operation fails
-        throw std::runtime_error("Failed to send command: " + std::string(strerror(errno)));
+    queueCommand(cmd);
+    flushCommands();
+}
+
+/*
+ * sendCommand function
+ * Sends a command with an argument, e.g. "RETR" and a path.
+ * Throws a runtime_error if the send operation fails.
+ * Returns void.
+ */
+void FTPClient::sendCommand(const char* verb, const std::string& argument) const {
+    queueCommand(verb, argument);
+    flushCommands();
+}
+
+/*
+ * sendCommand function
+ * Sends a command with a numeric argument, e.g. REST with an offset.
+ * Throws a runtime_error if the send operation fails.
+ * Returns void.
+ */
+void FTPClient::sendCommand(const char* verb, uint64_t argument) const {
+    queueCommand(verb, argument);
+    flushCommands();
+}
+
+/*
+ * queueCommand function
+ * Appends a command and its \r\n to the session's send buffer without sending it.
+ * Commands queued back to back are sent together by flushCommands, in one segment.
+ * Only queue commands whose replies do not decide whether the next command may be sent.
+ * Takes a string parameter cmd representing the command.
+ * Returns void.
+ */
+void FTPClient::queueCommand(const std::string& cmd) const {
+    commandBuffer.append(cmd);
+    commandBuffer.append("\r\n");
+}
+
+/*
+ * queueCommand function
+ * Queues a command with an argument, formatted straight into the send buffer
+ * so no temporary strings are built for it.
+ * Takes parameters:
+ * - verb: the command, e.g. "RETR"
+ * - argument: the argument of the command
+ * Returns void.
+ */
+void FTPClient::queueCommand(const char* verb, const std::string& argument) const {
+    commandBuffer.append(verb);
+    commandBuffer.push_back(' ');
+    commandBuffer.append(argument);
+    commandBuffer.append("\r\n");
+}
+
+/*
+ * queueCommand function
+ * Queues a command with a numeric argument.
+ * Returns void.
+ */
+void FTPClient::queueCommand(const char* verb, uint64_t argument) const {
+    char digits[24];
+    int length = snprintf(digits, sizeof(digits), "%llu", static_cast<unsigned long long>(argument));
+    commandBuffer.append(verb);
+    commandBuffer.push_back(' ');
+    commandBuffer.append(digits, length);
+    commandBuffer.append("\r\n");
+}
+
+/*
+ * flushCommands function
+ * Sends every queued command to the server with a single send.
+ * The control socket has Nagle disabled, so the commands leave immediately as one segment
+ * instead of one small packet per command.
+ * Throws a runtime_error if the send operation fails.
+ * Returns void.
+ */
+void FTPClient::flushCommands() const {
+    size_t sent = 0;
+    while (sent < commandBuffer.size()) {
+        ssize_t n = controlTls ? controlTls->send(commandBuffer.data() + sent, commandBuffer.size() - sent)
+                               : send(controlSocket, commandBuffer.data() + sent, commandBuffer.size() - sent,
+                                      MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            commandBuffer.clear();
+            // Throw an exception if the send operation fails
+            throw std::runtime_error("Failed to send command: " + std::string(strerror(errno)));
+        }
+        sent += n;
     }
+    commandBuffer.clear();
 }
 
-std::string FTPClient::readResponse() const {
-    // Read the server's response from the control socket
-    char buffer[BUFFER_SIZE];
-    int bytesReceived = recv(controlSocket, buffer, BUFFER_SIZE - 1, 0);
-    // Check for errors
-    if (bytesReceived < 0) {
-        throw std::runtime_error("Failed to read response: " + std::string(strerror(errno)));
+/*
+ * readResponse function
+ * Reads one complete reply from the server, including every line of a multi-line reply.
+ * Bytes received past the end of the reply are kept for the next call, so replies
+ * that arrive together are never lost or merged.
+ * Throws a runtime_error if the receive operation fails.
+ * The final reply of a read closed with closeRead, then the reply to a PORT or EPRT sent
+ * along with a transfer command, are read and checked first, so callers see the reply to
+ * the transfer command itself; if the server refused the address, that reply is an error too.
+ * Returns the reply, or an empty string if the server closed the connection.
+ * The returned string is the session's reply buffer and is overwritten by the next call.
+ */
+const std::string& FTPClient::readResponse() const {
+    while (unreadReadEnds > 0) {
+        --unreadReadEnds;
+        const std::string& response = readResponse();
+        const char* accepted[] = {"226", "250", "426", "450", "451"};
+        if (std::none_of(std::begin(accepted), std::end(accepted),
+                         [&response](const char* code) { return response.compare(0, 3, code) == 0; })) {
+            std::cerr << "Read ended with: " << response;
+        }
+    }
+    while (unreadAnnouncements > 0) {
+        --unreadAnnouncements;
+        const std::string& response = readResponse();
+        if (response.compare(0, 3, "200") != 0) {
+            std::cerr << "Server refused the data connection address: " << response;
+        }
+    }
+    reply.clear();
+    size_t lineStart = 0;
+    while (true) {
+        const char* begin = receiveBuffer + receiveStart;
+        const char* newline = static_cast<const char*>(memchr(begin, '\n', receiveEnd - receiveStart));
+        if (!newline) {
+            // Keep the partial line and refill the receive buffer
+            reply.append(begin, receiveEnd - receiveStart);
+            receiveStart = receiveEnd = 0;
+            // Decrypted bytes TLS already holds do not show up in poll
+            if (!controlTls || controlTls->pending() == 0) {
+                waitFor(controlSocket, POLLIN, timeouts.idleMs, "waiting for a server reply");
+            }
+            ssize_t bytesReceived = controlTls ? controlTls->recv(receiveBuffer, sizeof(receiveBuffer))
+                                               : recv(controlSocket, receiveBuffer, sizeof(receiveBuffer), 0);
+            if (bytesReceived < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("Failed to read response: " + std::string(strerror(errno)));
+            }
+            if (bytesReceived == 0) {
+                return reply;
+            }
+            receiveEnd = static_cast<size_t>(bytesReceived);
+            continue;
+        }
+
+        size_t length = static_cast<size_t>(newline - begin) + 1;
+        reply.append(begin, length);
+        receiveStart += length;
+
+        // "123-" opens a multi-line reply which ends with a line starting with "123 "
+        bool multiLine = reply.size() > 3 && reply[3] == '-';
+        if (!multiLine) {
+            return reply;
+        }
+        if (lineStart > 0 && reply.size() - lineStart > 3 && reply.compare(lineStart, 3, reply, 0, 3) == 0 &&
+            reply[lineStart + 3] == ' ') {
+            return reply;
+        }
+        lineStart = reply.size();
     }
-    // Null-terminate the buffer
-    buffer[bytesReceived] = '\0';
-    // Return the response as a string
-    return std::string(buffer);
 }
 
 /*
@@ -101,7 +466,7 @@ std::string FTPClient::readResponse() const {
  */
 bool FTPClient::checkResponseCode(const std::string& response, const std::string& expectedCode) {
     // Check if the response code matches the expected code
-    if (response.substr(0, 3) != expectedCode) {
+    if (response.compare(0, 3, expectedCode) != 0) {
         // Print an error message if the response code does not match the expected code
         std::cerr << "Expected response starting with " << expectedCode << ", but got: " << response << std::endl;
         return false;
@@ -126,179 +491,2140 @@ int FTPClient::enterPassiveMode() {
     // Send the PASV command to the server
     sendCommand("PASV");
     // Read the server's response
-    std::string response = readResponse();
+    const std::string& response = readResponse();
     // Check if the response code is 227 (Entering Passive Mode)
     if (!checkResponseCode(response, "227")) {
         throw std::runtime_error("Failed to enter passive mode: " + response);
     }
+    return connectPassive(response);
+}
 
-    // Parse the IP address and port from the response
-    size_t start = response.find('(');
-    size_t end = response.find(')', start);
-    std::string data = response.substr(start + 1, end - start - 1);
+/*
+ * openDataChannel function
+ * Returns the data connection for the next transfer.
+ * In block mode the connection of the previous transfer is reused without a PASV, unless
+ * the server closed it; otherwise a new one is opened with PASV, or announced with PORT
+ * in active mode.
+ * Throws a runtime_error if a new connection cannot be opened.
+ * Returns the file descriptor of the data socket.
+ */
+int FTPClient::openDataChannel() {
+    if (blockSocket >= 0) {
+        // A server that gave the connection up has closed it; TLS session tickets may still sit unread
+        pollfd pfd = {blockSocket, POLLRDHUP, 0};
+        if (poll(&pfd, 1, 0) == 0) {
+            startBlockTransfer();
+            return blockSocket;
+        }
+        int stale = blockSocket;
+        blockSocket = -1;
+        closeData(stale);
+    }
 
-    // Split the IP address and port values
-    std::vector<int> values;
-    size_t pos = 0;
-    while ((pos = data.find(',')) != std::string::npos) {
-        values.push_back(std::stoi(data.substr(0, pos)));
-        data.erase(0, pos + 1);
+    int dataSocket = activeMode ? enterActiveMode() : enterPassiveMode();
+    if (blockMode) {
+        blockSocket = dataSocket;
+        startBlockTransfer();
     }
-    values.push_back(std::stoi(data));
+    return dataSocket;
+}
 
-    // Construct the IP address and port
-    std::string ip = std::to_string(values[0]) + "." + std::to_string(values[1]) + "." +
-                     std::to_string(values[2]) + "." + std::to_string(values[3]);
-    int port = values[4] * 256 + values[5];
+/*
+ * connectPassive function
+ * Opens the data connection announced by a 227 reply to PASV.
+ * Takes a string parameter response representing the 227 reply.
+ * Throws a runtime_error if the reply cannot be parsed or the connection fails.
+ * Returns the file descriptor of the data socket.
+ */
+int FTPClient::connectPassive(const std::string& response) {
+    // Parse the IP address and port from the response
+    unsigned values[6];
+    size_t start = response.find('(');
+    if (start == std::string::npos ||
+        sscanf(response.c_str() + start + 1, "%u,%u,%u,%u,%u,%u", &values[0], &values[1], &values[2], &values[3],
+               &values[4], &values[5]) != 6) {
+        throw std::runtime_error("Failed to parse passive mode reply: " + response);
+    }
 
     // Initialize the data address structure
     sockaddr_in dataAddr = {};
     dataAddr.sin_family = AF_INET;
-    inet_pton(AF_INET, ip.c_str(), &dataAddr.sin_addr);
-    dataAddr.sin_port = htons(port);
+    dataAddr.sin_addr.s_addr = htonl((values[0] << 24) | (values[1] << 16) | (values[2] << 8) | values[3]);
+    dataAddr.sin_port = htons(static_cast<uint16_t>(values[4] * 256 + values[5]));
 
     // Create a new socket for the data connection
     int dataSocket = createSocket();
-    if (connect(dataSocket, (sockaddr*)&dataAddr, sizeof(dataAddr)) < 0) {
-        throw std::runtime_error("Failed to connect to data socket: " + std::string(strerror(errno)));
+    try {
+        connectSocket(dataSocket, dataAddr);
+    } catch (const std::exception& ex) {
+        close(dataSocket);
+        throw std::runtime_error("Failed to connect to data socket: " + std::string(ex.what()));
     }
+    configureDataSocket(dataSocket);
 
     // Return the file descriptor of the data socket
     return dataSocket;
 }
 
 /*
- * Destructor for the FTPClient class.
- * Closes the control socket.
+ * createListener function
+ * Opens a listening socket for active mode on the local address of the control connection,
+ * which is the address the server can reach us on, with a port picked by the kernel.
+ * Throws a runtime_error if the socket cannot be bound or put in listening state.
+ * Returns the file descriptor of the listening socket.
  */
-FTPClient::~FTPClient() {
-    // Close the control socket
-    close(controlSocket);
+int FTPClient::createListener() {
+    sockaddr_in localAddr = {};
+    socklen_t length = sizeof(localAddr);
+    if (getsockname(controlSocket, reinterpret_cast<sockaddr*>(&localAddr), &length) < 0) {
+        throw std::runtime_error("Failed to get the local address: " + std::string(strerror(errno)));
+    }
+    localAddr.sin_port = 0;
+
+    int listener = createSocket();
+    if (bind(listener, reinterpret_cast<sockaddr*>(&localAddr), sizeof(localAddr)) < 0 || listen(listener, 1) < 0) {
+        std::string error = strerror(errno);
+        close(listener);
+        throw std::runtime_error("Failed to open a listening socket: " + error);
+    }
+    return listener;
 }
 
 /*
- * user function
- * Sends the USER command to the server to authenticate the user.
- * Takes a string parameter username representing the username to send.
+ * fillListeners function
+ * Tops the pool of listening sockets up to ACTIVE_LISTENERS, so announcing a data
+ * connection needs no bind or listen on the way to a transfer.
+ * Throws a runtime_error if a socket cannot be opened.
  * Returns void.
  */
-void FTPClient::user(const std::string& username) {
-    // sends USER command used for logging in.
-    sendCommand("USER " + username);
-    std::cout << readResponse();
+void FTPClient::fillListeners() {
+    while (listeners.size() < ACTIVE_LISTENERS) {
+        listeners.push_back(createListener());
+    }
 }
 
 /*
- * pass function
- * Sends the PASS command to the server to authenticate the user.
- * Takes a string parameter password representing the password to send.
- * Returns void.
+ * announceListener function
+ * Takes the next listening socket of the pool and prepares the PORT or EPRT command announcing it.
+ * The transfer keeps a duplicate of the listener as its data socket until the server connects;
+ * establishData then puts the accepted connection in its place.
+ * Takes a string parameter command that receives the command to send.
+ * Throws a runtime_error if the pool is empty and no new listener can be opened.
+ * Returns the file descriptor of the data socket.
  */
-void FTPClient::pass(const std::string& password) {
-    // Analog to the user function, sends the password to the server.
-    sendCommand("PASS " + password);
-    std::cout << readResponse();
+int FTPClient::announceListener(std::string& command) {
+    int listener;
+    if (listeners.empty()) {
+        listener = createListener();
+    } else {
+        listener = listeners.front();
+        listeners.pop_front();
+    }
+    int dataSocket = fcntl(listener, F_DUPFD_CLOEXEC, 0);
+    if (dataSocket < 0) {
+        std::string error = strerror(errno);
+        close(listener);
+        throw std::runtime_error("Failed to prepare a data socket: " + error);
+    }
+    pendingAccepts[dataSocket] = listener;
+    command = activeCommand(dataSocket);
+    return dataSocket;
 }
 
 /*
- * logout function
- * Sends the QUIT command to the server to log out the user.
- * Returns void.
+ * activeCommand function
+ * Builds the PORT command announcing the listener of a data socket, or EPRT once the server refused PORT.
+ * Takes a parameter dataSocket representing a data socket returned by announceListener.
+ * Returns the command.
  */
-void FTPClient::logout() {
-    // Sends the QUIT command to the server to log out the user.
-    sendCommand("QUIT");
-    std::cout << readResponse();
+std::string FTPClient::activeCommand(int dataSocket) const {
+    sockaddr_in localAddr = {};
+    socklen_t length = sizeof(localAddr);
+    getsockname(pendingAccepts.at(dataSocket), reinterpret_cast<sockaddr*>(&localAddr), &length);
+    uint32_t host = ntohl(localAddr.sin_addr.s_addr);
+    uint16_t port = ntohs(localAddr.sin_port);
+
+    if (useEprt) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &localAddr.sin_addr, ip, sizeof(ip));
+        return "EPRT |1|" + std::string(ip) + "|" + std::to_string(port) + "|";
+    }
+    return "PORT " + std::to_string(host >> 24) + "," + std::to_string((host >> 16) & 0xff) + "," +
+           std::to_string((host >> 8) & 0xff) + "," + std::to_string(host & 0xff) + "," +
+           std::to_string(port >> 8) + "," + std::to_string(port & 0xff);
 }
 
 /*
- * uploadFile function
- * Uploads a file to the server.
- * Takes parameters:
- * - localPath: the local path of the file to upload
- * - remotePath: the remote path where the file will be uploaded on the server
- * Throws a runtime_error if the file does not exist or if the upload fails.
- * Returns void.
- * The function first checks if the 'drive' directory exists in the current directory.
- * It then constructs the full local path by appending the localPath to the 'drive' directory.
- * The function checks if the file exists and is not a directory.
- * It then opens the file in binary mode for reading.
- * The function enters passive mode and obtains the data socket for data transfer.
- * It sends the STOR command to the server with the remote path.
- * The function reads the server's response and checks if the response code is 150 (File status okay).
- * The function then reads the file in chunks and sends the data to the server using the data socket.
- * The function closes the file and the data socket after the upload is complete.
+ * enterActiveMode function
+ * Announces a listening socket of the pool with PORT, falling back to EPRT for the rest of
+ * the session if the server refuses PORT, e.g. behind a gateway that only speaks EPRT.
+ * Unlike the reply to PASV, nothing in the reply is needed to go on, so once the server
+ * accepted an announcement the next ones are only queued: they go out with the transfer
+ * command and readResponse checks their reply. The server connects while the transfer
+ * command is answered, which saves the round trips of PASV and of connecting.
+ * Throws a runtime_error if the server refuses both.
+ * Returns the file descriptor of the data socket, connected by establishData.
  */
-void FTPClient::uploadFile(const std::string& localPath, const std::string& remotePath) {
-
+int FTPClient::enterActiveMode() {
+    std::string command;
+    int dataSocket = announceListener(command);
+    if (activeConfirmed) {
+        queueCommand(command);
+        ++unreadAnnouncements;
+        return dataSocket;
+    }
+    sendCommand(command);
+    const std::string& response = readResponse();
+    if (!useEprt && response[0] == '5') {
+        useEprt = true;
+        sendCommand(activeCommand(dataSocket));
+        // Refills the reply buffer response refers to
+        readResponse();
+    }
+    if (!checkResponseCode(response, "200")) {
+        closeData(dataSocket);
+        throw std::runtime_error("Failed to enter active mode: " + response);
+    }
+    activeConfirmed = true;
+    return dataSocket;
+}
 
-    const std::string driveFolder = "drive";  // Define the 'drive' directory name
+/*
+ * establishData function
+ * Completes a data connection once the 150/125 reply to the transfer command has been read:
+ * in active mode accepts the server's connection, then runs the TLS handshake if the session uses TLS.
+ * The listener goes back to the pool for a later transfer.
+ * Takes a parameter dataSocket representing the data connection.
+ * Throws a TimeoutError if the server does not connect in time and a runtime_error if accepting
+ * or the handshake fails.
+ * Returns void.
+ */
+void FTPClient::establishData(int dataSocket) {
+    auto found = pendingAccepts.find(dataSocket);
+    if (found != pendingAccepts.end()) {
+        int listener = found->second;
+        waitFor(listener, POLLIN, timeouts.connectMs, "waiting for the server to open the data connection");
+        int connected = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (connected < 0) {
+            throw std::runtime_error("Failed to accept the data connection: " + std::string(strerror(errno)));
+        }
+        configureSocket(connected);
+        configureDataSocket(connected);
+        dup2(connected, dataSocket);
+        close(connected);
+        pendingAccepts.erase(found);
+        listeners.push_back(listener);
+    }
+    secureDataSocket(dataSocket);
+}
 
-    if (!std::filesystem::exists(driveFolder)) {
-        throw std::runtime_error("Directory 'drive' does not exist.");
+/*
+ * startTls function
+ * Secures the control channel with AUTH TLS and asks for encrypted data channels
+ * with PBSZ 0 and PROT P.
+ * Throws a runtime_error if the server refuses TLS or the handshake fails.
+ * Returns void.
+ */
+void FTPClient::startTls() {
+    sendCommand("AUTH TLS");
+    const std::string& response = readResponse();
+    if (!checkResponseCode(response, "234")) {
+        throw std::runtime_error("Server refused AUTH TLS: " + response);
+    }
+    // Anything after the 234 was sent in the clear and must not be read as part of the session
+    if (receiveStart != receiveEnd) {
+        throw std::runtime_error("Unexpected data from the server after AUTH TLS");
     }
 
-    std::string fullLocalPath = driveFolder + "/" + localPath;
+    // A TLS record can arrive in pieces, so reads within one are bounded like the wait for it
+    timeval idle = {timeouts.idleMs / 1000, (timeouts.idleMs % 1000) * 1000};
+    setsockopt(controlSocket, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    setsockopt(controlSocket, SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof(idle));
+    try {
+        controlTls = std::make_unique<TlsChannel>(controlSocket, serverAddress, serverPort, nullptr, false);
+    } catch (const std::exception&) {
+        // The server already speaks TLS, plain commands would only be misread
+        shutdown(controlSocket, SHUT_RDWR);
+        throw;
+    }
 
-    if (!std::filesystem::exists(fullLocalPath) || std::filesystem::is_directory(fullLocalPath)) {
-        throw std::runtime_error("File not found or invalid path: " + fullLocalPath);
+    // PROT needs a PBSZ first; if that fails, PROT fails too
+    queueCommand("PBSZ 0");
+    queueCommand("PROT P");
+    flushCommands();
+    bool pbszAccepted = checkResponseCode(readResponse(), "200");
+    const std::string& protResponse = readResponse();
+    if (!pbszAccepted || !checkResponseCode(protResponse, "200")) {
+        throw std::runtime_error("Server refused encrypted data channels: " + protResponse);
     }
+    if (verbose) {
+        std::cout << "TLS control channel: " << controlTls->description() << std::endl;
+    }
+}
 
-    std::ifstream file(fullLocalPath, std::ios::binary);
-    if (!file.is_open()) {
-        throw std::runtime_error("Failed to open file: " + fullLocalPath);
+/*
+ * secureDataSocket function
+ * Runs the TLS handshake on a data connection when the session uses TLS, resuming the
+ * control channel's session. Servers start their side only after the 150/125 reply,
+ * so this is called once that reply has been read.
+ * The keys go to kernel TLS when the kernel supports it, see TlsChannel.
+ * Takes a parameter dataSocket representing the data connection.
+ * Throws a runtime_error if the handshake fails.
+ * Returns void.
+ */
+void FTPClient::secureDataSocket(int dataSocket) {
+    // A block mode connection keeps its TLS session across transfers
+    if (!controlTls || dataChannel(dataSocket)) {
+        return;
+    }
+    // Handshake messages are small and wait for each other, Nagle would delay a resumed handshake
+    int noDelay = 1;
+    setsockopt(dataSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    auto channel = std::make_unique<TlsChannel>(dataSocket, serverAddress, serverPort, controlTls.get(), true);
+    if (verbose && !reportedTls) {
+        std::cout << "TLS data channel: " << channel->description() << std::endl;
+        reportedTls = true;
     }
+    dataTls[dataSocket] = std::move(channel);
+}
+
+/*
+ * dataChannel function
+ * Returns the TLS state of a data connection, or null if it is not encrypted.
+ */
+TlsChannel* FTPClient::dataChannel(int dataSocket) const {
+    auto found = dataTls.find(dataSocket);
+    return found == dataTls.end() ? nullptr : found->second.get();
+}
 
-    int dataSocket = enterPassiveMode();
-    sendCommand("STOR " + remotePath);
-    std::string response = readResponse();
+/*
+ * dataRecv function
+ * Receives the data of the current transfer from a data connection.
+ * Returns like recv: the byte count, 0 at the end of the transfer, or -1 with errno set.
+ * In block mode the end of the transfer is the EOF descriptor, not the end of the connection.
+ */
+ssize_t FTPClient::dataRecv(int dataSocket, char* buffer, size_t length) {
+    return dataSocket == blockSocket ? blockRecv(buffer, length) : rawRecv(dataSocket, buffer, length);
+}
 
-    if (!checkResponseCode(response, "150") && !checkResponseCode(response, "125")) {
-        throw std::runtime_error("Failed to initiate file upload: " + response);
-    }
+/*
+ * dataSend function
+ * Sends data of the current transfer on a data connection, as one block in block mode.
+ * Returns like send: the byte count, or -1 with errno set.
+ */
+ssize_t FTPClient::dataSend(int dataSocket, const char* data, size_t length) {
+    return dataSocket == blockSocket ? blockSend(data, length) : rawSend(dataSocket, data, length);
+}
 
-    std::cout << "Starting file upload: " << fullLocalPath << " to " << remotePath << std::endl;
+/*
+ * rawRecv function
+ * Receives from a data connection, decrypting it if it uses TLS.
+ * Returns like recv.
+ */
+ssize_t FTPClient::rawRecv(int dataSocket, char* buffer, size_t length) {
+    TlsChannel* channel = dataChannel(dataSocket);
+    return channel ? channel->recv(buffer, length) : recv(dataSocket, buffer, length, 0);
+}
 
-    char buffer[BUFFER_SIZE];
-    while (file.read(buffer, BUFFER_SIZE) || file.gcount() > 0) {
-        int bytesToSend = static_cast<int>(file.gcount());
-        int bytesSent = 0;
+/*
+ * rawSend function
+ * Sends on a data connection, encrypting it if it uses TLS.
+ * Returns like send.
+ */
+ssize_t FTPClient::rawSend(int dataSocket, const char* data, size_t length) {
+    TlsChannel* channel = dataChannel(dataSocket);
+    return channel ? channel->send(data, length) : send(dataSocket, data, length, MSG_NOSIGNAL);
+}
 
-        // Continue sending until all bytes are transmitted
-        while (bytesSent < bytesToSend) {
-            int sent = send(dataSocket, buffer + bytesSent, bytesToSend - bytesSent, 0);
-            if (sent < 0) {
-                throw std::runtime_error("Failed to send file data: " + std::string(strerror(errno)));
+/*
+ * rawSendAll function
+ * Sends a whole buffer on a data connection, without framing or progress accounting.
+ * Returns true on success, false with errno set otherwise.
+ */
+bool FTPClient::rawSendAll(int dataSocket, const char* data, size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+        ssize_t n = rawSend(dataSocket, data + sent, length - sent);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            bytesSent += sent;
+            return false;
         }
+        sent += n;
     }
+    return true;
+}
 
-    file.close();
-    close(dataSocket);
+/*
+ * startBlockTransfer function
+ * Resets the framing state of the block mode connection before a transfer starts on it.
+ * Returns void.
+ */
+void FTPClient::startBlockTransfer() {
+    blockRemaining = 0;
+    blockLast = false;
+    blockEof = false;
+    blockReceived = false;
+    blockSent = false;
+    blockEofSent = false;
+}
 
-    response = readResponse();
-    if (!checkResponseCode(response, "226") && !checkResponseCode(response, "250")) {
-        throw std::runtime_error("File upload failed: " + response);
+/*
+ * blockRecv function
+ * Receives data of the current transfer from the block mode connection.
+ * Reads block headers as they come: restart markers are kept aside (the last one in
+ * blockMarker), data blocks are passed on, and the EOF descriptor ends the transfer.
+ * Returns like recv: the byte count, 0 at the end of the transfer, or -1 with errno set.
+ * The connection closing before the EOF descriptor is reported as a reset.
+ */
+ssize_t FTPClient::blockRecv(char* buffer, size_t length) {
+    blockReceived = true;
+    while (blockRemaining == 0) {
+        if (blockEof || blockLast) {
+            blockEof = true;
+            return 0;
+        }
+
+        unsigned char header[BLOCK_HEADER_SIZE];
+        size_t got = 0;
+        while (got < sizeof(header)) {
+            ssize_t n = rawRecv(blockSocket, reinterpret_cast<char*>(header) + got, sizeof(header) - got);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n == 0) {
+                    errno = ECONNRESET;
+                }
+                return -1;
+            }
+            got += n;
+        }
+        size_t count = (static_cast<size_t>(header[1]) << 8) | header[2];
+
+        if (header[0] & BLOCK_RESTART_MARKER) {
+            blockMarker.resize(count);
+            got = 0;
+            while (got < count) {
+                ssize_t n = rawRecv(blockSocket, &blockMarker[got], count - got);
+                if (n <= 0) {
+                    if (n < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (n == 0) {
+                        errno = ECONNRESET;
+                    }
+                    return -1;
+                }
+                got += n;
+            }
+            continue;
+        }
+        blockRemaining = count;
+        blockLast = (header[0] & BLOCK_EOF) != 0;
     }
 
-    std::cout << "File uploaded successfully: " << remotePath << std::endl;
+    ssize_t n = rawRecv(blockSocket, buffer, std::min(length, blockRemaining));
+    if (n == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    if (n > 0) {
+        blockRemaining -= n;
+    }
+    return n;
 }
 
+/*
+ * blockSend function
+ * Sends up to BLOCK_MAX_LENGTH bytes as one data block on the block mode connection.
+ * Header and data go out in one send, so with TLS they share a record.
+ * Returns the number of bytes sent, or -1 with errno set.
+ */
+ssize_t FTPClient::blockSend(const char* data, size_t length) {
+    size_t count = std::min(length, BLOCK_MAX_LENGTH);
+    blockFrame.resize(BLOCK_HEADER_SIZE + count);
+    blockFrame[0] = 0;
+    blockFrame[1] = static_cast<char>(count >> 8);
+    blockFrame[2] = static_cast<char>(count & 0xff);
+    memcpy(blockFrame.data() + BLOCK_HEADER_SIZE, data, count);
+    blockSent = true;
+    if (!rawSendAll(blockSocket, blockFrame.data(), blockFrame.size())) {
+        return -1;
+    }
+    return static_cast<ssize_t>(count);
+}
 
 /*
- * downloadFile function
+ * finishUpload function
+ * Marks the end of an upload's data. In block mode that is an empty block with the
+ * EOF descriptor and the connection stays open; in stream mode closing it does the job.
+ * Over TLS the session is ended here and the server's close awaited: a close with
+ * unread data (such as session tickets arriving late) resets the connection, which
+ * discards whatever the server has not read yet.
+ * Takes a parameter dataSocket representing the data connection.
+ * Throws a runtime_error if the EOF block cannot be sent.
+ * Returns void.
+ */
+void FTPClient::finishUpload(int dataSocket) {
+    if (dataSocket != blockSocket) {
+        TlsChannel* channel = dataChannel(dataSocket);
+        if (channel) {
+            channel->shutdown();
+            shutdown(dataSocket, SHUT_WR);
+            // Bounded by the stall timeout of the data socket
+            char discard[BUFFER_SIZE];
+            while (recv(dataSocket, discard, sizeof(discard), 0) > 0) {
+            }
+        }
+        return;
+    }
+    const char eof[BLOCK_HEADER_SIZE] = {static_cast<char>(BLOCK_EOF), 0, 0};
+    if (!rawSendAll(blockSocket, eof, sizeof(eof))) {
+        throwSocketError("Failed to end block mode upload");
+    }
+    blockEofSent = true;
+}
+
+/*
+ * closeData function
+ * Closes a data connection at the end of a transfer, ending its TLS session first if it has one.
+ * The block mode connection stays open for the next transfer, unless this one stopped
+ * before its EOF descriptor: then the framing is lost and the connection is closed.
+ * TLS servers send session tickets nobody reads on an upload; closing a socket with
+ * unread data resets the connection and can make the server drop the end of the upload,
+ * so whatever already arrived is consumed first.
+ * A connection the server never opened in active mode closes its listener too.
+ * Takes a parameter dataSocket representing the data connection.
+ * Returns void.
+ */
+void FTPClient::closeData(int dataSocket) {
+    // The server may still connect to a listener whose transfer failed, so it is not reused
+    auto pending = pendingAccepts.find(dataSocket);
+    if (pending != pendingAccepts.end()) {
+        close(pending->second);
+        pendingAccepts.erase(pending);
+    }
+    if (dataSocket == blockSocket) {
+        bool complete = (!blockReceived || blockEof) && (!blockSent || blockEofSent);
+        if (complete) {
+            return;
+        }
+        blockSocket = -1;
+    }
+
+    auto found = dataTls.find(dataSocket);
+    if (found != dataTls.end()) {
+        found->second->shutdown();
+        dataTls.erase(found);
+
+        char discard[BUFFER_SIZE];
+        while (recv(dataSocket, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+        }
+    }
+    close(dataSocket);
+}
+
+/*
+ * Destructor for the FTPClient class.
+ * Closes the control socket.
+ */
+FTPClient::~FTPClient() {
+    // Close the control socket
+    if (readSocket >= 0 && readSocket != blockSocket) {
+        close(readSocket);
+    }
+    if (blockSocket >= 0) {
+        close(blockSocket);
+    }
+    for (int listener : listeners) {
+        close(listener);
+    }
+    for (const auto& pending : pendingAccepts) {
+        close(pending.second);
+    }
+    controlTls.reset();
+    close(controlSocket);
+}
+
+/*
+ * user function
+ * Sends the USER command to the server to authenticate the user.
+ * Takes a string parameter username representing the username to send.
+ * Returns true if the server needs no password and the login is already complete (230),
+ * false if PASS has to follow.
+ */
+bool FTPClient::user(const std::string& username) {
+    // sends USER command used for logging in.
+    sendCommand("USER", username);
+    const std::string& response = readResponse();
+    if (verbose) {
+        std::cout << response;
+    }
+    return response.compare(0, 3, "230") == 0;
+}
+
+/*
+ * pass function
+ * Sends the PASS command to the server to authenticate the user.
+ * Takes a string parameter password representing the password to send.
+ * Throws a runtime_error if the server does not accept the login.
+ * Returns void.
+ */
+void FTPClient::pass(const std::string& password) {
+    // Analog to the user function, sends the password to the server.
+    sendCommand("PASS", password);
+    const std::string& response = readResponse();
+    if (verbose) {
+        std::cout << response;
+    }
+    // 230 logged in, 202 no password needed
+    if (response.compare(0, 3, "230") != 0 && response.compare(0, 3, "202") != 0) {
+        throw std::runtime_error("Login rejected: " + response);
+    }
+}
+
+/*
+ * login function
+ * Logs in and prepares the session for transfers: binary type, and UTF-8 paths when supported.
+ * Takes parameters:
+ * - username: the username to log in with
+ * - password: the password to log in with
+ * Throws a runtime_error if the server does not accept the login.
+ * Returns void.
+ * With TLS enabled the control channel is secured first, so the credentials are never sent in the clear.
+ * The first login to a server sends USER and, unless USER completed the login, PASS one
+ * by one and then discovers the server's features with FEAT, which are cached on disk
+ * per host. Later logins to the same server use the cache and pipeline USER, PASS,
+ * TYPE I and OPTS UTF8 ON in one round trip.
+ */
+void FTPClient::login(const std::string& username, const std::string& password) {
+    if (tls && !controlTls) {
+        startTls();
+    }
+
+    if (!loadFeatures()) {
+        // A server that needs no password answers USER with 230 and would reject a PASS
+        if (!user(username)) {
+            pass(password);
+        }
+
+        queueCommand("FEAT");
+        queueCommand("TYPE I");
+        flushCommands();
+        parseFeatures(readResponse());
+        binaryType = readResponse().compare(0, 3, "200") == 0;
+        saveFeatures();
+
+        if (hasFeature("UTF8")) {
+            sendCommand("OPTS UTF8 ON");
+            readResponse();
+        }
+        return;
+    }
+
+    bool utf8 = hasFeature("UTF8");
+    queueCommand("USER", username);
+    queueCommand("PASS", password);
+    queueCommand("TYPE I");
+    if (utf8) {
+        queueCommand("OPTS UTF8 ON");
+    }
+    flushCommands();
+
+    const std::string& userResponse = readResponse();
+    if (verbose) {
+        std::cout << userResponse;
+    }
+    // A server that needs no password answers USER with 230 and rejects the PASS that follows
+    bool loggedIn = userResponse.compare(0, 3, "230") == 0;
+    const std::string& passResponse = readResponse();
+    if (!loggedIn) {
+        if (verbose) {
+            std::cout << passResponse;
+        }
+        loggedIn = passResponse.compare(0, 3, "230") == 0 || passResponse.compare(0, 3, "202") == 0;
+    }
+    if (!loggedIn) {
+        throw std::runtime_error("Login rejected: " + passResponse);
+    }
+
+    binaryType = readResponse().compare(0, 3, "200") == 0;
+    if (utf8) {
+        readResponse();
+    }
+}
+
+/*
+ * hasFeature function
+ * Checks whether the server announced a feature in its FEAT reply, e.g. "MDTM" or "UTF8".
+ * Takes a string parameter name representing the feature keyword.
+ * Returns true if the feature is supported, false otherwise or before login.
+ */
+bool FTPClient::hasFeature(const std::string& name) const {
+    for (const std::string& feature : features) {
+        size_t length = feature.find(' ');
+        if (length == std::string::npos) {
+            length = feature.size();
+        }
+        if (length == name.size() && strncasecmp(feature.c_str(), name.c_str(), length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * parseFeatures function
+ * Reads the feature list out of a FEAT reply, one feature per indented line.
+ * A server without FEAT support leaves the list empty.
+ * Takes a string parameter response representing the reply to FEAT.
+ * Returns void.
+ */
+void FTPClient::parseFeatures(const std::string& response) {
+    features.clear();
+    if (response.compare(0, 3, "211") != 0) {
+        return;
+    }
+    size_t start = 0;
+    while (start < response.size()) {
+        size_t end = response.find('\n', start);
+        if (end == std::string::npos) {
+            end = response.size();
+        }
+        std::string line = response.substr(start, end - start);
+        start = end + 1;
+
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] != ' ') {
+            continue;
+        }
+        line.erase(0, line.find_first_not_of(' '));
+        if (!line.empty()) {
+            features.push_back(line);
+        }
+    }
+}
+
+/*
+ * featureCachePath function
+ * Returns the file caching the features of this session's server.
+ */
+std::string FTPClient::featureCachePath() const {
+    return FEATURE_FOLDER + "/" + serverAddress + "_" + std::to_string(serverPort);
+}
+
+/*
+ * loadFeatures function
+ * Loads the cached features of the server, one per line.
+ * Returns true if the server has been seen before, false otherwise.
+ */
+bool FTPClient::loadFeatures() {
+    std::ifstream file(featureCachePath());
+    if (!file.is_open()) {
+        return false;
+    }
+    features.clear();
+    std::string line;
+    while (std::getline(file, line)) {
+        if (!line.empty()) {
+            features.push_back(line);
+        }
+    }
+    return true;
+}
+
+/*
+ * saveFeatures function
+ * Caches the features of the server so later logins can skip discovery.
+ * The cache is only an optimization, failing to write it is not an error.
+ * Returns void.
+ */
+void FTPClient::saveFeatures() const {
+    std::error_code error;
+    std::filesystem::create_directories(FEATURE_FOLDER, error);
+
+    std::string path = featureCachePath();
+    std::string tempPath = path + ".tmp";
+    std::ofstream file(tempPath, std::ios::trunc);
+    if (!file.is_open()) {
+        return;
+    }
+    for (const std::string& feature : features) {
+        file << feature << "\n";
+    }
+    file.close();
+    std::rename(tempPath.c_str(), path.c_str());
+}
+
+/*
+ * logout function
+ * Sends the QUIT command to the server to log out the user.
+ * Returns void.
+ */
+void FTPClient::logout() {
+    closeRead();
+    // Sends the QUIT command to the server to log out the user.
+    sendCommand("QUIT");
+    const std::string& response = readResponse();
+    if (verbose) {
+        std::cout << response;
+    }
+}
+
+/*
+ * uploadFile function
+ * Uploads a file to the server.
+ * Takes parameters:
+ * - localPath: the local path of the file to upload
+ * - remotePath: the remote path where the file will be uploaded on the server
+ * Throws a runtime_error if the file does not exist or if the upload fails.
+ * Returns void.
+ * The function first checks if the 'drive' directory exists in the current directory.
+ * It then constructs the full local path by appending the localPath to the 'drive' directory.
+ * The function checks if the file exists and is not a directory.
+ * It then opens the file for reading.
+ * With segmented uploads enabled, files of at least SEGMENTED_UPLOAD_SIZE go to servers
+ * announcing REST (STREAM) as parallel ranges when extra sessions can be opened, see uploadSegmented.
+ * The function enters passive mode and obtains the data socket for data transfer.
+ * It sends the STOR command to the server with the remote path.
+ * The function reads the server's response and checks if the response code is 150 (File status okay).
+ * The function then sends the file over the data socket with sendFileRange.
+ * The function closes the file and the data socket after the upload is complete.
+ */
+void FTPClient::uploadFile(const std::string& localPath, const std::string& remotePath) {
+
+
+    const std::string driveFolder = "drive";  // Define the 'drive' directory name
+
+    std::string fullLocalPath = driveFolder + "/" + localPath;
+
+    // A single stat covers both the existence and the type check
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(std::filesystem::status(fullLocalPath, ec))) {
+        if (!std::filesystem::exists(driveFolder, ec)) {
+            throw std::runtime_error("Directory 'drive' does not exist.");
+        }
+        throw std::runtime_error("File not found or invalid path: " + fullLocalPath);
+    }
+
+    int fileFd = open(fullLocalPath.c_str(), O_RDONLY);
+    if (fileFd < 0) {
+        throw std::runtime_error("Failed to open file: " + fullLocalPath);
+    }
+    struct stat fileStat = {};
+    fstat(fileFd, &fileStat);
+    uint64_t fileSize = static_cast<uint64_t>(fileStat.st_size);
+
+    if (segmentedUpload && sessionFactory && fileSize >= SEGMENTED_UPLOAD_SIZE && hasFeature("REST")) {
+        try {
+            uploadSegmented(fileFd, remotePath, fileSize);
+        } catch (const std::exception&) {
+            close(fileFd);
+            throw;
+        }
+        close(fileFd);
+        std::cout << "File uploaded successfully: " << remotePath << std::endl;
+        return;
+    }
+
+    int dataSocket;
+    try {
+        dataSocket = openDataChannel();
+        sendCommand("STOR", remotePath);
+        const std::string& response = readResponse();
+        if (!checkResponseCode(response, "150") && !checkResponseCode(response, "125")) {
+            closeData(dataSocket);
+            throw std::runtime_error("Failed to initiate file upload: " + response);
+        }
+    } catch (const std::exception&) {
+        close(fileFd);
+        throw;
+    }
+
+    std::cout << "Starting file upload: " << fullLocalPath << " to " << remotePath << std::endl;
+
+    ProgressScope progress(currentProgress, remotePath, fileSize);
+
+    try {
+        establishData(dataSocket);
+        sendFileRange(fileFd, dataSocket, 0, fileSize);
+        finishUpload(dataSocket);
+    } catch (const std::exception&) {
+        close(fileFd);
+        abandonTransfer(dataSocket);
+        throw;
+    }
+
+    close(fileFd);
+    closeData(dataSocket);
+
+    const std::string& response = readResponse();
+    if (!checkResponseCode(response, "226") && !checkResponseCode(response, "250")) {
+        throw std::runtime_error("File upload failed: " + response);
+    }
+
+    std::cout << "File uploaded successfully: " << remotePath << std::endl;
+}
+
+/*
+ * sendAll function
+ * Sends a whole buffer over a data socket and counts it towards the current transfer's progress.
+ * Takes parameters:
+ * - socket: the data socket to send on
+ * - data: the bytes to send
+ * - length: the number of bytes to send
+ * Throws a runtime_error if the send operation fails.
+ * Returns void.
+ */
+void FTPClient::sendAll(int socket, const char* data, size_t length) {
+    // Continue sending until all bytes are transmitted
+    size_t bytesSent = 0;
+    while (bytesSent < length) {
+        ssize_t sent = dataSend(socket, data + bytesSent, length - bytesSent);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throwSocketError("Failed to send file data");
+        }
+        bytesSent += sent;
+    }
+    if (currentProgress) {
+        currentProgress->add(length);
+    }
+    if (pacer) {
+        pacer(length);
+    }
+}
+
+/*
+ * sendFileRange function
+ * Sends a byte range of a local file over a data socket.
+ * On Linux the file is handed to the socket with sendfile, without a copy through user space;
+ * with TLS this needs kernel TLS, otherwise the range is read and encrypted in user space.
+ * Takes parameters:
+ * - fileFd: the descriptor of the local file
+ * - dataSocket: the data socket to send on
+ * - offset: the first byte of the range
+ * - length: the number of bytes to send
+ * Throws a runtime_error if reading the file or sending fails.
+ * Returns void.
+ * With a pipeline depth set the file is read on a separate thread instead, see sendPipelined.
+ */
+void FTPClient::sendFileRange(int fileFd, int dataSocket, uint64_t offset, uint64_t length) {
+    if (pipelineDepth > 0) {
+        sendPipelined(fileFd, dataSocket, offset, length);
+        return;
+    }
+
+#ifdef __linux__
+    TlsChannel* channel = dataChannel(dataSocket);
+    uint64_t first = offset;
+    // Block mode frames every block, which sendfile cannot do
+    while (length > 0 && dataSocket != blockSocket && (!channel || channel->kernelSend())) {
+        size_t chunk = static_cast<size_t>(std::min<uint64_t>(length, SENDFILE_CHUNK));
+        off_t position = static_cast<off_t>(offset);
+        ssize_t sent = channel ? channel->sendFile(fileFd, offset, chunk) : sendfile(dataSocket, fileFd, &position, chunk);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (offset == first && (errno == EINVAL || errno == ENOSYS)) {
+                // Nothing was sent yet, fall back to copying
+                break;
+            }
+            throwSocketError("Failed to send file data");
+        }
+        if (sent == 0) {
+            throw std::runtime_error("Failed to read file data: file is shorter than expected");
+        }
+        offset += sent;
+        length -= sent;
+        if (currentProgress) {
+            currentProgress->add(sent);
+        }
+        if (pacer) {
+            pacer(static_cast<uint64_t>(sent));
+        }
+    }
+#endif
+
+    char buffer[BUFFER_SIZE];
+    while (length > 0) {
+        size_t toRead = length < BUFFER_SIZE ? static_cast<size_t>(length) : BUFFER_SIZE;
+        ssize_t bytesRead = pread(fileFd, buffer, toRead, static_cast<off_t>(offset));
+        if (bytesRead <= 0) {
+            throw std::runtime_error("Failed to read file data: " + std::string(strerror(errno)));
+        }
+
+        sendAll(dataSocket, buffer, static_cast<size_t>(bytesRead));
+
+        offset += bytesRead;
+        length -= bytesRead;
+    }
+}
+
+/*
+ * storeRange function
+ * Writes a byte range of a local file to the same offset of a remote file.
+ * Takes parameters:
+ * - fileFd: the descriptor of the local file
+ * - remotePath: the file on the server
+ * - offset: the first byte of the range
+ * - length: the number of bytes to send
+ * - append: use APPE instead of REST + STOR, for ranges that start at the end of the remote file
+ * Throws a runtime_error if the server refuses the restart offset or the transfer fails.
+ * Returns void.
+ */
+void FTPClient::storeRange(int fileFd, const std::string& remotePath, uint64_t offset, uint64_t length, bool append) {
+    int dataSocket = openDataChannel();
+
+    if (append) {
+        sendCommand("APPE", remotePath);
+    } else {
+        // REST must come right before the STOR it applies to
+        sendCommand("REST", offset);
+        const std::string& restResponse = readResponse();
+        if (!checkResponseCode(restResponse, "350")) {
+            closeData(dataSocket);
+            throw std::runtime_error("Server does not support restarting uploads: " + restResponse);
+        }
+        sendCommand("STOR", remotePath);
+    }
+
+    const std::string& response = readResponse();
+    if (!checkResponseCode(response, "150") && !checkResponseCode(response, "125")) {
+        closeData(dataSocket);
+        throw std::runtime_error("Failed to initiate range upload: " + response);
+    }
+
+    try {
+        establishData(dataSocket);
+        sendFileRange(fileFd, dataSocket, offset, length);
+        finishUpload(dataSocket);
+    } catch (const std::exception&) {
+        closeData(dataSocket);
+        throw;
+    }
+    closeData(dataSocket);
+
+    const std::string& finalResponse = readResponse();
+    if (!checkResponseCode(finalResponse, "226") && !checkResponseCode(finalResponse, "250")) {
+        throw std::runtime_error("Range upload failed: " + finalResponse);
+    }
+}
+
+/*
+ * uploadRange function
+ * Writes a byte range of a local file to the same offset of an existing remote file with REST + STOR.
+ * Takes parameters:
+ * - fileFd: the descriptor of the local file
+ * - remotePath: the file on the server
+ * - offset: the first byte of the range
+ * - length: the number of bytes to send
+ * - progress: the progress counters to update, may be null
+ * Throws a runtime_error if the server refuses the restart offset or the transfer fails.
+ * Returns void.
+ */
+void FTPClient::uploadRange(int fileFd, const std::string& remotePath, uint64_t offset, uint64_t length,
+                            const std::shared_ptr<TransferProgress>& progress) {
+    ensureBinaryType();
+    currentProgress = progress;
+    try {
+        storeRange(fileFd, remotePath, offset, length, false);
+    } catch (const std::exception&) {
+        currentProgress.reset();
+        throw;
+    }
+    currentProgress.reset();
+}
+
+/*
+ * uploadSegmented function
+ * Uploads a large file as byte ranges stored in parallel over several sessions.
+ * Takes parameters:
+ * - fileFd: the descriptor of the local file
+ * - remotePath: the file on the server
+ * - fileSize: the size of the local file
+ * Throws a runtime_error if a range cannot be stored or the assembled file has the wrong size.
+ * Returns void.
+ * This session sends the first range with REST 0 + STOR, which creates or truncates the
+ * remote file; SegmentedTransfer then stores the rest at their offsets on extra sessions,
+ * tuning their number to the throughput. SIZE finally checks the assembled file.
+ */
+void FTPClient::uploadSegmented(int fileFd, const std::string& remotePath, uint64_t fileSize) {
+    ProgressScope progress(currentProgress, remotePath, fileSize);
+    ensureBinaryType();
+
+    std::cout << "Uploading " << remotePath << " (" << fileSize << " bytes) over up to " << SEGMENTED_UPLOAD_STREAMS
+              << " sessions" << std::endl;
+    uint64_t first = std::min(fileSize, SegmentedTransfer::INITIAL_RANGE);
+    storeRange(fileFd, remotePath, 0, first, false);
+    unsigned streams = SegmentedTransfer::upload(sessionFactory, remotePath, fileFd, first, fileSize,
+                                                 SEGMENTED_UPLOAD_STREAMS, currentProgress);
+
+    int64_t remote = remoteSize(remotePath);
+    if (remote != static_cast<int64_t>(fileSize)) {
+        throw std::runtime_error("Uploaded file has " + std::to_string(remote) + " bytes, expected " +
+                                 std::to_string(fileSize));
+    }
+    std::cout << "Segmented upload tuned to " << streams << " sessions" << std::endl;
+}
+
+/*
+ * uploadFileDelta function
+ * Uploads only the parts of a file that changed since its last upload to the same remote path.
+ * Takes parameters:
+ * - localPath: the local path of the file to upload, relative to 'drive'
+ * - remotePath: the remote path of the file on the server
+ * Throws a runtime_error if the file does not exist or if the upload fails.
+ * Returns void.
+ * The function splits the file into content-defined chunks and compares them with the
+ * manifest kept from the previous upload to this server and path. A chunk is unchanged when
+ * the previous upload had the same bytes at the same offset: FTP can only overwrite a remote
+ * file in place, not move data within it, so a chunk found at another offset has to be sent
+ * again anyway. Runs of changed chunks are sent with REST + STOR, or with APPE when they
+ * start at the old end of the file.
+ * The remote file is patched only while SIZE (and MDTM, when the server has it) still match
+ * what the manifest recorded; without a manifest, when the file shrank (the server cannot
+ * truncate it), when the remote file changed since, or when the server refuses REST, the
+ * whole file is uploaded instead. SIZE checks the result before the new manifest is saved.
+ */
+void FTPClient::uploadFileDelta(const std::string& localPath, const std::string& remotePath) {
+    const std::string driveFolder = "drive";
+    std::string fullLocalPath = driveFolder + "/" + localPath;
+
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(std::filesystem::status(fullLocalPath, ec))) {
+        throw std::runtime_error("File not found or invalid path: " + fullLocalPath);
+    }
+
+    std::string manifestLocation = location(remotePath);
+    ChunkManifest current = Chunker::split(fullLocalPath);
+    ChunkManifest previous;
+
+    if (!Chunker::loadManifest(manifestLocation, previous) || current.fileSize < previous.fileSize) {
+        uploadFile(localPath, remotePath);
+        recordUpload(remotePath, manifestLocation, current);
+        return;
+    }
+
+    // Someone else may have written the remote file since, then the manifest no longer describes it
+    int64_t remoteBytes = -1;
+    time_t remoteModified = 0;
+    bool haveModified = remoteStat(remotePath, remoteBytes, remoteModified);
+    if (remoteBytes != static_cast<int64_t>(previous.fileSize) ||
+        (haveModified && previous.remoteModified != 0 && remoteModified != previous.remoteModified)) {
+        std::cerr << "Remote file changed since its last upload, uploading whole file: " << remotePath << std::endl;
+        uploadFile(localPath, remotePath);
+        recordUpload(remotePath, manifestLocation, current);
+        return;
+    }
+
+    // Index the previous chunks by offset, a chunk only survives if it still lines up
+    std::unordered_map<uint64_t, const Chunk*> previousByOffset;
+    for (const Chunk& chunk : previous.chunks) {
+        previousByOffset[chunk.offset] = &chunk;
+    }
+
+    // Merge adjacent changed chunks into ranges
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    for (const Chunk& chunk : current.chunks) {
+        auto it = previousByOffset.find(chunk.offset);
+        bool unchanged = it != previousByOffset.end() &&
+                         it->second->length == chunk.length && it->second->hash == chunk.hash;
+        if (unchanged) {
+            continue;
+        }
+        if (!ranges.empty() && ranges.back().first + ranges.back().second == chunk.offset) {
+            ranges.back().second += chunk.length;
+        } else {
+            ranges.emplace_back(chunk.offset, chunk.length);
+        }
+    }
+
+    if (ranges.empty()) {
+        std::cout << "File unchanged, nothing to upload: " << remotePath << std::endl;
+        return;
+    }
+
+    int fileFd = open(fullLocalPath.c_str(), O_RDONLY);
+    if (fileFd < 0) {
+        throw std::runtime_error("Failed to open file: " + fullLocalPath);
+    }
+
+    uint64_t bytesToSend = 0;
+    for (const auto& range : ranges) {
+        bytesToSend += range.second;
+    }
+    uint64_t bytesSent = 0;
+    bool fallback = false;
+    std::string fallbackReason;
+    {
+        // Ends before a fallback upload, which reports progress in the same slot
+        ProgressScope progress(currentProgress, remotePath, bytesToSend);
+        try {
+            for (const auto& [offset, length] : ranges) {
+                storeRange(fileFd, remotePath, offset, length, offset == previous.fileSize);
+                bytesSent += length;
+            }
+        } catch (const std::exception& ex) {
+            close(fileFd);
+            if (bytesSent > 0) {
+                throw;
+            }
+            fallback = true;
+            fallbackReason = ex.what();
+        }
+    }
+    if (fallback) {
+        // Nothing was written yet, a plain upload still gets the file there
+        std::cerr << "Delta upload not possible, uploading whole file: " << fallbackReason << std::endl;
+        uploadFile(localPath, remotePath);
+        recordUpload(remotePath, manifestLocation, current);
+        return;
+    }
+    close(fileFd);
+
+    recordUpload(remotePath, manifestLocation, current);
+    std::cout << "Delta upload complete: sent " << bytesSent << " of " << current.fileSize
+              << " bytes in " << ranges.size() << " ranges to " << remotePath << std::endl;
+}
+
+/*
+ * recordUpload function
+ * Checks a file just uploaded for a delta upload and saves its manifest.
+ * Takes parameters:
+ * - remotePath: the uploaded file on the server
+ * - manifestLocation: the location its manifest is kept under
+ * - manifest: the manifest of the uploaded contents, receives the remote modification time
+ * Throws a runtime_error if SIZE reports a different size than the manifest.
+ * Returns void.
+ */
+void FTPClient::recordUpload(const std::string& remotePath, const std::string& manifestLocation,
+                             ChunkManifest& manifest) {
+    int64_t remoteBytes = -1;
+    time_t remoteModified = 0;
+    bool haveModified = remoteStat(remotePath, remoteBytes, remoteModified);
+    if (remoteBytes >= 0 && remoteBytes != static_cast<int64_t>(manifest.fileSize)) {
+        throw std::runtime_error("Uploaded file has " + std::to_string(remoteBytes) + " bytes, expected " +
+                                 std::to_string(manifest.fileSize));
+    }
+    manifest.remoteModified = haveModified ? static_cast<int64_t>(remoteModified) : 0;
+    Chunker::saveManifest(manifestLocation, manifest);
+}
+
+/*
+ * ensureBinaryType function
+ * Switches the session to binary (TYPE I) transfers once.
+ * Returns void.
+ */
+void FTPClient::ensureBinaryType() {
+    if (binaryType) {
+        return;
+    }
+    sendCommand("TYPE I");
+    const std::string& response = readResponse();
+    binaryType = response.compare(0, 3, "200") == 0;
+}
+
+/*
+ * parseSizeReply function
+ * Extracts the size from a "213 <size>" reply to SIZE.
+ * Returns the size in bytes, or -1 if the reply does not carry one.
+ */
+static int64_t parseSizeReply(const std::string& response) {
+    if (response.compare(0, 3, "213") != 0 || response.size() < 5) {
+        return -1;
+    }
+    char* end = nullptr;
+    long long size = strtoll(response.c_str() + 4, &end, 10);
+    return end == response.c_str() + 4 ? -1 : size;
+}
+
+/*
+ * parseTransferStatus function
+ * Extracts the bytes transferred so far from a reply to STAT sent during a transfer.
+ * Servers word it differently ("Transferred 1234 bytes", "1234 of 5678 bytes"), so the
+ * count is the first number followed by "of" or "bytes".
+ * Returns the byte count, or -1 if the reply carries none.
+ */
+static int64_t parseTransferStatus(const std::string& response) {
+    if (response.size() < 4 || response[0] != '2') {
+        return -1;
+    }
+    std::vector<std::string> words;
+    size_t position = 4;
+    while (position < response.size()) {
+        size_t start = response.find_first_not_of(" \t\r\n/,()", position);
+        if (start == std::string::npos) {
+            break;
+        }
+        size_t end = response.find_first_of(" \t\r\n/,()", start);
+        end = end == std::string::npos ? response.size() : end;
+        words.push_back(response.substr(start, end - start));
+        position = end;
+    }
+    for (size_t i = 0; i + 1 < words.size(); ++i) {
+        bool number = words[i].find_first_not_of("0123456789") == std::string::npos;
+        if (number && (strcasecmp(words[i + 1].c_str(), "of") == 0 || strncasecmp(words[i + 1].c_str(), "bytes", 5) == 0)) {
+            return strtoll(words[i].c_str(), nullptr, 10);
+        }
+    }
+    return -1;
+}
+
+/*
+ * parseModTimeReply function
+ * Extracts the time from a "213 YYYYMMDDHHMMSS" reply to MDTM.
+ * Returns true if the reply carries a time, false otherwise.
+ */
+static bool parseModTimeReply(const std::string& response, time_t& modified) {
+    if (response.compare(0, 3, "213") != 0 || response.size() < 18) {
+        return false;
+    }
+
+    // YYYYMMDDHHMMSS in UTC, possibly followed by fractional seconds
+    std::tm tm = {};
+    if (sscanf(response.c_str() + 4, "%4d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {
+        return false;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    modified = timegm(&tm);
+    return true;
+}
+
+/*
+ * location function
+ * Names a remote file together with its server, for caches shared between sessions and servers.
+ * Takes a string parameter remotePath representing the file on the server.
+ * Returns the server address, port and path as one string.
+ */
+std::string FTPClient::location(const std::string& remotePath) const {
+    return serverAddress + ":" + std::to_string(serverPort) + "/" + remotePath;
+}
+
+/*
+ * remoteSize function
+ * Queries the size of a remote file with the SIZE command.
+ * Takes a string parameter remotePath representing the file on the server.
+ * Returns the size in bytes, or -1 if the server does not report it.
+ * Servers only report exact sizes in binary mode, so the session is switched to TYPE I first.
+ */
+int64_t FTPClient::remoteSize(const std::string& remotePath) {
+    ensureBinaryType();
+    sendCommand("SIZE", remotePath);
+    return parseSizeReply(readResponse());
+}
+
+/*
+ * remoteStat function
+ * Queries the size and modification time of a remote file in one round trip.
+ * TYPE I (when still needed), SIZE and MDTM do not depend on each other's replies,
+ * so they are sent together and their replies read in order.
+ * Takes parameters:
+ * - remotePath: the file on the server
+ * - size: receives the size in bytes, or -1 if the server does not report it
+ * - modified: receives the modification time
+ * Returns true if the server reported the modification time, false otherwise.
+ */
+bool FTPClient::remoteStat(const std::string& remotePath, int64_t& size, time_t& modified) {
+    bool switchType = !binaryType;
+    if (switchType) {
+        queueCommand("TYPE I");
+    }
+    queueCommand("SIZE", remotePath);
+    queueCommand("MDTM", remotePath);
+    flushCommands();
+
+    if (switchType) {
+        binaryType = readResponse().compare(0, 3, "200") == 0;
+    }
+    size = parseSizeReply(readResponse());
+    return parseModTimeReply(readResponse(), modified);
+}
+
+/*
+ * transferTo function
+ * Copies a file from this session's server straight to another server (FXP), without
+ * the data passing through the client.
+ * Takes parameters:
+ * - target: a logged-in session on the receiving server
+ * - sourcePath: the file on this session's server
+ * - targetPath: where the target server stores it
+ * Throws a runtime_error if a server refuses its part, for example a target that does not
+ * connect to third-party addresses, or if the transfer fails. The other server may still
+ * be waiting for its data connection then, so both sessions should be closed.
+ * Returns void.
+ * This server is put in passive mode and the address of its 227 reply handed to the target
+ * with PORT, so the target connects to it when it gets the STOR; then this server is sent the
+ * RETR. While both run, STAT asks this server every STAT_INTERVAL_MS for the bytes sent so far.
+ * Both sessions must use stream mode and unprotected data: neither can take part in the
+ * TLS handshake of a data connection between the servers.
+ */
+void FTPClient::transferTo(FTPClient& target, const std::string& sourcePath, const std::string& targetPath) {
+    if (controlTls || target.controlTls) {
+        throw std::runtime_error("Server-to-server transfers need unprotected data connections, not FTPS");
+    }
+    if (blockMode || target.blockMode) {
+        throw std::runtime_error("Server-to-server transfers need stream mode on both servers");
+    }
+
+    int64_t size = remoteSize(sourcePath);
+    target.ensureBinaryType();
+
+    sendCommand("PASV");
+    const std::string& response = readResponse();
+    size_t open = response.find('(');
+    size_t closing = response.find(')', open);
+    if (!checkResponseCode(response, "227") || open == std::string::npos || closing == std::string::npos) {
+        throw std::runtime_error("Failed to enter passive mode: " + response);
+    }
+    target.sendCommand("PORT", response.substr(open + 1, closing - open - 1));
+    const std::string& portResponse = target.readResponse();
+    if (!checkResponseCode(portResponse, "200")) {
+        throw std::runtime_error("Target refused the source address: " + portResponse);
+    }
+
+    target.sendCommand("STOR", targetPath);
+    sendCommand("RETR", sourcePath);
+    // Copies: both are kept for the final replies, which arrive after further STAT replies
+    std::string sourceReply = readResponse();
+    std::string targetReply = target.readResponse();
+    bool sourceStarted = !sourceReply.empty() && sourceReply[0] == '1';
+    bool targetStarted = !targetReply.empty() && targetReply[0] == '1';
+    if (!sourceStarted || !targetStarted) {
+        throw std::runtime_error("Failed to start server-to-server transfer: " +
+                                 (sourceStarted ? targetReply : sourceReply));
+    }
+
+    std::cout << "Copying " << sourcePath << " to " << target.serverAddress << ":" << target.serverPort << " "
+              << targetPath << std::endl;
+    ProgressScope progress(currentProgress, sourcePath, size > 0 ? static_cast<uint64_t>(size) : 0);
+
+    // Both control connections are watched; a STAT is sent whenever the source stays quiet for a while
+    bool sourceDone = false;
+    bool targetDone = false;
+    unsigned statsPending = 0;
+    int64_t reported = 0;
+    auto replyBuffered = [](const FTPClient& session) {
+        return memchr(session.receiveBuffer + session.receiveStart, '\n',
+                      session.receiveEnd - session.receiveStart) != nullptr;
+    };
+
+    while (!sourceDone || !targetDone) {
+        pollfd fds[2] = {{sourceDone ? -1 : controlSocket, POLLIN, 0},
+                         {targetDone ? -1 : target.controlSocket, POLLIN, 0}};
+        bool sourceReady = !sourceDone && replyBuffered(*this);
+        bool targetReady = !targetDone && replyBuffered(target);
+        if (!sourceReady && !targetReady) {
+            int ready = poll(fds, 2, STAT_INTERVAL_MS);
+            if (ready < 0 && errno != EINTR) {
+                throw std::runtime_error("Failed to wait for transfer: " + std::string(strerror(errno)));
+            }
+            if (ready == 0) {
+                // One STAT at a time, servers that queue it until the end would only pile them up
+                if (!sourceDone && statsPending == 0) {
+                    sendCommand("STAT");
+                    ++statsPending;
+                }
+                continue;
+            }
+            sourceReady = fds[0].revents & (POLLIN | POLLHUP | POLLERR);
+            targetReady = fds[1].revents & (POLLIN | POLLHUP | POLLERR);
+        }
+
+        if (sourceReady) {
+            const std::string& reply = readResponse();
+            if (reply.empty()) {
+                throw std::runtime_error("Source server closed the control connection");
+            }
+            bool status = reply.compare(0, 3, "211") == 0 || reply.compare(0, 3, "212") == 0 ||
+                          reply.compare(0, 3, "213") == 0;
+            if (status && statsPending > 0) {
+                --statsPending;
+                int64_t transferred = parseTransferStatus(reply);
+                if (transferred > reported) {
+                    currentProgress->add(static_cast<uint64_t>(transferred - reported));
+                    reported = transferred;
+                }
+            } else {
+                sourceDone = true;
+                sourceReply = reply;
+            }
+        }
+        if (targetReady) {
+            targetReply = target.readResponse();
+            if (targetReply.empty()) {
+                throw std::runtime_error("Target server closed the control connection");
+            }
+            targetDone = true;
+        }
+    }
+
+    // Answers to a STAT the source only got to after the transfer
+    while (statsPending > 0) {
+        readResponse();
+        --statsPending;
+    }
+
+    bool sourceOk = checkResponseCode(sourceReply, "226") || checkResponseCode(sourceReply, "250");
+    bool targetOk = checkResponseCode(targetReply, "226") || checkResponseCode(targetReply, "250");
+    if (!sourceOk || !targetOk) {
+        throw std::runtime_error("Server-to-server transfer failed: " + (sourceOk ? targetReply : sourceReply));
+    }
+    if (size > reported) {
+        currentProgress->add(static_cast<uint64_t>(size - reported));
+    }
+
+    int64_t copied = target.remoteSize(targetPath);
+    if (size >= 0 && copied >= 0 && copied != size) {
+        throw std::runtime_error("Copy has " + std::to_string(copied) + " bytes, expected " + std::to_string(size));
+    }
+}
+
+/*
+ * setSegmentedUpload function
+ * Selects whether large uploads are split into ranges stored in parallel over extra sessions.
+ * Off by default, as it opens extra sessions and relies on the server honouring REST before
+ * STOR; uploads then use this session's single data connection.
+ * Takes a boolean parameter enabled.
+ * Returns void.
+ */
+void FTPClient::setSegmentedUpload(bool enabled) {
+    segmentedUpload = enabled;
+}
+
+/*
+ * setSegmentedDownload function
+ * Selects whether large downloads are fetched as parallel ranges over extra sessions.
+ * Off by default, as it needs the server to accept more than one login; downloads then
+ * use this session's single data connection.
+ * Takes a boolean parameter enabled.
+ * Returns void.
+ */
+void FTPClient::setSegmentedDownload(bool enabled) {
+    segmentedDownload = enabled;
+}
+
+/*
+ * setDirectIO function
+ * Selects whether downloads bypass the page cache.
+ * Takes a boolean parameter enabled.
+ * Returns void.
+ */
+void FTPClient::setDirectIO(bool enabled) {
+    directIO = enabled;
+}
+
+/*
+ * setPipelineDepth function
+ * Selects whether uploads and downloads run their disk and network I/O on separate threads.
+ * Takes a parameter depth: the number of PIPELINE_SLOT_SIZE buffers between the two threads
+ * (at least 2), or 0 to do both on the calling thread with sendfile and splice.
+ * Returns void.
+ */
+void FTPClient::setPipelineDepth(unsigned depth) {
+    pipelineDepth = depth == 0 ? 0 : std::max(depth, 2u);
+}
+
+/*
+ * setTls function
+ * Selects explicit FTPS: the next login secures the control channel with AUTH TLS
+ * and every data connection is encrypted (PROT P).
+ * Takes a boolean parameter enabled.
+ * Throws a runtime_error if the client was built without TLS support.
+ * Returns void.
+ */
+void FTPClient::setTls(bool enabled) {
+    if (enabled && !TlsChannel::available()) {
+        throw std::runtime_error("TLS is not available, the client was built without OpenSSL");
+    }
+    tls = enabled;
+}
+
+/*
+ * setBlockMode function
+ * Switches the session between block mode (MODE B) and stream mode (MODE S).
+ * In block mode every transfer is framed in blocks ending with an EOF descriptor, so one
+ * data connection carries consecutive transfers: no PASV, connect or TLS handshake per
+ * file, and the connection keeps its congestion window.
+ * Takes a boolean parameter enabled.
+ * Throws a runtime_error if the server refuses the mode; the session then keeps its current mode.
+ * Returns void.
+ */
+void FTPClient::setBlockMode(bool enabled) {
+    if (enabled == blockMode) {
+        return;
+    }
+    if (!enabled && blockSocket >= 0) {
+        int dataSocket = blockSocket;
+        blockSocket = -1;
+        closeData(dataSocket);
+    }
+    sendCommand(enabled ? "MODE B" : "MODE S");
+    const std::string& response = readResponse();
+    if (response.compare(0, 3, "200") != 0) {
+        throw std::runtime_error("Server refused " + std::string(enabled ? "MODE B" : "MODE S") + ": " + response);
+    }
+    blockMode = enabled;
+}
+
+/*
+ * setActiveMode function
+ * Switches the session between active mode, where the server connects to us after PORT
+ * or EPRT, and passive mode (PASV), where we connect to the server.
+ * Enabling it binds the pool of listening sockets right away; disabling it closes them.
+ * Takes a boolean parameter enabled.
+ * Throws a runtime_error if the listening sockets cannot be opened; the session then stays passive.
+ * Returns void.
+ */
+void FTPClient::setActiveMode(bool enabled) {
+    if (enabled) {
+        fillListeners();
+    } else {
+        for (int listener : listeners) {
+            close(listener);
+        }
+        listeners.clear();
+    }
+    activeMode = enabled;
+}
+
+/*
+ * receivePipelined function
+ * Receives a whole download from a data socket into a file, with a writer thread
+ * emptying the filled buffers of a BufferRing into the file while this thread receives.
+ * A slow disk only stalls the network once every buffer waits to be written, and the
+ * other way round.
+ * Takes parameters:
+ * - dataSocket: the data socket to receive from
+ * - fileFd: the local file
+ * - progress: the progress counters to update, may be null
+ * Throws a runtime_error if receiving or writing fails.
+ * Returns void.
+ */
+void FTPClient::receivePipelined(int dataSocket, int fileFd, TransferProgress* progress) {
+    BufferRing ring(pipelineDepth, PIPELINE_SLOT_SIZE);
+    std::string diskError;
+
+    std::thread writer([&ring, &diskError, fileFd]() {
+        while (BufferRing::Slot* slot = ring.next()) {
+            size_t written = 0;
+            while (written < slot->length) {
+                ssize_t n = write(fileFd, slot->data.data() + written, slot->length - written);
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    diskError = "Failed to write file data: " + std::string(strerror(errno));
+                    ring.abort();
+                    return;
+                }
+                written += static_cast<size_t>(n);
+            }
+            ring.release();
+        }
+    });
+
+    try {
+        bool done = false;
+        while (!done) {
+            BufferRing::Slot* slot = ring.acquire();
+            if (!slot) {
+                break;
+            }
+            // Fill the whole buffer so the writer gets large sequential writes
+            while (slot->length < slot->data.size()) {
+                ssize_t bytesRead = dataRecv(dataSocket, slot->data.data() + slot->length,
+                                             slot->data.size() - slot->length);
+                if (bytesRead == 0) {
+                    done = true;
+                    break;
+                }
+                if (bytesRead < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throwSocketError("Failed to receive file data");
+                }
+                slot->length += static_cast<size_t>(bytesRead);
+                if (progress) {
+                    progress->add(bytesRead);
+                }
+                if (pacer) {
+                    pacer(static_cast<uint64_t>(bytesRead));
+                }
+            }
+            ring.publish();
+        }
+    } catch (const std::exception&) {
+        ring.abort();
+        writer.join();
+        throw;
+    }
+
+    ring.finish();
+    writer.join();
+    if (!diskError.empty()) {
+        throw std::runtime_error(diskError);
+    }
+}
+
+/*
+ * sendPipelined function
+ * Sends a byte range of a local file over a data socket, with a reader thread
+ * filling the buffers of a BufferRing from the file while this thread sends.
+ * Takes parameters:
+ * - fileFd: the descriptor of the local file
+ * - dataSocket: the data socket to send on
+ * - offset: the first byte of the range
+ * - length: the number of bytes to send
+ * Throws a runtime_error if reading the file or sending fails.
+ * Returns void.
+ */
+void FTPClient::sendPipelined(int fileFd, int dataSocket, uint64_t offset, uint64_t length) {
+    BufferRing ring(pipelineDepth, PIPELINE_SLOT_SIZE);
+    std::string diskError;
+
+    std::thread reader([&ring, &diskError, fileFd, offset, length]() {
+        uint64_t position = offset;
+        uint64_t end = offset + length;
+        while (position < end) {
+            BufferRing::Slot* slot = ring.acquire();
+            if (!slot) {
+                return;
+            }
+            size_t wanted = static_cast<size_t>(std::min<uint64_t>(end - position, slot->data.size()));
+            while (slot->length < wanted) {
+                ssize_t n = pread(fileFd, slot->data.data() + slot->length, wanted - slot->length,
+                                  static_cast<off_t>(position + slot->length));
+                if (n <= 0) {
+                    if (n < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    diskError = n == 0 ? "Failed to read file data: file is shorter than expected"
+                                       : "Failed to read file data: " + std::string(strerror(errno));
+                    ring.abort();
+                    return;
+                }
+                slot->length += static_cast<size_t>(n);
+            }
+            position += slot->length;
+            ring.publish();
+        }
+        ring.finish();
+    });
+
+    try {
+        while (BufferRing::Slot* slot = ring.next()) {
+            sendAll(dataSocket, slot->data.data(), slot->length);
+            ring.release();
+        }
+    } catch (const std::exception&) {
+        ring.abort();
+        reader.join();
+        throw;
+    }
+
+    reader.join();
+    if (!diskError.empty()) {
+        throw std::runtime_error(diskError);
+    }
+}
+
+/*
+ * receiveDirect function
+ * Receives a download straight into the aligned buffers of a DirectWriter.
+ * Takes parameters:
+ * - dataSocket: the data socket to receive from
+ * - fullLocalPath: the file to write
+ * - expectedSize: the size reported by SIZE, or -1 if unknown
+ * Throws a runtime_error if receiving or writing fails.
+ * Returns void.
+ */
+void FTPClient::receiveDirect(int dataSocket, const std::string& fullLocalPath, int64_t expectedSize) {
+    DirectWriter writer(fullLocalPath, expectedSize);
+
+    ssize_t bytesRead;
+    while ((bytesRead = dataRecv(dataSocket, writer.buffer(), writer.space())) > 0) {
+        writer.commit(static_cast<size_t>(bytesRead));
+        if (currentProgress) {
+            currentProgress->add(bytesRead);
+        }
+        if (pacer) {
+            pacer(static_cast<uint64_t>(bytesRead));
+        }
+    }
+    if (bytesRead < 0) {
+        throwSocketError("Failed to receive file data");
+    }
+    writer.finish();
+}
+
+/*
+ * preallocate function
+ * Reserves disk space for a file of known size so it is laid out in few extents.
+ * The file size itself is left alone, it grows as the data is written.
+ */
+static void preallocate(int fd, int64_t size) {
+#ifdef __linux__
+    if (size > 0) {
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+    }
+#else
+    (void)fd;
+    (void)size;
+#endif
+}
+
+/*
+ * writeAll function
+ * Writes a whole buffer to a file, continuing after short writes and interruptions.
+ * Returns true on success, false with errno set otherwise.
+ */
+static bool writeAll(int fd, const char* data, size_t length) {
+    size_t written = 0;
+    while (written < length) {
+        ssize_t n = write(fd, data + written, length - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+/*
+ * setDownloadCache function
+ * Selects the local cache downloadFile serves unchanged files from and adds downloads to.
+ * Takes a parameter cache, null to download every file.
+ * Returns void.
+ */
+void FTPClient::setDownloadCache(std::shared_ptr<DownloadCache> cache) {
+    downloadCache = std::move(cache);
+}
+
+/*
+ * setSessionFactory function
+ * Provides a way to open additional logged-in sessions to the same server,
+ * which enables segmented downloads.
+ * Takes a parameter factory returning a new session.
+ * Returns void.
+ */
+void FTPClient::setSessionFactory(SessionFactory factory) {
+    sessionFactory = std::move(factory);
+}
+
+/*
+ * setPacer function
+ * Installs a callback run after every buffer a transfer moves, with the number of bytes.
+ * A scheduler uses it to slow this session down in favour of more urgent transfers.
+ * Takes a parameter pacer, or an empty function to remove it.
+ * Returns void.
+ */
+void FTPClient::setPacer(Pacer pacer) {
+    this->pacer = std::move(pacer);
+}
+
+/*
+ * abandonTransfer function
+ * Closes the data connection of a failed transfer and consumes the server's final reply
+ * so the session can be used again. A reply that does not come is ignored, the caller
+ * is already reporting the failure.
+ * Takes a parameter dataSocket representing the data connection.
+ * Returns void.
+ */
+void FTPClient::abandonTransfer(int dataSocket) {
+    // A failed transfer leaves a block mode connection at an unknown point of its framing
+    if (dataSocket == blockSocket) {
+        blockSocket = -1;
+    }
+    closeData(dataSocket);
+    try {
+        readResponse();
+    } catch (const std::exception&) {
+        // The original error is the one worth reporting
+    }
+}
+
+/*
+ * discardRemote function
+ * Deletes what a failed upload left on the server. A server that refuses, or a session
+ * that no longer works, is ignored, the caller is already reporting the failure.
+ * Takes a parameter remotePath representing the file to delete.
+ * Returns void.
+ */
+void FTPClient::discardRemote(const std::string& remotePath) {
+    try {
+        sendCommand("DELE", remotePath);
+        readResponse();
+    } catch (const std::exception&) {
+        // The original error is the one worth reporting
+    }
+}
+
+/*
+ * openRead function
+ * Starts reading a remote file at an offset with REST + RETR. The data is then taken with
+ * readSome until closeRead, so a caller reads as much or as little of the file as it needs.
+ * A read still open on this session is closed first.
+ * Takes parameters:
+ * - remotePath: the file on the server
+ * - offset: the first byte to read
+ * Throws a runtime_error if the server refuses the offset or the download.
+ * Returns void.
+ */
+void FTPClient::openRead(const std::string& remotePath, uint64_t offset) {
+    closeRead();
+    ensureBinaryType();
+    int dataSocket = openDataChannel();
+
+    // REST and RETR go out together, saving a round trip per read
+    queueCommand("REST", offset);
+    queueCommand("RETR", remotePath);
+    flushCommands();
+
+    const std::string& response = readResponse();
+    if (response.compare(0, 3, "350") != 0) {
+        // The RETR was already sent and would start from offset zero, abandon it
+        std::string restResponse = response;
+        const std::string& retrResponse = readResponse();
+        if (retrResponse.compare(0, 3, "150") == 0 || retrResponse.compare(0, 3, "125") == 0) {
+            abandonTransfer(dataSocket);
+        } else {
+            closeData(dataSocket);
+        }
+        throw std::runtime_error("Server does not support restarting downloads: " + restResponse);
+    }
+
+    const std::string& retrResponse = readResponse();
+    if (retrResponse.compare(0, 3, "150") != 0 && retrResponse.compare(0, 3, "125") != 0) {
+        closeData(dataSocket);
+        throw std::runtime_error("Failed to initiate range download: " + retrResponse);
+    }
+    try {
+        establishData(dataSocket);
+    } catch (const std::exception&) {
+        abandonTransfer(dataSocket);
+        throw;
+    }
+    readSocket = dataSocket;
+}
+
+/*
+ * readSome function
+ * Receives the next bytes of the read started with openRead.
+ * Takes parameters:
+ * - buffer: where to store the bytes
+ * - length: the most bytes to receive
+ * Throws a runtime_error if no read is open or the data connection fails; the read is over then.
+ * Returns the number of bytes received, or 0 at the end of the file, which also ends the read.
+ */
+size_t FTPClient::readSome(char* buffer, size_t length) {
+    if (readSocket < 0) {
+        throw std::runtime_error("No read is open");
+    }
+    ssize_t bytesRead = dataRecv(readSocket, buffer, length);
+    if (bytesRead < 0) {
+        int error = errno;
+        abandonTransfer(readSocket);
+        readSocket = -1;
+        errno = error;
+        throwSocketError("Range download failed");
+    }
+    if (bytesRead == 0) {
+        closeRead();
+    }
+    return static_cast<size_t>(bytesRead);
+}
+
+/*
+ * closeRead function
+ * Ends the read started with openRead, early if the file has more data. The server then
+ * answers with 226 or an abort code (426/450/451), both of which are fine, so the reply is
+ * not waited for here: readResponse consumes it before the reply to the next command.
+ * Returns void.
+ */
+void FTPClient::closeRead() {
+    if (readSocket < 0) {
+        return;
+    }
+    closeData(readSocket);
+    readSocket = -1;
+    ++unreadReadEnds;
+}
+
+/*
+ * fetchRange function
+ * Downloads a byte range of a remote file with REST + RETR and writes it at the same offset locally.
+ * Takes parameters:
+ * - remotePath: the file on the server
+ * - offset: the first byte of the range
+ * - length: the number of bytes to fetch
+ * - fileFd: the local file
+ * - progress: the progress counters to update, may be null
+ * Throws a runtime_error if the server refuses the offset or the range cannot be received.
+ * Returns void.
+ * Once the range is complete the data connection is closed early, see closeRead.
+ */
+void FTPClient::fetchRange(const std::string& remotePath, uint64_t offset, uint64_t length, int fileFd,
+                           TransferProgress* progress) {
+    openRead(remotePath, offset);
+
+    std::vector<char> buffer(64 * 1024);
+    uint64_t received = 0;
+    while (received < length) {
+        size_t wanted = static_cast<size_t>(std::min<uint64_t>(buffer.size(), length - received));
+        size_t bytesRead = readSome(buffer.data(), wanted);
+        if (bytesRead == 0) {
+            throw std::runtime_error("Range download ended early at offset " + std::to_string(offset + received));
+        }
+
+        size_t written = 0;
+        while (written < bytesRead) {
+            ssize_t n = pwrite(fileFd, buffer.data() + written, bytesRead - written,
+                               static_cast<off_t>(offset + received + written));
+            if (n < 0) {
+                int error = errno;
+                closeRead();
+                throw std::runtime_error("Failed to write file data: " + std::string(strerror(error)));
+            }
+            written += n;
+        }
+
+        received += bytesRead;
+        if (progress) {
+            progress->add(bytesRead);
+        }
+    }
+    closeRead();
+}
+
+/*
+ * receiveStream function
+ * Receives a whole download from a data socket into a file.
+ * On Linux the data is spliced from the socket through a pipe into the file without
+ * passing through user space; elsewhere, when splice is refused, or on a TLS data
+ * connection, it is copied.
+ * Takes parameters:
+ * - dataSocket: the data socket to receive from
+ * - fileFd: the local file
+ * - progress: the progress counters to update, may be null
+ * Throws a runtime_error if receiving or writing fails.
+ * Returns void.
+ * With a pipeline depth set the file is written on a separate thread instead, see receivePipelined.
+ */
+void FTPClient::receiveStream(int dataSocket, int fileFd, TransferProgress* progress) {
+    if (pipelineDepth > 0) {
+        receivePipelined(dataSocket, fileFd, progress);
+        return;
+    }
+
+#ifdef __linux__
+    int pipeFds[2];
+    // TLS records must go through OpenSSL, which also reads them when the kernel decrypts
+    if (!dataChannel(dataSocket) && dataSocket != blockSocket && pipe2(pipeFds, O_CLOEXEC) == 0) {
+        fcntl(pipeFds[1], F_SETPIPE_SZ, 1024 * 1024);
+
+        bool spliced = true;
+        while (true) {
+            ssize_t n = splice(dataSocket, nullptr, pipeFds[1], nullptr, 1024 * 1024, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n == 0) {
+                break;
+            }
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                int error = errno;
+                close(pipeFds[0]);
+                close(pipeFds[1]);
+                if (error == EINVAL) {
+                    // Nothing was consumed from the socket yet, fall back to copying
+                    spliced = false;
+                    break;
+                }
+                errno = error;
+                throwSocketError("Failed to receive file data");
+            }
+            while (n > 0) {
+                ssize_t m = splice(pipeFds[0], nullptr, fileFd, nullptr, static_cast<size_t>(n), SPLICE_F_MOVE);
+                if (m <= 0) {
+                    close(pipeFds[0]);
+                    close(pipeFds[1]);
+                    throw std::runtime_error("Failed to write file data: " + std::string(strerror(errno)));
+                }
+                n -= m;
+                if (progress) {
+                    progress->add(m);
+                }
+                if (pacer) {
+                    pacer(static_cast<uint64_t>(m));
+                }
+            }
+        }
+        if (spliced) {
+            close(pipeFds[0]);
+            close(pipeFds[1]);
+            return;
+        }
+    }
+#endif
+
+    char buffer[BUFFER_SIZE];
+    ssize_t bytesRead;
+    // Read the data from the data socket and write it to the file
+    while ((bytesRead = dataRecv(dataSocket, buffer, BUFFER_SIZE)) > 0) {
+        ssize_t written = 0;
+        while (written < bytesRead) {
+            ssize_t n = write(fileFd, buffer + written, bytesRead - written);
+            if (n < 0) {
+                throw std::runtime_error("Failed to write file data: " + std::string(strerror(errno)));
+            }
+            written += n;
+        }
+        if (progress) {
+            progress->add(bytesRead);
+        }
+        if (pacer) {
+            pacer(static_cast<uint64_t>(bytesRead));
+        }
+    }
+    if (bytesRead < 0) {
+        throwSocketError("Failed to receive file data");
+    }
+}
+
+/*
+ * downloadFile function
  * Downloads a file from the server.
  * Takes parameters:
  * - remotePath: the remote path of the file to download
  * - localPath: the local path where the file will be saved
  * Throws a runtime_error if the download fails.
  * Returns void.
- * The function enters passive mode and obtains the data socket for data transfer.
- * It sends the RETR command to the server with the remote path.
- * The function reads the server's response and checks if the response code is 226 (Closing data connection).
- * The function then reads the data from the data socket and writes it to a file in binary mode.
- * The function closes the file and the data socket after the download is complete.
+ * The function first queries SIZE and MDTM. If the local copy has the same size and
+ * modification time the download is skipped; if the download cache holds the file as the
+ * server has it now, it is served from there. Otherwise the file is preallocated and
+ * the transfer strategy is picked from the size:
+ * - direct: when direct I/O is enabled, written around the page cache
+ * - segmented: with segmented downloads enabled, large files are fetched as parallel REST ranges
+ *   when at least one extra session can be opened, and as a stream on this session otherwise
+ * - stream: everything else, spliced zero-copy into the file where the platform allows
+ * A stream transfer enters passive mode, sends RETR, checks for 150/125,
+ * receives until the server closes the data connection and expects 226.
+ * The local modification time is set to the remote one so the next download can be skipped,
+ * and the file is added to the download cache.
  */
 void FTPClient::downloadFile(const std::string& remotePath, const std::string& localPath) {
     // Check if the 'drive' directory exists
@@ -312,43 +2638,629 @@ void FTPClient::downloadFile(const std::string& remotePath, const std::string& l
     // Construct the full local path
     std::string fullLocalPath = driveFolder + "/" + localPath;
 
-    int dataSocket = enterPassiveMode();
+    // Plan the download from the size and modification time of the remote file
+    int64_t size = -1;
+    time_t modified = 0;
+    bool haveModified = remoteStat(remotePath, size, modified);
 
-    // Send the RETR command to the server
-    sendCommand("RETR " + remotePath);
-    std::cout << readResponse();
+    struct stat localStat = {};
+    if (size >= 0 && haveModified && stat(fullLocalPath.c_str(), &localStat) == 0 &&
+        S_ISREG(localStat.st_mode) && localStat.st_size == size && localStat.st_mtime == modified) {
+        std::cout << "Local copy is up to date, skipping download: " << remotePath << std::endl;
+        return;
+    }
+    std::string cacheSource = location(remotePath);
+    if (downloadCache && size >= 0 && haveModified && downloadCache->fetch(cacheSource, size, modified, fullLocalPath)) {
+        std::cout << "Served from the download cache: " << remotePath << std::endl;
+        return;
+    }
+    DownloadCache::detach(fullLocalPath);
 
-    // Open the file for writing in binary mode
-    std::ofstream file(fullLocalPath, std::ios::binary);
-    if (!file.is_open()) {
-        throw std::runtime_error("Failed to create file: " + fullLocalPath);
+    ProgressScope progress(currentProgress, remotePath, size > 0 ? static_cast<uint64_t>(size) : 0);
+
+    // The first extra session is opened up front, a server refusing it gets a plain RETR instead
+    std::unique_ptr<FTPClient> spare;
+    if (segmentedDownload && !directIO && sessionFactory && size >= SEGMENTED_DOWNLOAD_SIZE) {
+        try {
+            spare = sessionFactory();
+        } catch (const std::exception& ex) {
+            std::cerr << "No extra session, downloading over this one: " << ex.what() << std::endl;
+        }
     }
 
-    // Read the data from the data socket and write it to the file
+    if (spare) {
+        int fileFd = open(fullLocalPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fileFd < 0) {
+            throw std::runtime_error("Failed to create file: " + fullLocalPath);
+        }
+        preallocate(fileFd, size);
+
+        // The first stream takes the session opened above, the others log in themselves
+        std::mutex spareMutex;
+        SessionFactory factory = [&]() -> std::unique_ptr<FTPClient> {
+            {
+                std::lock_guard<std::mutex> lock(spareMutex);
+                if (spare) {
+                    return std::move(spare);
+                }
+            }
+            return sessionFactory();
+        };
+
+        std::cout << "Downloading " << remotePath << " (" << size << " bytes) over up to "
+                  << SEGMENTED_DOWNLOAD_STREAMS << " sessions" << std::endl;
+        unsigned sessions = 0;
+        try {
+            sessions = SegmentedTransfer::download(factory, remotePath, fileFd, static_cast<uint64_t>(size),
+                                                   SEGMENTED_DOWNLOAD_STREAMS, currentProgress.get());
+        } catch (const std::exception&) {
+            close(fileFd);
+            throw;
+        }
+        close(fileFd);
+        std::cout << "Segmented download used " << sessions << " sessions" << std::endl;
+    } else {
+        int dataSocket = openDataChannel();
+
+        // Send the RETR command to the server
+        sendCommand("RETR", remotePath);
+        const std::string& response = readResponse();
+        std::cout << response;
+
+        // Without a 150/125 the server never opens the data connection
+        if (response.compare(0, 3, "150") != 0 && response.compare(0, 3, "125") != 0) {
+            closeData(dataSocket);
+            throw std::runtime_error("Failed to initiate file download: " + response);
+        }
+
+        try {
+            establishData(dataSocket);
+            if (directIO) {
+                receiveDirect(dataSocket, fullLocalPath, size);
+            } else {
+                // Open the file for writing in binary mode
+                int fileFd = open(fullLocalPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fileFd < 0) {
+                    throw std::runtime_error("Failed to create file: " + fullLocalPath);
+                }
+                preallocate(fileFd, size);
+                try {
+                    receiveStream(dataSocket, fileFd, currentProgress.get());
+                } catch (const std::exception&) {
+                    close(fileFd);
+                    throw;
+                }
+                close(fileFd);
+            }
+        } catch (const std::exception&) {
+            abandonTransfer(dataSocket);
+            throw;
+        }
+
+        // Close the data socket
+        closeData(dataSocket);
+
+        // Read the final response from the server
+        const std::string& finalResponse = readResponse();
+        if (!checkResponseCode(finalResponse, "226")) {
+            throw std::runtime_error("Failed to download file: " + finalResponse);
+        }
+    }
+
+    // Mirror the remote modification time so an unchanged file is not fetched again
+    if (haveModified) {
+        timespec times[2] = {{modified, 0}, {modified, 0}};
+        utimensat(AT_FDCWD, fullLocalPath.c_str(), times, 0);
+        if (downloadCache) {
+            downloadCache->store(cacheSource, size, modified, fullLocalPath);
+        }
+    }
+
+    std::cout << "File downloaded successfully: " << remotePath << std::endl;
+}
+
+/*
+ * downloadFiles function
+ * Downloads several files over this one control connection, overlapping their transfers.
+ * Takes a parameter remotePaths listing the files; each is saved under the same name in 'drive'.
+ * Throws a runtime_error if the control connection fails.
+ * Returns the number of files that failed.
+ * As soon as a RETR is answered with 150 the PASV for the next file is sent, so up to
+ * MAX_DATA_CHANNELS data connections are open at once. All of them and the control socket
+ * are serviced with one poll loop, which keeps a server that handles one command at a time
+ * streaming while later commands wait for it.
+ * At most one command is outstanding at a time. Replies are matched by their code and the
+ * command state: 226 and 426 complete the oldest transfer that got its 1xx reply, and so does
+ * 451 while no RETR is outstanding; any other reply, a 451 to an outstanding RETR included,
+ * answers the command.
+ * In block mode the files follow each other on one data connection instead, see downloadFilesBlock.
+ */
+size_t FTPClient::downloadFiles(const std::vector<std::string>& remotePaths) {
+    if (blockMode) {
+        return downloadFilesBlock(remotePaths);
+    }
+
+    struct Channel {
+        std::string remotePath;
+        int dataSocket = -1;
+        int fileFd = -1;
+        bool dataDone = false;
+        bool replied = false;
+        bool ok = true;
+        std::shared_ptr<TransferProgress> progress;
+    };
+
+    const std::string driveFolder = "drive";
+    std::filesystem::create_directories(driveFolder);
+    ensureBinaryType();
+
+    enum class Pending { None, Announce, Retr };
+    Pending pending = Pending::None;
+    int pendingSocket = -1;
+    size_t next = 0;
+    size_t failures = 0;
+    std::deque<Channel> channels;
     char buffer[BUFFER_SIZE];
-    int bytesRead;
-    // Read the data from the data socket and write it to the file
-    while ((bytesRead = recv(dataSocket, buffer, BUFFER_SIZE, 0)) > 0) {
-        file.write(buffer, bytesRead);
+
+    auto issueNext = [&]() {
+        if (pending == Pending::None && next < remotePaths.size() && channels.size() < MAX_DATA_CHANNELS) {
+            if (activeMode && !activeConfirmed) {
+                // Nothing is outstanding yet, so the first announcement can wait for its reply
+                pendingSocket = enterActiveMode();
+                sendCommand("RETR", remotePaths[next]);
+                pending = Pending::Retr;
+            } else if (activeMode) {
+                // Completions of earlier transfers may come before the reply, so it is read here, not by readResponse
+                std::string command;
+                pendingSocket = announceListener(command);
+                queueCommand(command);
+                sendCommand("RETR", remotePaths[next]);
+                pending = Pending::Announce;
+            } else {
+                sendCommand("PASV");
+                pending = Pending::Announce;
+            }
+        }
+    };
+    auto failNext = [&](const std::string& reason) {
+        std::cerr << "Failed to download " << remotePaths[next] << ": " << reason << std::endl;
+        if (pendingSocket >= 0) {
+            closeData(pendingSocket);
+            pendingSocket = -1;
+        }
+        ++failures;
+        ++next;
+        pending = Pending::None;
+    };
+    auto finishData = [this](Channel& channel) {
+        channel.dataDone = true;
+        closeData(channel.dataSocket);
+        if (channel.fileFd >= 0) {
+            close(channel.fileFd);
+        }
+    };
+
+    issueNext();
+    while (pending != Pending::None || !channels.empty()) {
+        std::vector<pollfd> fds;
+        fds.push_back({controlSocket, POLLIN, 0});
+        // Data TLS already decrypted is invisible to poll
+        bool dataReady = false;
+        for (Channel& channel : channels) {
+            fds.push_back({channel.dataDone ? -1 : channel.dataSocket, POLLIN, 0});
+            TlsChannel* tlsChannel = channel.dataDone ? nullptr : dataChannel(channel.dataSocket);
+            dataReady = dataReady || (tlsChannel && tlsChannel->pending() > 0);
+        }
+
+        // A reply may already sit in the receive buffer, behind the one read last
+        bool replyReady = memchr(receiveBuffer + receiveStart, '\n', receiveEnd - receiveStart) != nullptr ||
+                          (controlTls && controlTls->pending() > 0);
+        int ready = poll(fds.data(), fds.size(), replyReady || dataReady ? 0 : timeouts.stallMs);
+        if (ready < 0 && errno != EINTR) {
+            throw std::runtime_error("Failed to wait for transfers: " + std::string(strerror(errno)));
+        }
+        if (ready == 0 && !replyReady && !dataReady) {
+            throw TimeoutError("Timed out: no reply or data for " + std::to_string(timeouts.stallMs) + " ms");
+        }
+
+        for (size_t i = 0; i < channels.size(); ++i) {
+            Channel& channel = channels[i];
+            TlsChannel* tlsChannel = channel.dataDone ? nullptr : dataChannel(channel.dataSocket);
+            bool readable = (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) ||
+                            (tlsChannel && tlsChannel->pending() > 0);
+            if (channel.dataDone || !readable) {
+                continue;
+            }
+            ssize_t bytesRead = dataRecv(channel.dataSocket, buffer, BUFFER_SIZE);
+            if (bytesRead > 0) {
+                if (!writeAll(channel.fileFd, buffer, static_cast<size_t>(bytesRead))) {
+                    channel.ok = false;
+                    finishData(channel);
+                } else {
+                    channel.progress->add(bytesRead);
+                }
+            } else if (bytesRead == 0 || errno != EINTR) {
+                channel.ok = channel.ok && bytesRead == 0;
+                finishData(channel);
+            }
+        }
+
+        if (replyReady || (fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            const std::string& response = readResponse();
+            if (response.empty()) {
+                throw std::runtime_error("Server closed the control connection");
+            }
+
+            // 226 and 426 only ever end a transfer; a 451 may also refuse the RETR in flight
+            bool completion = response.compare(0, 3, "226") == 0 || response.compare(0, 3, "426") == 0 ||
+                              (pending != Pending::Retr && response.compare(0, 3, "451") == 0);
+            auto running = std::find_if(channels.begin(), channels.end(),
+                                        [](const Channel& channel) { return !channel.replied; });
+
+            if (completion && running != channels.end()) {
+                running->replied = true;
+                running->ok = running->ok && response[0] == '2';
+            } else if (pending == Pending::Announce && activeMode) {
+                // The RETR is already sent; after a refusal its reply is an error as well
+                if (response.compare(0, 3, "200") != 0) {
+                    std::cerr << "Server refused the data connection address: " << response;
+                }
+                pending = Pending::Retr;
+            } else if (pending == Pending::Announce) {
+                if (response.compare(0, 3, "227") != 0) {
+                    failNext(response);
+                } else {
+                    try {
+                        pendingSocket = connectPassive(response);
+                        sendCommand("RETR", remotePaths[next]);
+                        pending = Pending::Retr;
+                    } catch (const std::runtime_error& ex) {
+                        failNext(ex.what());
+                    }
+                }
+            } else if (pending == Pending::Retr) {
+                if (response[0] != '1') {
+                    failNext(response);
+                } else {
+                    Channel channel;
+                    channel.remotePath = remotePaths[next];
+                    channel.dataSocket = pendingSocket;
+                    try {
+                        establishData(pendingSocket);
+                        std::string localPath = driveFolder + "/" + channel.remotePath;
+                        DownloadCache::detach(localPath);
+                        channel.fileFd = open(localPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                        channel.ok = channel.fileFd >= 0;
+                    } catch (const std::runtime_error& ex) {
+                        // The server still answers the RETR, so the channel stays to take its reply
+                        std::cerr << "Failed to download " << channel.remotePath << ": " << ex.what() << std::endl;
+                        channel.ok = false;
+                    }
+                    if (!channel.ok) {
+                        finishData(channel);
+                    }
+                    channel.progress = ProgressMonitor::instance().track(channel.remotePath, 0);
+                    channels.push_back(std::move(channel));
+                    pendingSocket = -1;
+                    ++next;
+                    pending = Pending::None;
+                }
+            } else {
+                std::cerr << "Unexpected reply: " << response;
+            }
+        }
+
+        // Retire transfers whose data and final reply have both arrived, in order
+        while (!channels.empty() && channels.front().dataDone && channels.front().replied) {
+            Channel& channel = channels.front();
+            ProgressMonitor::instance().untrack(channel.progress);
+            if (channel.ok) {
+                std::cout << "File downloaded successfully: " << channel.remotePath << std::endl;
+            } else {
+                std::cerr << "Failed to download " << channel.remotePath << std::endl;
+                ++failures;
+            }
+            channels.pop_front();
+        }
+
+        issueNext();
     }
+    return failures;
+}
 
-    // Close the file and the data socket
-    file.close();
-    close(dataSocket);
+/*
+ * downloadFilesBlock function
+ * Downloads several files in block mode, one after the other on a single data connection.
+ * Takes a parameter remotePaths listing the files; each is saved under the same name in 'drive'.
+ * Throws a runtime_error if the control or data connection fails; the RETRs still outstanding
+ * are then lost with it, so the session should be reopened.
+ * Returns the number of files the server refused or that could not be written.
+ * Up to BLOCK_PIPELINE_DEPTH RETRs are sent ahead, so the server starts the next file
+ * as soon as the EOF block of the previous one is out: a file costs no PASV, no connect,
+ * no TLS handshake and no round trip.
+ */
+size_t FTPClient::downloadFilesBlock(const std::vector<std::string>& remotePaths) {
+    const std::string driveFolder = "drive";
+    std::filesystem::create_directories(driveFolder);
+    ensureBinaryType();
+
+    int dataSocket = openDataChannel();
+    size_t sent = 0;
+    size_t failures = 0;
+    char buffer[BUFFER_SIZE];
+
+    auto sendAhead = [&](size_t received) {
+        while (sent < remotePaths.size() && sent - received < BLOCK_PIPELINE_DEPTH) {
+            queueCommand("RETR", remotePaths[sent++]);
+        }
+        flushCommands();
+    };
 
-    // Read the final response from the server
-    std::string response = readResponse();
-    if (!checkResponseCode(response, "226")) {
-        throw std::runtime_error("Failed to download file: " + response);
+    sendAhead(0);
+    for (size_t i = 0; i < remotePaths.size(); ++i) {
+        const std::string& remotePath = remotePaths[i];
+        const std::string& response = readResponse();
+        if (response.empty()) {
+            throw std::runtime_error("Server closed the control connection");
+        }
+        if (response[0] != '1') {
+            std::cerr << "Failed to download " << remotePath << ": " << response;
+            ++failures;
+            sendAhead(i + 1);
+            continue;
+        }
+
+        std::string localPath = driveFolder + "/" + remotePath;
+        auto progress = ProgressMonitor::instance().track(remotePath, 0);
+        bool written = true;
+        startBlockTransfer();
+        try {
+            establishData(dataSocket);
+            // The data has to be read off the connection even if it cannot be stored
+            DownloadCache::detach(localPath);
+            int fileFd = open(localPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            written = fileFd >= 0;
+            ssize_t bytesRead;
+            while ((bytesRead = dataRecv(dataSocket, buffer, BUFFER_SIZE)) != 0) {
+                if (bytesRead < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    if (fileFd >= 0) {
+                        close(fileFd);
+                    }
+                    throwSocketError("Failed to receive " + remotePath);
+                }
+                if (written && !writeAll(fileFd, buffer, static_cast<size_t>(bytesRead))) {
+                    written = false;
+                }
+                progress->add(bytesRead);
+            }
+            if (fileFd >= 0) {
+                close(fileFd);
+            }
+        } catch (const std::exception&) {
+            ProgressMonitor::instance().untrack(progress);
+            abandonTransfer(dataSocket);
+            throw;
+        }
+        ProgressMonitor::instance().untrack(progress);
+        closeData(dataSocket);
+
+        const std::string& finalResponse = readResponse();
+        if (!written || !checkResponseCode(finalResponse, "226")) {
+            std::cerr << "Failed to download " << remotePath << (written ? ": " + finalResponse : "\n");
+            ++failures;
+        } else {
+            std::cout << "File downloaded successfully: " << remotePath << std::endl;
+        }
+        sendAhead(i + 1);
     }
+    return failures;
+}
 
-    std::cout << "File downloaded successfully: " << remotePath << std::endl;
+/*
+ * isCompressedArchive function
+ * Tells whether a remote archive name asks for gzip compression (.tar.gz or .tgz).
+ */
+static bool isCompressedArchive(const std::string& remotePath) {
+    auto endsWith = [&remotePath](const std::string& suffix) {
+        return remotePath.size() >= suffix.size() &&
+               remotePath.compare(remotePath.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+    return endsWith(".tar.gz") || endsWith(".tgz");
+}
+
+/*
+ * uploadDirectoryArchive function
+ * Uploads a directory under 'drive' as a single tar archive over one data connection.
+ * Takes parameters:
+ * - localDir: the directory to upload, relative to 'drive'
+ * - remotePath: the remote path of the archive, compressed if it ends in .tar.gz or .tgz
+ * Throws a runtime_error if the directory does not exist or if the upload fails.
+ * Returns void.
+ * The archive is generated while it is sent: every file is read straight into the
+ * send buffer behind its header, so no temporary archive is written and
+ * thousands of small files cost one PASV + STOR round trip instead of one each.
+ * It is stored under the remote path with ".part" appended and renamed with RNFR + RNTO
+ * once complete, so a failed upload never leaves a truncated archive under the real name;
+ * the partial one is deleted again.
+ */
+void FTPClient::uploadDirectoryArchive(const std::string& localDir, const std::string& remotePath) {
+    const std::string driveFolder = "drive";
+    std::string fullLocalDir = driveFolder + "/" + localDir;
+
+    std::error_code ec;
+    if (!std::filesystem::is_directory(fullLocalDir, ec)) {
+        throw std::runtime_error("Directory not found: " + fullLocalDir);
+    }
+
+    std::string partPath = remotePath + ".part";
+    int dataSocket = openDataChannel();
+    sendCommand("STOR", partPath);
+    const std::string& response = readResponse();
+
+    if (!checkResponseCode(response, "150") && !checkResponseCode(response, "125")) {
+        closeData(dataSocket);
+        throw std::runtime_error("Failed to initiate archive upload: " + response);
+    }
+
+    std::cout << "Starting archive upload: " << fullLocalDir << " to " << remotePath << std::endl;
+    auto start = std::chrono::steady_clock::now();
+
+    ProgressScope progress(currentProgress, remotePath, 0);
+    TarWriter writer([this, dataSocket](const char* data, size_t length) {
+        sendAll(dataSocket, data, length);
+    }, isCompressedArchive(remotePath));
+
+    try {
+        establishData(dataSocket);
+        for (auto it = std::filesystem::recursive_directory_iterator(fullLocalDir);
+             it != std::filesystem::recursive_directory_iterator(); ++it) {
+            std::string name = std::filesystem::relative(it->path(), fullLocalDir).generic_string();
+            if (it->is_directory()) {
+                writer.addDirectory(name);
+            } else if (it->is_regular_file()) {
+                writer.addFile(it->path().string(), name);
+            }
+        }
+        writer.finish();
+        finishUpload(dataSocket);
+    } catch (const std::exception&) {
+        abandonTransfer(dataSocket);
+        discardRemote(partPath);
+        throw;
+    }
+    closeData(dataSocket);
+
+    const std::string& finalResponse = readResponse();
+    if (!checkResponseCode(finalResponse, "226") && !checkResponseCode(finalResponse, "250")) {
+        // Taken before the DELE reply overwrites it
+        std::string error = "Archive upload failed: " + finalResponse;
+        discardRemote(partPath);
+        throw std::runtime_error(error);
+    }
+
+    // RNFR and RNTO go out together, saving a round trip
+    queueCommand("RNFR", partPath);
+    queueCommand("RNTO", remotePath);
+    flushCommands();
+    bool renameFromAccepted = checkResponseCode(readResponse(), "350");
+    const std::string& renameResponse = readResponse();
+    if (!renameFromAccepted || !checkResponseCode(renameResponse, "250")) {
+        throw std::runtime_error("Failed to rename uploaded archive " + partPath + ": " + renameResponse);
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Archive uploaded successfully: " << writer.fileCount() << " files, " << writer.byteCount()
+              << " bytes in " << seconds << " s (" << (seconds > 0 ? writer.fileCount() / seconds : 0)
+              << " files/s)" << std::endl;
+}
+
+/*
+ * downloadDirectoryArchive function
+ * Downloads a tar archive and unpacks it under 'drive' while it is received.
+ * Takes parameters:
+ * - remotePath: the remote path of the archive, compressed if it ends in .tar.gz or .tgz
+ * - localDir: the directory to unpack into, relative to 'drive'
+ * Throws a runtime_error if the download fails or the archive is corrupt.
+ * Returns void.
+ * Small files are written by a pool of worker threads so the receive loop is not
+ * held up by file creation, large ones are written as their data arrives.
+ */
+void FTPClient::downloadDirectoryArchive(const std::string& remotePath, const std::string& localDir) {
+    const std::string driveFolder = "drive";
+    std::string fullLocalDir = driveFolder + "/" + localDir;
+
+    unsigned workers = std::min(8u, std::max(2u, std::thread::hardware_concurrency()));
+    TarReader reader(fullLocalDir, isCompressedArchive(remotePath), workers);
+
+    int dataSocket = openDataChannel();
+    sendCommand("RETR", remotePath);
+    const std::string& response = readResponse();
+
+    if (!checkResponseCode(response, "150") && !checkResponseCode(response, "125")) {
+        closeData(dataSocket);
+        throw std::runtime_error("Failed to initiate archive download: " + response);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    ProgressScope progress(currentProgress, remotePath, 0);
+
+    std::vector<char> buffer(256 * 1024);
+    ssize_t bytesRead;
+    try {
+        establishData(dataSocket);
+        while ((bytesRead = dataRecv(dataSocket, buffer.data(), buffer.size())) > 0) {
+            reader.feed(buffer.data(), static_cast<size_t>(bytesRead));
+            currentProgress->add(bytesRead);
+        }
+        if (bytesRead < 0) {
+            throwSocketError("Failed to receive archive data");
+        }
+        reader.finish();
+    } catch (const std::exception&) {
+        abandonTransfer(dataSocket);
+        throw;
+    }
+    closeData(dataSocket);
+
+    const std::string& finalResponse = readResponse();
+    if (!checkResponseCode(finalResponse, "226")) {
+        throw std::runtime_error("Failed to download archive: " + finalResponse);
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Archive unpacked successfully: " << reader.fileCount() << " files, " << reader.byteCount()
+              << " bytes in " << seconds << " s (" << (seconds > 0 ? reader.fileCount() / seconds : 0)
+              << " files/s)" << std::endl;
+}
+
+/*
+ * parseListLine function
+ * Reads a regular file out of one line of a Unix-style LIST reply:
+ * "-rw-r--r-- 1 owner group <size> <month> <day> <time or year> <name>".
+ * Takes parameters:
+ * - line: the line, without its line ending
+ * - entry: receives the name and size
+ * Returns true if the line describes a regular file, false for directories, links and other lines.
+ */
+static bool parseListLine(const std::string& line, FTPClient::ListEntry& entry) {
+    if (line.empty() || line[0] != '-') {
+        return false;
+    }
+    // Skip the eight fields before the name, which may itself contain spaces
+    size_t position = 0;
+    std::string sizeField;
+    for (int field = 0; field < 8; ++field) {
+        size_t start = line.find_first_not_of(' ', position);
+        if (start == std::string::npos) {
+            return false;
+        }
+        position = line.find(' ', start);
+        if (position == std::string::npos) {
+            return false;
+        }
+        if (field == 4) {
+            sizeField = line.substr(start, position - start);
+        }
+    }
+    size_t nameStart = line.find_first_not_of(' ', position);
+    if (nameStart == std::string::npos || sizeField.empty() ||
+        sizeField.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    entry.name = line.substr(nameStart);
+    entry.size = std::strtoll(sizeField.c_str(), nullptr, 10);
+    return true;
 }
 
 /*
  * listFiles function
  * Lists the files in the current directory on the server.
- * Returns void.
+ * Returns the regular files of the listing with their sizes, in listing order; lines in
+ * another format are printed but not returned.
  * The function enters passive mode and obtains the data socket for data transfer.
  * It sends the LIST command to the server to list the files in the current directory.
  * The function reads the server's response and prints it to the console.
@@ -356,9 +3268,9 @@ void FTPClient::downloadFile(const std::string& remotePath, const std::string& l
  * The function closes the data socket after reading all the data.
  * The function reads the final response from the server and prints it to the console.
  */
-void FTPClient::listFiles() {
+std::vector<FTPClient::ListEntry> FTPClient::listFiles() {
     // Enter passive mode and obtain the data socket
-    int dataSocket = enterPassiveMode();
+    int dataSocket = openDataChannel();
 
     // Send the LIST command to the server
     sendCommand("LIST");
@@ -366,17 +3278,45 @@ void FTPClient::listFiles() {
     // Print the server's response
     std::cout << readResponse();
 
+    try {
+        establishData(dataSocket);
+    } catch (const std::exception&) {
+        abandonTransfer(dataSocket);
+        throw;
+    }
+
     char buffer[BUFFER_SIZE];
-    int bytesRead;
+    ssize_t bytesRead;
+    std::string listing;
 
     // Receive and print the data from the data socket
-    while ((bytesRead = recv(dataSocket, buffer, BUFFER_SIZE, 0)) > 0) {
+    while ((bytesRead = dataRecv(dataSocket, buffer, BUFFER_SIZE)) > 0) {
         std::cout.write(buffer, bytesRead);
+        listing.append(buffer, static_cast<size_t>(bytesRead));
     }
 
     // Close the data connection
-    close(dataSocket);
+    closeData(dataSocket);
 
     // Print the final response from the server
     std::cout << readResponse();
+
+    std::vector<ListEntry> entries;
+    size_t lineStart = 0;
+    while (lineStart < listing.size()) {
+        size_t lineEnd = listing.find('\n', lineStart);
+        if (lineEnd == std::string::npos) {
+            lineEnd = listing.size();
+        }
+        std::string line = listing.substr(lineStart, lineEnd - lineStart);
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        ListEntry entry;
+        if (parseListLine(line, entry)) {
+            entries.push_back(std::move(entry));
+        }
+        lineStart = lineEnd + 1;
+    }
+    return entries;
 }
@@ -10,28 +10,203 @@
 #include <netinet/in.h>
 #include <cstring>
 #include <stdexcept>
+#include <cstdint>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <ctime>
+#include <unordered_map>
+#include <deque>
+#include "TransferProgress.h"
+#include "TlsChannel.h"
+#include "DownloadCache.h"
+#include "Chunker.h"
+
+/*
+ * TimeoutError class
+ * Thrown when a connection, a reply or a transfer does not make progress in time,
+ * so callers can retry or fail over instead of treating it like a refusal.
+ */
+class TimeoutError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
 
 class FTPClient {
+public:
+    // Limits on how long a session waits, in milliseconds
+    struct Timeouts {
+        int connectMs = 10000;
+        int idleMs = 60000;
+        int stallMs = 30000;
+    };
+
+    using SessionFactory = std::function<std::unique_ptr<FTPClient>()>;
+    using Pacer = std::function<void(uint64_t)>;
+
+    // A regular file of a directory listing
+    struct ListEntry {
+        std::string name;
+        int64_t size = -1;
+    };
+
 private:
     int controlSocket;
     std::string serverAddress;
     int serverPort;
+    std::shared_ptr<TransferProgress> currentProgress;
+    bool binaryType = false;
+    bool directIO = false;
+    // Slots of the ring between the disk and network threads of a transfer, 0 for a single thread
+    unsigned pipelineDepth = 0;
+    bool verbose;
+    SessionFactory sessionFactory;
+    // Large uploads are split into ranges stored over extra sessions, see uploadSegmented
+    bool segmentedUpload = false;
+    // Large downloads are fetched as ranges over extra sessions, see downloadFile
+    bool segmentedDownload = false;
+    std::shared_ptr<DownloadCache> downloadCache;
+    Pacer pacer;
+    Timeouts timeouts;
+    static Timeouts defaults;
+    static std::mutex defaultTimeoutsMutex;
+    std::vector<std::string> features;
+    bool tls = false;
+    bool reportedTls = false;
+    std::unique_ptr<TlsChannel> controlTls;
+    // TLS state of the open data connections, by socket
+    std::unordered_map<int, std::unique_ptr<TlsChannel>> dataTls;
+
+    // Block mode (MODE B): one data connection stays open and carries every transfer
+    bool blockMode = false;
+    int blockSocket = -1;
+    // Framing state of the current transfer on blockSocket
+    size_t blockRemaining = 0;
+    bool blockLast = false;
+    bool blockEof = false;
+    bool blockReceived = false;
+    bool blockSent = false;
+    bool blockEofSent = false;
+    std::vector<char> blockFrame;
+    std::string blockMarker;
+
+    // Active mode (PORT/EPRT): the server connects to listening sockets bound ahead of time
+    bool activeMode = false;
+    bool useEprt = false;
+    // Set once the server accepted an announcement; later ones go out with the transfer command
+    bool activeConfirmed = false;
+    // Replies to announcements sent along with a transfer command, read before its reply
+    mutable size_t unreadAnnouncements = 0;
+    std::deque<int> listeners;
+    // Data sockets announced to the server whose connection is not accepted yet, with their listener
+    std::unordered_map<int, int> pendingAccepts;
+
+    // Data connection of the read started with openRead, -1 if none is open
+    int readSocket = -1;
+    // Final replies of reads ended by closeRead, read before the next reply
+    mutable size_t unreadReadEnds = 0;
+
+    // Control channel buffers, reused for every command and reply of the session
+    static constexpr size_t CONTROL_BUFFER_SIZE = 4096;
+    mutable std::string commandBuffer;
+    mutable std::string reply;
+    mutable char receiveBuffer[CONTROL_BUFFER_SIZE];
+    mutable size_t receiveStart = 0;
+    mutable size_t receiveEnd = 0;
 
     int createSocket();
+    static void waitFor(int fd, short events, int timeoutMs, const char* what);
+    [[noreturn]] static void throwSocketError(const std::string& what);
+    void connectSocket(int fd, const sockaddr_in& address);
+    void configureSocket(int fd) const;
+    void configureDataSocket(int fd) const;
     void sendCommand(const std::string& cmd) const;
-    std::string readResponse() const;
+    void sendCommand(const char* verb, const std::string& argument) const;
+    void sendCommand(const char* verb, uint64_t argument) const;
+    void queueCommand(const std::string& cmd) const;
+    void queueCommand(const char* verb, const std::string& argument) const;
+    void queueCommand(const char* verb, uint64_t argument) const;
+    void flushCommands() const;
+    const std::string& readResponse() const;
     int enterPassiveMode();
+    int openDataChannel();
+    int connectPassive(const std::string& response);
+    int createListener();
+    void fillListeners();
+    int announceListener(std::string& command);
+    std::string activeCommand(int dataSocket) const;
+    int enterActiveMode();
+    void establishData(int dataSocket);
+    void abandonTransfer(int dataSocket);
+    void discardRemote(const std::string& remotePath);
+    void startTls();
+    void secureDataSocket(int dataSocket);
+    TlsChannel* dataChannel(int dataSocket) const;
+    ssize_t dataRecv(int dataSocket, char* buffer, size_t length);
+    ssize_t dataSend(int dataSocket, const char* data, size_t length);
+    ssize_t rawRecv(int dataSocket, char* buffer, size_t length);
+    ssize_t rawSend(int dataSocket, const char* data, size_t length);
+    bool rawSendAll(int dataSocket, const char* data, size_t length);
+    ssize_t blockRecv(char* buffer, size_t length);
+    ssize_t blockSend(const char* data, size_t length);
+    void startBlockTransfer();
+    void finishUpload(int dataSocket);
+    void closeData(int dataSocket);
+    size_t downloadFilesBlock(const std::vector<std::string>& remotePaths);
+    void ensureBinaryType();
+    void receiveStream(int dataSocket, int fileFd, TransferProgress* progress);
+    void receiveDirect(int dataSocket, const std::string& fullLocalPath, int64_t expectedSize);
+    void receivePipelined(int dataSocket, int fileFd, TransferProgress* progress);
+    void sendPipelined(int fileFd, int dataSocket, uint64_t offset, uint64_t length);
+    void sendAll(int socket, const char* data, size_t length);
+    void sendFileRange(int fileFd, int dataSocket, uint64_t offset, uint64_t length);
+    void parseFeatures(const std::string& response);
+    std::string featureCachePath() const;
+    bool loadFeatures();
+    void saveFeatures() const;
+    void storeRange(int fileFd, const std::string& remotePath, uint64_t offset, uint64_t length, bool append);
+    void uploadSegmented(int fileFd, const std::string& remotePath, uint64_t fileSize);
+    void recordUpload(const std::string& remotePath, const std::string& manifestLocation, ChunkManifest& manifest);
 
 public:
-    FTPClient(const std::string& address, int port);
+    FTPClient(const std::string& address, int port, bool verbose = true);
     ~FTPClient();
 
-    void user(const std::string& username);
+    bool user(const std::string& username);
     void pass(const std::string& password);
+    void login(const std::string& username, const std::string& password);
+    bool hasFeature(const std::string& name) const;
     void logout();
     void uploadFile(const std::string& localPath, const std::string& remotePath);
+    void uploadFileDelta(const std::string& localPath, const std::string& remotePath);
     void downloadFile(const std::string& remotePath, const std::string& localPath);
-    void listFiles();
+    size_t downloadFiles(const std::vector<std::string>& remotePaths);
+    void uploadDirectoryArchive(const std::string& localDir, const std::string& remotePath);
+    void downloadDirectoryArchive(const std::string& remotePath, const std::string& localDir);
+    std::vector<ListEntry> listFiles();
+    int64_t remoteSize(const std::string& remotePath);
+    bool remoteStat(const std::string& remotePath, int64_t& size, time_t& modified);
+    std::string location(const std::string& remotePath) const;
+    void setDirectIO(bool enabled);
+    void setPipelineDepth(unsigned depth);
+    void setTls(bool enabled);
+    void setBlockMode(bool enabled);
+    void setActiveMode(bool enabled);
+    void setSegmentedUpload(bool enabled);
+    void setSegmentedDownload(bool enabled);
+    void setSessionFactory(SessionFactory factory);
+    void setDownloadCache(std::shared_ptr<DownloadCache> cache);
+    void setPacer(Pacer pacer);
+    void setTimeouts(const Timeouts& timeouts);
+    static Timeouts defaultTimeouts();
+    static void setDefaultTimeouts(const Timeouts& timeouts);
+    void openRead(const std::string& remotePath, uint64_t offset);
+    size_t readSome(char* buffer, size_t length);
+    void closeRead();
+    void fetchRange(const std::string& remotePath, uint64_t offset, uint64_t length, int fileFd, TransferProgress* progress);
+    void uploadRange(int fileFd, const std::string& remotePath, uint64_t offset, uint64_t length,
+                     const std::shared_ptr<TransferProgress>& progress);
+    void transferTo(FTPClient& target, const std::string& sourcePath, const std::string& targetPath);
 
     bool checkResponseCode(const std::string &response, const std::string &expectedCode);
 };
\ No newline at end of file
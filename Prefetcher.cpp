@@ -0,0 +1,355 @@
+#include "Prefetcher.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+
+// Size of the buffer a background session receives a staged file through
+const size_t STAGE_BUFFER_SIZE = 256 * 1024;
+
+/*
+ * Constructor for the Prefetcher class.
+ * Creates the prefetcher's own directory under the staging folder.
+ * Takes parameters:
+ * - factory: opens a new logged-in session for each background worker
+ * - stagingFolder: where staging directories are kept
+ * - budgetBytes: the most bytes of files staged at a time
+ * - sessions: the number of files staged at the same time
+ * Throws a runtime_error if the directory cannot be created.
+ */
+Prefetcher::Prefetcher(FTPClient::SessionFactory factory, const std::string& stagingFolder, uint64_t budgetBytes,
+                       unsigned sessions)
+    : factory(std::move(factory)), budgetBytes(budgetBytes), sessions(std::max(1u, sessions)) {
+    static std::atomic<uint64_t> instances{0};
+    directory = stagingFolder + "/" + std::to_string(getpid()) + "-" + std::to_string(++instances);
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    if (error) {
+        throw std::runtime_error("Failed to create staging directory " + directory + ": " + error.message());
+    }
+}
+
+/*
+ * Destructor for the Prefetcher class.
+ * Stops the workers, abandoning the files they are staging, and removes every staged file.
+ */
+Prefetcher::~Prefetcher() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    std::error_code error;
+    std::filesystem::remove_all(directory, error);
+}
+
+/*
+ * schedule function
+ * Plans the files of a new listing for staging, in listing order.
+ * Staged files the listing no longer holds, or holds with another size, are dropped; the
+ * ones it still holds stay staged. Files queued for an earlier listing are dropped too.
+ * Takes a parameter listing representing the regular files of the listing.
+ * Returns void.
+ */
+void Prefetcher::schedule(const std::vector<FTPClient::ListEntry>& listing) {
+    std::unordered_map<std::string, const FTPClient::ListEntry*> listed;
+    std::unordered_map<std::string, size_t> positions;
+    for (size_t i = 0; i < listing.size(); ++i) {
+        listed[listing[i].name] = &listing[i];
+        positions[listing[i].name] = i;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    queue.clear();
+    for (auto it = entries.begin(); it != entries.end();) {
+        auto found = listed.find(it->first);
+        bool same = found != listed.end() && found->second->size == static_cast<int64_t>(it->second.size);
+        if (it->second.state == State::Running) {
+            it->second.dropped = !same;
+            it->second.position = same ? positions[it->first] : it->second.position;
+            ++it;
+        } else if (it->second.state == State::Staged && same) {
+            it->second.position = positions[it->first];
+            ++it;
+        } else {
+            auto next = std::next(it);
+            discard(it);
+            it = next;
+        }
+    }
+    for (size_t i = 0; i < listing.size(); ++i) {
+        const FTPClient::ListEntry& file = listing[i];
+        if (file.size < 0 || static_cast<uint64_t>(file.size) > budgetBytes || entries.count(file.name) != 0) {
+            continue;
+        }
+        Entry entry;
+        entry.position = i;
+        entry.size = static_cast<uint64_t>(file.size);
+        entries.emplace(file.name, std::move(entry));
+        queue.emplace(i, file.name);
+    }
+    cursor = 0;
+
+    // Sessions are opened on demand, up to the configured number
+    while (workers.size() < sessions && workers.size() < queue.size()) {
+        workers.emplace_back(&Prefetcher::workerLoop, this);
+    }
+    changed.notify_all();
+}
+
+/*
+ * claim function
+ * Moves a staged file to where the caller wants it, waiting first if it is being staged.
+ * Staging continues with the files listed after it.
+ * Takes parameters:
+ * - remotePath: the file as named in the listing
+ * - localPath: where to put it
+ * Returns true if the file is in place, false if the caller has to download it; a queued
+ * file is then taken off the queue.
+ */
+bool Prefetcher::claim(const std::string& remotePath, const std::string& localPath) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto entry = entries.find(remotePath);
+    if (entry == entries.end()) {
+        return false;
+    }
+    cursor = entry->second.position + 1;
+    changed.notify_all();
+
+    if (entry->second.state == State::Running) {
+        ++counts.waited;
+        changed.wait(lock, [&] {
+            entry = entries.find(remotePath);
+            return stopping || entry == entries.end() || entry->second.state != State::Running;
+        });
+        if (entry == entries.end() || entry->second.state == State::Running) {
+            ++counts.missed;
+            return false;
+        }
+    }
+    if (entry->second.state != State::Staged) {
+        ++counts.missed;
+        if (entry->second.state == State::Queued) {
+            queue.erase(entry->second.position);
+        }
+        entries.erase(entry);
+        return false;
+    }
+
+    std::string stagedPath = entry->second.stagedPath;
+    bool moved = rename(stagedPath.c_str(), localPath.c_str()) == 0;
+    if (!moved && errno == EXDEV) {
+        // The staging folder is on another file system, copy the file over
+        std::error_code error;
+        moved = std::filesystem::copy_file(stagedPath, localPath, std::filesystem::copy_options::overwrite_existing,
+                                           error);
+    }
+    discard(entry);
+    if (!moved) {
+        ++counts.missed;
+        return false;
+    }
+    ++counts.served;
+    return true;
+}
+
+/*
+ * discard function
+ * Forgets a file that is not being staged, removing its staged copy if there still is one
+ * and freeing its part of the budget. Must be called with the mutex held.
+ * Takes a parameter entry representing the file.
+ * Returns void.
+ */
+void Prefetcher::discard(std::unordered_map<std::string, Entry>::iterator entry) {
+    if (entry->second.state == State::Staged) {
+        if (unlink(entry->second.stagedPath.c_str()) == 0) {
+            ++counts.discarded;
+        }
+        reservedBytes -= entry->second.size;
+        changed.notify_all();
+    }
+    entries.erase(entry);
+}
+
+/*
+ * pickNext function
+ * Chooses the queued file to stage next: the first one listed after the file claimed last,
+ * else the first one listed. Must be called with the mutex held.
+ * Returns the file in the queue, or the end of the queue if it is empty or the file does
+ * not fit in the budget yet.
+ */
+std::map<size_t, std::string>::iterator Prefetcher::pickNext() {
+    auto next = queue.lower_bound(cursor);
+    if (next == queue.end()) {
+        next = queue.begin();
+    }
+    if (next != queue.end() && reservedBytes + entries[next->second].size > budgetBytes) {
+        return queue.end();
+    }
+    return next;
+}
+
+/*
+ * workerLoop function
+ * Body of a worker thread: stages queued files on its own session until the prefetcher stops.
+ * A session that fails is dropped and a new one is opened for the next file.
+ * Returns void.
+ */
+void Prefetcher::workerLoop() {
+    std::unique_ptr<FTPClient> session;
+    while (true) {
+        std::string remotePath;
+        std::string stagedPath;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            std::map<size_t, std::string>::iterator next;
+            changed.wait(lock, [&] { return stopping || (next = pickNext()) != queue.end(); });
+            if (stopping) {
+                break;
+            }
+            remotePath = next->second;
+            queue.erase(next);
+            Entry& entry = entries[remotePath];
+            entry.state = State::Running;
+            entry.stagedPath = directory + "/" + std::to_string(++nextName);
+            stagedPath = entry.stagedPath;
+            reservedBytes += entry.size;
+        }
+
+        bool ok = false;
+        try {
+            if (!session) {
+                session = factory();
+            }
+            stage(*session, remotePath, stagedPath);
+            ok = true;
+        } catch (const std::exception& ex) {
+            if (!stopping) {
+                std::cerr << "Prefetch of " << remotePath << " failed: " << ex.what() << std::endl;
+            }
+            session.reset();
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto entry = entries.find(remotePath);
+        if (!ok) {
+            // A claim waiting for the file downloads it itself
+            reservedBytes -= entry->second.size;
+            entry->second.state = State::Failed;
+            if (entry->second.dropped) {
+                entries.erase(entry);
+            }
+        } else if (entry->second.dropped || stopping) {
+            entry->second.state = State::Staged;
+            discard(entry);
+        } else {
+            // The listing may have been older than the file, account for what was staged
+            struct stat stagedStat = {};
+            if (stat(stagedPath.c_str(), &stagedStat) == 0) {
+                reservedBytes = reservedBytes - entry->second.size + static_cast<uint64_t>(stagedStat.st_size);
+                entry->second.size = static_cast<uint64_t>(stagedStat.st_size);
+            }
+            entry->second.state = State::Staged;
+            ++counts.staged;
+            counts.bytesStaged += entry->second.size;
+        }
+        changed.notify_all();
+    }
+
+    if (session) {
+        try {
+            session->logout();
+        } catch (const std::exception&) {
+            // The files are staged, a failed QUIT does not matter
+        }
+    }
+}
+
+/*
+ * stage function
+ * Downloads a file into the staging area and gives it the remote modification time, so
+ * the file claimed from there counts as up to date like a downloaded one.
+ * The file is written under a temporary name and renamed when complete.
+ * Takes parameters:
+ * - session: the worker's session
+ * - remotePath: the file on the server
+ * - stagedPath: where to stage it
+ * Throws a runtime_error if the download fails or the prefetcher stops meanwhile.
+ * Returns void.
+ */
+void Prefetcher::stage(FTPClient& session, const std::string& remotePath, const std::string& stagedPath) {
+    int64_t size = -1;
+    time_t modified = 0;
+    bool haveModified = session.remoteStat(remotePath, size, modified);
+
+    std::string partPath = stagedPath + ".part";
+    int fileFd = open(partPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fileFd < 0) {
+        throw std::runtime_error("Failed to create file: " + partPath);
+    }
+    try {
+        session.openRead(remotePath, 0);
+        std::vector<char> buffer(STAGE_BUFFER_SIZE);
+        size_t bytesRead;
+        while ((bytesRead = session.readSome(buffer.data(), buffer.size())) > 0) {
+            if (stopping) {
+                session.closeRead();
+                throw std::runtime_error("Prefetcher stopped");
+            }
+            size_t written = 0;
+            while (written < bytesRead) {
+                ssize_t n = write(fileFd, buffer.data() + written, bytesRead - written);
+                if (n < 0) {
+                    int error = errno;
+                    session.closeRead();
+                    throw std::runtime_error("Failed to write file data: " + std::string(strerror(error)));
+                }
+                written += static_cast<size_t>(n);
+            }
+        }
+    } catch (const std::exception&) {
+        close(fileFd);
+        unlink(partPath.c_str());
+        throw;
+    }
+    close(fileFd);
+
+    if (haveModified) {
+        timespec times[2] = {{modified, 0}, {modified, 0}};
+        utimensat(AT_FDCWD, partPath.c_str(), times, 0);
+    }
+    if (rename(partPath.c_str(), stagedPath.c_str()) != 0) {
+        unlink(partPath.c_str());
+        throw std::runtime_error("Failed to stage file: " + stagedPath);
+    }
+}
+
+/*
+ * stats function
+ * Returns the counts since the prefetcher was created.
+ */
+Prefetcher::Stats Prefetcher::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counts;
+}
+
+/*
+ * printStats function
+ * Prints how many files were staged and how many fetches they served.
+ * Takes a parameter out representing the stream to print to.
+ * Returns void.
+ */
+void Prefetcher::printStats(std::ostream& out) const {
+    Stats current = stats();
+    out << "[prefetch] staged=" << current.staged << " served=" << current.served << " waited=" << current.waited
+        << " missed=" << current.missed << " discarded=" << current.discarded
+        << " bytes_staged=" << current.bytesStaged << std::endl;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "FTPClient.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Prefetcher class
+ * Downloads the files of a directory listing ahead of time, on background sessions, into a
+ * local staging area, so that fetching them one after another afterwards does not wait for
+ * the server each time.
+ * Files are staged in listing order, starting after the file fetched last, since that is
+ * the one most likely needed next. Staged files and files being staged together stay within
+ * a size budget; a file that does not fit waits until fetching staged files makes room, and
+ * one larger than the whole budget is never staged.
+ * claim hands a staged file over by renaming it into place, waits for a file that is being
+ * staged, and leaves any other file to the caller. A staged file is as the server had it
+ * when it was staged; a new listing drops staged files that left it or changed size.
+ * Every Prefetcher has its own directory under the staging folder, removed again with it.
+ */
+class Prefetcher {
+public:
+    // Counts since the prefetcher was created
+    struct Stats {
+        uint64_t staged = 0;
+        uint64_t served = 0;
+        uint64_t waited = 0;
+        uint64_t missed = 0;
+        uint64_t discarded = 0;
+        uint64_t bytesStaged = 0;
+    };
+
+    Prefetcher(FTPClient::SessionFactory factory, const std::string& stagingFolder, uint64_t budgetBytes,
+               unsigned sessions);
+    ~Prefetcher();
+
+    Prefetcher(const Prefetcher&) = delete;
+    Prefetcher& operator=(const Prefetcher&) = delete;
+
+    void schedule(const std::vector<FTPClient::ListEntry>& listing);
+    bool claim(const std::string& remotePath, const std::string& localPath);
+    Stats stats() const;
+    void printStats(std::ostream& out) const;
+
+private:
+    enum class State { Queued, Running, Staged, Failed };
+
+    struct Entry {
+        size_t position = 0;
+        uint64_t size = 0;
+        State state = State::Queued;
+        std::string stagedPath;
+        // Set when a new listing no longer holds the file while it is being staged
+        bool dropped = false;
+    };
+
+    FTPClient::SessionFactory factory;
+    std::string directory;
+    uint64_t budgetBytes;
+    unsigned sessions;
+
+    std::unordered_map<std::string, Entry> entries;
+    // Queued files by listing position
+    std::map<size_t, std::string> queue;
+    // Listing position after the file claimed last
+    size_t cursor = 0;
+    // Bytes of staged files and of files being staged
+    uint64_t reservedBytes = 0;
+    uint64_t nextName = 0;
+    Stats counts;
+    std::atomic<bool> stopping{false};
+    mutable std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<std::thread> workers;
+
+    std::map<size_t, std::string>::iterator pickNext();
+    void discard(std::unordered_map<std::string, Entry>::iterator entry);
+    void workerLoop();
+    void stage(FTPClient& session, const std::string& remotePath, const std::string& stagedPath);
+};
@@ -0,0 +1,347 @@
+#include "RemoteFile.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+/*
+ * fileIdOf function
+ * Returns the 64-bit FNV-1a hash of a string, to name the blocks of a file in the cache.
+ */
+static uint64_t fileIdOf(const std::string& name) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : name) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * Constructor for the RemoteFile class.
+ * Opens the first session and looks up the size and modification time of the file.
+ * Takes parameters:
+ * - factory: opens logged-in sessions to the file's server
+ * - remotePath: the file on the server
+ * - cache: the block cache to read through, may be shared with other RemoteFiles
+ * Throws an invalid_argument if factory or cache is missing, and a runtime_error if the
+ * session cannot be opened or the server does not report the size of the file.
+ */
+RemoteFile::RemoteFile(FTPClient::SessionFactory factory, const std::string& remotePath,
+                       std::shared_ptr<BlockCache> cache)
+    : factory(std::move(factory)), remotePath(remotePath), cache(std::move(cache)) {
+    if (!this->factory || !this->cache) {
+        throw std::invalid_argument("A remote file needs a session factory and a block cache");
+    }
+    auto session = std::make_unique<Session>();
+    session->client = this->factory();
+
+    int64_t size = -1;
+    time_t modified = 0;
+    bool haveModified = session->client->remoteStat(remotePath, size, modified);
+    if (size < 0) {
+        throw std::runtime_error("Server does not report the size of " + remotePath);
+    }
+    fileSize = static_cast<uint64_t>(size);
+
+    std::string name = session->client->location(remotePath) + "\n" + std::to_string(size);
+    if (haveModified) {
+        name += " " + std::to_string(modified);
+    } else {
+        // Without a modification time a changed file cannot be told apart, so its blocks are not shared
+        static std::atomic<uint64_t> unversioned{0};
+        name += " #" + std::to_string(++unversioned);
+    }
+    fileId = fileIdOf(name);
+
+    idle.push_back(std::move(session));
+    sessions = 1;
+}
+
+/*
+ * Destructor for the RemoteFile class.
+ * Ends any open read and logs out of every session.
+ */
+RemoteFile::~RemoteFile() {
+    for (auto& session : idle) {
+        try {
+            session->client->logout();
+        } catch (const std::exception&) {
+            // The reads are done, a failed QUIT does not matter
+        }
+    }
+}
+
+/*
+ * size function
+ * Returns the size of the file in bytes, as reported when it was opened.
+ */
+uint64_t RemoteFile::size() const {
+    return fileSize;
+}
+
+/*
+ * pread function
+ * Reads bytes of the file at an offset, from the block cache where it holds them and from
+ * the server otherwise.
+ * Takes parameters:
+ * - buffer: where to store the bytes
+ * - length: the number of bytes to read
+ * - offset: the position in the file of the first byte
+ * Throws a runtime_error if the server refuses the read or the data connection fails.
+ * Returns the number of bytes read, less than length only at the end of the file.
+ */
+size_t RemoteFile::pread(char* buffer, size_t length, uint64_t offset) {
+    ++reads;
+    if (offset >= fileSize || length == 0) {
+        return 0;
+    }
+    length = static_cast<size_t>(std::min<uint64_t>(length, fileSize - offset));
+    uint64_t window = nextReadahead(offset, length);
+
+    uint64_t first = offset / BLOCK_SIZE;
+    uint64_t last = (offset + length - 1) / BLOCK_SIZE;
+    uint64_t blockCount = (fileSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint64_t end = std::min(last + 1 + (window + BLOCK_SIZE - 1) / BLOCK_SIZE, blockCount);
+
+    // Blocks fetched by this call, used directly in case the cache evicts them again
+    std::vector<BlockCache::Block> fetched;
+    uint64_t fetchedFirst = 0;
+    size_t copied = 0;
+    for (uint64_t index = first; index <= last; ++index) {
+        BlockCache::Block block;
+        if (index >= fetchedFirst && index - fetchedFirst < fetched.size()) {
+            block = fetched[index - fetchedFirst];
+        } else {
+            block = cache->get(fileId, index);
+        }
+        if (!block) {
+            // The missing run, with the readahead, up to the first block the cache holds
+            uint64_t count = 1;
+            while (index + count < end && !cache->contains(fileId, index + count)) {
+                ++count;
+            }
+            fetched = fetch(index, count, window > 0);
+            fetchedFirst = index;
+            block = fetched.front();
+        }
+
+        uint64_t blockStart = index * BLOCK_SIZE;
+        uint64_t from = std::max(offset, blockStart) - blockStart;
+        uint64_t to = std::min<uint64_t>(offset + length, blockStart + block->size()) - blockStart;
+        if (to <= from) {
+            break;
+        }
+        std::memcpy(buffer + copied, block->data() + from, static_cast<size_t>(to - from));
+        copied += static_cast<size_t>(to - from);
+    }
+    return copied;
+}
+
+/*
+ * nextReadahead function
+ * Updates the readahead window for a read: a read starting where the last one ended
+ * doubles it, up to MAX_READAHEAD, any other read drops it.
+ * Takes parameters:
+ * - offset: the position of the read
+ * - length: the length of the read
+ * Returns the window in bytes to fetch past the end of the read.
+ */
+uint64_t RemoteFile::nextReadahead(uint64_t offset, uint64_t length) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (offset == sequentialEnd) {
+        readahead = readahead == 0 ? BLOCK_SIZE : std::min(readahead * 2, MAX_READAHEAD);
+    } else {
+        readahead = 0;
+    }
+    sequentialEnd = offset + length;
+    return readahead;
+}
+
+/*
+ * acquire function
+ * Takes an idle session, preferring one whose open read continues at the given position,
+ * then one without an open read. Without an idle session a new one is opened while
+ * fewer than MAX_SESSIONS exist, else the call waits for one to be released.
+ * Takes a parameter position representing the offset the caller reads from.
+ * Throws a runtime_error if a new session cannot be opened.
+ * Returns the session, to be handed back with release or discard.
+ */
+std::unique_ptr<RemoteFile::Session> RemoteFile::acquire(uint64_t position) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        if (!idle.empty()) {
+            auto chosen = std::find_if(idle.begin(), idle.end(), [position](const std::unique_ptr<Session>& session) {
+                return session->reading && session->position == position;
+            });
+            if (chosen == idle.end()) {
+                chosen = std::find_if(idle.begin(), idle.end(),
+                                      [](const std::unique_ptr<Session>& session) { return !session->reading; });
+            }
+            if (chosen == idle.end()) {
+                chosen = idle.begin();
+            }
+            std::unique_ptr<Session> session = std::move(*chosen);
+            idle.erase(chosen);
+            return session;
+        }
+        if (sessions < MAX_SESSIONS) {
+            ++sessions;
+            lock.unlock();
+            try {
+                auto session = std::make_unique<Session>();
+                session->client = factory();
+                return session;
+            } catch (const std::exception&) {
+                discard();
+                throw;
+            }
+        }
+        sessionReleased.wait(lock);
+    }
+}
+
+/*
+ * release function
+ * Hands a session back for other reads, with its read still open if it has one.
+ * Takes a parameter session representing the session from acquire.
+ * Returns void.
+ */
+void RemoteFile::release(std::unique_ptr<Session> session) {
+    std::lock_guard<std::mutex> lock(mutex);
+    idle.push_back(std::move(session));
+    sessionReleased.notify_one();
+}
+
+/*
+ * discard function
+ * Accounts for a session from acquire that failed and was dropped, so another can be opened.
+ * Returns void.
+ */
+void RemoteFile::discard() {
+    std::lock_guard<std::mutex> lock(mutex);
+    --sessions;
+    sessionReleased.notify_one();
+}
+
+/*
+ * fetch function
+ * Fetches a run of blocks from the server and adds them to the cache.
+ * A session whose RETR is still open at the first block continues it; otherwise a new
+ * REST + RETR starts there. If continuing fails, for example because the server gave
+ * up on the idle data connection, the run is fetched again with a new transfer.
+ * Takes parameters:
+ * - firstBlock: the index of the first block
+ * - count: the number of blocks
+ * - keepOpen: leave the RETR open after the run, for a sequential reader to continue
+ * Throws a runtime_error if the server refuses the read or the data connection fails.
+ * Returns the blocks.
+ * A run that reaches the end of the file reads the transfer to its end, so it finishes
+ * with 226 and a block mode data connection stays usable.
+ */
+std::vector<BlockCache::Block> RemoteFile::fetch(uint64_t firstBlock, uint64_t count, bool keepOpen) {
+    uint64_t start = firstBlock * BLOCK_SIZE;
+    std::unique_ptr<Session> session = acquire(start);
+    std::vector<BlockCache::Block> blocks;
+    try {
+        bool continuing = session->reading && session->position == start;
+        if (continuing) {
+            try {
+                receiveBlocks(*session, firstBlock, count, blocks);
+                ++continued;
+            } catch (const std::exception&) {
+                blocks.clear();
+                continuing = false;
+            }
+        }
+        if (!continuing) {
+            session->client->openRead(remotePath, start);
+            session->reading = true;
+            session->position = start;
+            ++transfers;
+            receiveBlocks(*session, firstBlock, count, blocks);
+        }
+
+        if (session->position >= fileSize) {
+            char extra;
+            if (session->reading && session->client->readSome(&extra, 1) != 0) {
+                // The file grew since it was opened, the rest is not part of it
+                session->client->closeRead();
+            }
+            session->reading = false;
+        } else if (!keepOpen) {
+            session->client->closeRead();
+            session->reading = false;
+        }
+    } catch (const std::exception&) {
+        session.reset();
+        discard();
+        throw;
+    }
+    release(std::move(session));
+    return blocks;
+}
+
+/*
+ * receiveBlocks function
+ * Receives blocks from the open read of a session and adds each to the cache as soon as
+ * it is complete, so concurrent readers can use it.
+ * Takes parameters:
+ * - session: the session, reading at the first block
+ * - firstBlock: the index of the first block
+ * - count: the number of blocks
+ * - blocks: receives the blocks
+ * Throws a runtime_error if the data connection fails or the file ends early; the read is over then.
+ * Returns void.
+ */
+void RemoteFile::receiveBlocks(Session& session, uint64_t firstBlock, uint64_t count,
+                               std::vector<BlockCache::Block>& blocks) {
+    for (uint64_t index = firstBlock; index < firstBlock + count; ++index) {
+        uint64_t blockStart = index * BLOCK_SIZE;
+        auto data = std::make_shared<std::vector<char>>(
+            static_cast<size_t>(std::min(BLOCK_SIZE, fileSize - blockStart)));
+        size_t received = 0;
+        while (received < data->size()) {
+            size_t bytesRead = 0;
+            try {
+                bytesRead = session.client->readSome(data->data() + received, data->size() - received);
+            } catch (const std::exception&) {
+                session.reading = false;
+                throw;
+            }
+            if (bytesRead == 0) {
+                session.reading = false;
+                throw std::runtime_error("Remote file ended early at offset " + std::to_string(blockStart + received));
+            }
+            received += bytesRead;
+        }
+        session.position += data->size();
+        bytesFetched += data->size();
+        cache->put(fileId, index, data);
+        blocks.push_back(std::move(data));
+    }
+}
+
+/*
+ * stats function
+ * Returns the read, transfer and byte counts since the file was opened.
+ */
+RemoteFile::Stats RemoteFile::stats() const {
+    Stats result;
+    result.reads = reads.load();
+    result.transfers = transfers.load();
+    result.continued = continued.load();
+    result.bytesFetched = bytesFetched.load();
+    return result;
+}
+
+/*
+ * printStats function
+ * Prints the counts on one line.
+ * Takes a parameter out representing the stream to print to.
+ * Returns void.
+ */
+void RemoteFile::printStats(std::ostream& out) const {
+    Stats current = stats();
+    out << "[remote file] reads=" << current.reads << " transfers=" << current.transfers
+        << " continued=" << current.continued << " bytes_fetched=" << current.bytesFetched << std::endl;
+}
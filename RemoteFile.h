@@ -0,0 +1,86 @@
+#pragma once
+
+#include "FTPClient.h"
+#include "BlockCache.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+ * RemoteFile class
+ * Reads parts of a remote file at any offset, like pread on a local file, without
+ * downloading the whole file.
+ * Reads go through a BlockCache in blocks of BLOCK_SIZE; a missing run of blocks is read
+ * with REST + RETR on one of up to MAX_SESSIONS sessions, and the data connection closed
+ * once the run is in. A read that continues where the previous one ended grows a readahead
+ * window, doubling up to MAX_READAHEAD, that is fetched along with it; any other read
+ * drops it again. While reads stay sequential the RETR is left open after the run, so the
+ * next run continues on the same data connection instead of starting a new transfer.
+ * Blocks are named after the file's server, path, size and modification time, so a cache
+ * shared by several RemoteFiles serves a file again when it is reopened unchanged.
+ * pread may be called from several threads at once.
+ */
+class RemoteFile {
+public:
+    static constexpr uint64_t BLOCK_SIZE = 64 * 1024;
+    static constexpr uint64_t MAX_READAHEAD = 8 * 1024 * 1024;
+    static constexpr size_t MAX_SESSIONS = 4;
+
+    // Counts since the file was opened
+    struct Stats {
+        uint64_t reads = 0;
+        uint64_t transfers = 0;
+        uint64_t continued = 0;
+        uint64_t bytesFetched = 0;
+    };
+
+    RemoteFile(FTPClient::SessionFactory factory, const std::string& remotePath, std::shared_ptr<BlockCache> cache);
+    ~RemoteFile();
+
+    RemoteFile(const RemoteFile&) = delete;
+    RemoteFile& operator=(const RemoteFile&) = delete;
+
+    size_t pread(char* buffer, size_t length, uint64_t offset);
+    uint64_t size() const;
+    Stats stats() const;
+    void printStats(std::ostream& out) const;
+
+private:
+    struct Session {
+        std::unique_ptr<FTPClient> client;
+        // Whether a RETR is still open, and the file offset it continues at
+        bool reading = false;
+        uint64_t position = 0;
+    };
+
+    FTPClient::SessionFactory factory;
+    std::string remotePath;
+    std::shared_ptr<BlockCache> cache;
+    uint64_t fileId = 0;
+    uint64_t fileSize = 0;
+
+    std::mutex mutex;
+    std::condition_variable sessionReleased;
+    std::vector<std::unique_ptr<Session>> idle;
+    size_t sessions = 0;
+    // Where the last read ended, and the readahead window it built up
+    uint64_t sequentialEnd = 0;
+    uint64_t readahead = 0;
+
+    std::atomic<uint64_t> reads{0};
+    std::atomic<uint64_t> transfers{0};
+    std::atomic<uint64_t> continued{0};
+    std::atomic<uint64_t> bytesFetched{0};
+
+    uint64_t nextReadahead(uint64_t offset, uint64_t length);
+    std::unique_ptr<Session> acquire(uint64_t position);
+    void release(std::unique_ptr<Session> session);
+    void discard();
+    std::vector<BlockCache::Block> fetch(uint64_t firstBlock, uint64_t count, bool keepOpen);
+    void receiveBlocks(Session& session, uint64_t firstBlock, uint64_t count, std::vector<BlockCache::Block>& blocks);
+};
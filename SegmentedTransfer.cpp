@@ -0,0 +1,378 @@
+#include "SegmentedTransfer.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+/*
+ * download function
+ * Downloads a file as a set of ranges fetched in parallel from one server.
+ * Takes parameters:
+ * - factory: opens a new logged-in session for each stream
+ * - remotePath: the file on the server
+ * - fileFd: the local file, written at the same offsets as the remote one
+ * - size: the size of the remote file
+ * - streams: the most concurrent sessions to open
+ * - progress: the progress counters to update, may be null
+ * Throws a runtime_error if a range could not be fetched after MAX_ATTEMPTS.
+ * Returns the number of sessions that took part, fewer than streams when the server refused some logins.
+ */
+unsigned SegmentedTransfer::download(const SessionFactory& factory, const std::string& remotePath, int fileFd,
+                                     uint64_t size, unsigned streams, TransferProgress* progress) {
+    return download({Source{"", factory, std::max(1u, streams)}}, remotePath, fileFd, size, progress)[0].sessions;
+}
+
+/*
+ * download function
+ * Downloads a file as a set of ranges fetched in parallel from one or more servers.
+ * Takes parameters:
+ * - sources: the servers holding the file and the number of streams to open on each
+ * - remotePath: the file on the servers
+ * - fileFd: the local file, written at the same offsets as the remote one
+ * - size: the size of the remote file
+ * - progress: the progress counters to update, may be null
+ * Throws a runtime_error if fetching a range failed MAX_ATTEMPTS times on connected sessions,
+ * or if every source was dropped before the file was complete.
+ * Returns what each source contributed.
+ * Each stream claims RANGE_SECONDS worth of data at its own measured rate, so the share
+ * of a mirror follows its throughput as it changes. A failed range is queued again for
+ * any stream. A source is dropped after MAX_SOURCE_FAILURES failures in a row, or at
+ * once if it reports a different size for the file. A stream that cannot log in ends
+ * while other streams are still running, so a server limiting logins gets fewer streams.
+ */
+std::vector<SegmentedTransfer::SourceStats> SegmentedTransfer::download(const std::vector<Source>& sources,
+                                                                        const std::string& remotePath, int fileFd,
+                                                                        uint64_t size, TransferProgress* progress) {
+    struct Range {
+        uint64_t offset = 0;
+        uint64_t length = 0;
+        unsigned attempts = 0;
+    };
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    uint64_t cursor = 0;
+    std::deque<Range> retry;
+    unsigned inFlight = 0;
+    unsigned liveStreams = 0;
+    std::string error;
+    std::vector<SourceStats> stats(sources.size());
+    std::vector<unsigned> failuresInRow(sources.size(), 0);
+    std::vector<unsigned> streamsLeft(sources.size(), 0);
+
+    for (size_t i = 0; i < sources.size(); ++i) {
+        stats[i].name = sources[i].name;
+        liveStreams += std::max(1u, sources[i].streams);
+    }
+
+    auto worker = [&](size_t sourceIndex) {
+        const Source& source = sources[sourceIndex];
+        std::unique_ptr<FTPClient> session;
+        bool opened = false;
+        bool left = false;
+        double rate = 0;
+
+        while (true) {
+            Range range;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                // With nothing left to hand out, wait in case a running range fails
+                changed.wait(lock, [&] {
+                    return !error.empty() || stats[sourceIndex].dropped || !retry.empty() || cursor < size ||
+                           inFlight == 0;
+                });
+                if (!error.empty() || stats[sourceIndex].dropped || (retry.empty() && cursor >= size)) {
+                    break;
+                }
+                if (!retry.empty()) {
+                    range = retry.front();
+                    retry.pop_front();
+                } else {
+                    uint64_t wanted = rate > 0 ? static_cast<uint64_t>(rate * RANGE_SECONDS) : INITIAL_RANGE;
+                    wanted = std::min(std::max(wanted, MIN_RANGE), MAX_RANGE);
+                    range.offset = cursor;
+                    range.length = std::min(wanted, size - cursor);
+                    cursor += range.length;
+                }
+                ++inFlight;
+            }
+
+            bool mismatch = false;
+            bool connected = session != nullptr;
+            try {
+                if (!session) {
+                    session = source.factory();
+                    // A mirror with a different file must not contribute any range
+                    if (session->remoteSize(remotePath) != static_cast<int64_t>(size)) {
+                        mismatch = true;
+                        throw std::runtime_error("size differs on " + source.name);
+                    }
+                    connected = true;
+                    opened = true;
+                }
+                auto start = std::chrono::steady_clock::now();
+                session->fetchRange(remotePath, range.offset, range.length, fileFd, progress);
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+                double measured = static_cast<double>(range.length) / std::max(seconds, 1e-3);
+                rate = rate > 0 ? (rate + measured) / 2 : measured;
+
+                std::lock_guard<std::mutex> lock(mutex);
+                stats[sourceIndex].bytes += range.length;
+                stats[sourceIndex].seconds += seconds;
+                failuresInRow[sourceIndex] = 0;
+                --inFlight;
+                changed.notify_all();
+            } catch (const std::exception& ex) {
+                // The session may be in an unknown state, start over on a new one
+                session.reset();
+
+                std::lock_guard<std::mutex> lock(mutex);
+                --inFlight;
+                ++stats[sourceIndex].failures;
+                // A stream that never logged in, e.g. past the server's session limit, leaves its
+                // share to the others rather than counting against the source
+                left = !opened && !mismatch && liveStreams > 1;
+                if (left) {
+                    --liveStreams;
+                    // A mirror none of whose streams got in counts as dropped
+                    if (++streamsLeft[sourceIndex] == std::max(1u, source.streams)) {
+                        stats[sourceIndex].dropped = true;
+                    }
+                } else if (mismatch || ++failuresInRow[sourceIndex] >= MAX_SOURCE_FAILURES) {
+                    stats[sourceIndex].dropped = true;
+                }
+                // A source that cannot be reached says nothing about the range itself
+                if (connected && ++range.attempts >= MAX_ATTEMPTS) {
+                    if (error.empty()) {
+                        error = "Range at offset " + std::to_string(range.offset) + " failed: " + ex.what();
+                    }
+                } else {
+                    retry.push_back(range);
+                }
+                changed.notify_all();
+            }
+            if (left) {
+                break;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (opened) {
+                ++stats[sourceIndex].sessions;
+            }
+            if (!left && --liveStreams == 0 && error.empty() && (!retry.empty() || cursor < size)) {
+                error = "Every source failed before the download was complete";
+            }
+            changed.notify_all();
+        }
+
+        if (session) {
+            try {
+                session->logout();
+            } catch (const std::exception&) {
+                // The ranges are written, a failed QUIT does not matter
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < sources.size(); ++i) {
+        for (unsigned stream = 0; stream < std::max(1u, sources[i].streams); ++stream) {
+            workers.emplace_back(worker, i);
+        }
+    }
+    for (std::thread& thread : workers) {
+        thread.join();
+    }
+
+    if (!error.empty()) {
+        throw std::runtime_error(error);
+    }
+    return stats;
+}
+
+/*
+ * upload function
+ * Uploads the rest of a file as a set of ranges stored in parallel with REST + STOR.
+ * The remote file must already exist, holding at least the part before offset: a STOR
+ * without a restart offset truncates, so the caller sends the first range on its own.
+ * Takes parameters:
+ * - factory: opens a new logged-in session for each stream
+ * - remotePath: the file on the server
+ * - fileFd: the local file, read at the same offsets as the remote one
+ * - offset: the first byte not uploaded yet
+ * - size: the size of the local file
+ * - maxStreams: the most concurrent sessions tuning may open
+ * - progress: the progress counters to update, also sampled for tuning; may be null
+ * Throws a runtime_error if a range could not be stored after MAX_ATTEMPTS, or if every
+ * stream failed MAX_SOURCE_FAILURES times in a row before the file was complete.
+ * Returns the number of streams the upload was tuned to.
+ * It starts with INITIAL_UPLOAD_STREAMS. Every TUNE_SECONDS the throughput is compared with
+ * the best seen so far: while it grew by TUNE_GAIN another stream is started, once it does
+ * not the stream count stays where it is.
+ */
+unsigned SegmentedTransfer::upload(const SessionFactory& factory, const std::string& remotePath, int fileFd,
+                                   uint64_t offset, uint64_t size, unsigned maxStreams,
+                                   const std::shared_ptr<TransferProgress>& progress) {
+    struct Range {
+        uint64_t offset = 0;
+        uint64_t length = 0;
+        unsigned attempts = 0;
+    };
+
+    std::shared_ptr<TransferProgress> counter = progress ? progress : std::make_shared<TransferProgress>(remotePath, size);
+    std::mutex mutex;
+    std::condition_variable changed;
+    uint64_t cursor = offset;
+    std::deque<Range> retry;
+    unsigned inFlight = 0;
+    unsigned liveStreams = 0;
+    std::string error;
+
+    auto finished = [&] { return !error.empty() || liveStreams == 0 || (retry.empty() && cursor >= size && inFlight == 0); };
+
+    auto worker = [&]() {
+        std::unique_ptr<FTPClient> session;
+        double rate = 0;
+        unsigned failuresInRow = 0;
+
+        while (true) {
+            Range range;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                // With nothing left to hand out, wait in case a running range fails
+                changed.wait(lock, [&] { return !error.empty() || !retry.empty() || cursor < size || inFlight == 0; });
+                if (!error.empty() || (retry.empty() && cursor >= size)) {
+                    break;
+                }
+                if (!retry.empty()) {
+                    range = retry.front();
+                    retry.pop_front();
+                } else {
+                    uint64_t wanted = rate > 0 ? static_cast<uint64_t>(rate * RANGE_SECONDS) : INITIAL_RANGE;
+                    wanted = std::min(std::max(wanted, MIN_RANGE), MAX_RANGE);
+                    range.offset = cursor;
+                    range.length = std::min(wanted, size - cursor);
+                    cursor += range.length;
+                }
+                ++inFlight;
+            }
+
+            bool connected = session != nullptr;
+            try {
+                if (!session) {
+                    session = factory();
+                    connected = true;
+                }
+                auto start = std::chrono::steady_clock::now();
+                session->uploadRange(fileFd, remotePath, range.offset, range.length, counter);
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+                double measured = static_cast<double>(range.length) / std::max(seconds, 1e-3);
+                rate = rate > 0 ? (rate + measured) / 2 : measured;
+                failuresInRow = 0;
+
+                std::lock_guard<std::mutex> lock(mutex);
+                --inFlight;
+                changed.notify_all();
+            } catch (const std::exception& ex) {
+                // The session may be in an unknown state, start over on a new one
+                session.reset();
+                ++failuresInRow;
+
+                std::lock_guard<std::mutex> lock(mutex);
+                --inFlight;
+                // A session that cannot be opened says nothing about the range itself
+                if (connected && ++range.attempts >= MAX_ATTEMPTS) {
+                    if (error.empty()) {
+                        error = "Range at offset " + std::to_string(range.offset) + " failed: " + ex.what();
+                    }
+                } else {
+                    retry.push_back(range);
+                }
+                changed.notify_all();
+                if (failuresInRow >= MAX_SOURCE_FAILURES) {
+                    break;
+                }
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--liveStreams == 0 && error.empty() && (!retry.empty() || cursor < size)) {
+                error = "Every stream failed before the upload was complete";
+            }
+            changed.notify_all();
+        }
+
+        if (session) {
+            try {
+                session->logout();
+            } catch (const std::exception&) {
+                // The ranges are stored, a failed QUIT does not matter
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    auto addStream = [&]() {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++liveStreams;
+        workers.emplace_back(worker);
+    };
+
+    maxStreams = std::max(1u, maxStreams);
+    for (unsigned stream = 0; stream < std::min(INITIAL_UPLOAD_STREAMS, maxStreams); ++stream) {
+        addStream();
+    }
+
+    // Grow the stream count while the last added stream paid off
+    bool tuning = workers.size() < maxStreams;
+    double bestRate = 0;
+    uint64_t lastDone = counter->done();
+    auto lastSample = std::chrono::steady_clock::now();
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (changed.wait_for(lock, std::chrono::duration<double>(TUNE_SECONDS), finished)) {
+                break;
+            }
+            // Streams only help while there is work left to hand out
+            if (cursor >= size) {
+                tuning = false;
+            }
+        }
+        if (!tuning) {
+            continue;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        uint64_t done = counter->done();
+        double rate = (done - lastDone) / std::max(std::chrono::duration<double>(now - lastSample).count(), 1e-3);
+        lastDone = done;
+        lastSample = now;
+
+        if (rate > bestRate * (1 + TUNE_GAIN)) {
+            bestRate = rate;
+            addStream();
+            tuning = workers.size() < maxStreams;
+        } else {
+            tuning = false;
+        }
+    }
+
+    for (std::thread& thread : workers) {
+        thread.join();
+    }
+
+    if (!error.empty()) {
+        throw std::runtime_error(error);
+    }
+    return static_cast<unsigned>(workers.size());
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "FTPClient.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ * SegmentedTransfer class
+ * Splits a large download into byte ranges fetched with REST + RETR over
+ * several sessions at once, each writing its ranges in place with pwrite.
+ * The sessions may belong to different servers holding the same file (mirrors).
+ * Every stream sizes the ranges it claims by its own measured throughput, so slow
+ * streams hold little work and fast ones take more; a failed range is handed to
+ * whichever stream asks next. A stream that cannot log in, for example past the
+ * server's limit on sessions, leaves its share to the streams that did.
+ * Uploads are split the same way and sent with REST + STOR, each stream reading its
+ * ranges from the local file at their offsets. Their stream count is tuned while they
+ * run: streams are added as long as each new one still raises the total throughput.
+ */
+class SegmentedTransfer {
+public:
+    using SessionFactory = FTPClient::SessionFactory;
+
+    // A server to fetch from and how many sessions to open on it
+    struct Source {
+        std::string name;
+        SessionFactory factory;
+        unsigned streams = 1;
+    };
+
+    // What a source contributed to a download
+    struct SourceStats {
+        std::string name;
+        uint64_t bytes = 0;
+        double seconds = 0;
+        unsigned failures = 0;
+        bool dropped = false;
+        // Streams that logged in and found the file as expected
+        unsigned sessions = 0;
+    };
+
+    static constexpr uint64_t MIN_RANGE = 1024 * 1024;
+    static constexpr uint64_t INITIAL_RANGE = 4 * 1024 * 1024;
+    static constexpr uint64_t MAX_RANGE = 64 * 1024 * 1024;
+    // A stream claims about this many seconds of work at its measured rate
+    static constexpr double RANGE_SECONDS = 1.0;
+    static constexpr unsigned MAX_ATTEMPTS = 3;
+    static constexpr unsigned MAX_SOURCE_FAILURES = 3;
+    // Streams an upload starts with before tuning adds more
+    static constexpr unsigned INITIAL_UPLOAD_STREAMS = 2;
+    // How often upload throughput is sampled, and the gain a new stream must bring to keep adding
+    static constexpr double TUNE_SECONDS = 1.0;
+    static constexpr double TUNE_GAIN = 0.1;
+
+    static unsigned download(const SessionFactory& factory, const std::string& remotePath, int fileFd,
+                         uint64_t size, unsigned streams, TransferProgress* progress);
+    static std::vector<SourceStats> download(const std::vector<Source>& sources, const std::string& remotePath,
+                                             int fileFd, uint64_t size, TransferProgress* progress);
+    static unsigned upload(const SessionFactory& factory, const std::string& remotePath, int fileFd,
+                           uint64_t offset, uint64_t size, unsigned maxStreams,
+                           const std::shared_ptr<TransferProgress>& progress);
+};
@@ -1,20 +1,83 @@
 #include "ServerController.h"
+#include "SegmentedTransfer.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
 #include <iostream>
 
+// Sessions the transfer scheduler runs queued transfers on
+const unsigned SCHEDULER_SESSIONS = 2;
+// Sessions opened on every mirror of a striped download
+const unsigned MIRROR_STREAMS = 2;
+// Prefix of a server address that asks for explicit FTPS
+const std::string TLS_SCHEME = "ftps://";
+// Where the download cache is kept unless FTP_CACHE_DIR names a directory shared more widely
+const std::string CACHE_FOLDER = ".ftpstate/cache";
+// Background sessions that stage listed files when prefetching is on
+const unsigned PREFETCH_SESSIONS = 4;
+// Where prefetched files wait to be downloaded
+const std::string STAGING_FOLDER = ".ftpstate/staging";
+// Memory for blocks of remote files read with readRemote
+const uint64_t BLOCK_CACHE_BYTES = 64ULL * 1024 * 1024;
+
+/*
+ * isTlsAddress function
+ * Tells whether a server address starts with ftps://.
+ */
+static bool isTlsAddress(const std::string& address) {
+    return address.compare(0, TLS_SCHEME.size(), TLS_SCHEME) == 0;
+}
+
+/*
+ * hostOf function
+ * Returns a server address without its ftps:// prefix.
+ */
+static std::string hostOf(const std::string& address) {
+    return isTlsAddress(address) ? address.substr(TLS_SCHEME.size()) : address;
+}
+
+/*
+ * splitAddress function
+ * Splits a server address of the form "host" or "host:port", with or without ftps://.
+ * Returns true if the port is missing (then 21) or a number, false otherwise.
+ */
+static bool splitAddress(const std::string& address, std::string& host, int& port) {
+    std::string hostPort = hostOf(address);
+    size_t colon = hostPort.rfind(':');
+    host = hostPort.substr(0, colon);
+    port = 21;
+    if (colon != std::string::npos) {
+        try {
+            port = std::stoi(hostPort.substr(colon + 1));
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+    return true;
+}
+
 /*
  * constructor
  * Initializes the FTPClient object with the server address and port.
  * Takes parameters:
- * - serverAddress: the IP address of the server
+ * - serverAddress: the IP address of the server, prefixed with ftps:// for explicit FTPS
  * - serverPort: the port number of the server
  * Returns void.
  */
 ServerController::ServerController(const std::string& serverAddress, int serverPort)
-    : client(serverAddress, serverPort) {}
+    : client(hostOf(serverAddress), serverPort), driveIndex("drive", ".ftpstate/drive.index"),
+      serverAddress(hostOf(serverAddress)), serverPort(serverPort), tls(isTlsAddress(serverAddress)) {
+    client.setTls(tls);
+
+    // Load the index of the 'drive' directory, it is watched from the first push on
+    driveIndex.load();
+}
 
 // Destructor
 ServerController::~ServerController() {
-    // Cleanup can be done here if needed
+    // The index persists itself when it is destroyed
 }
 
 /*
@@ -44,29 +107,76 @@ bool ServerController::downloadFileValid(const std::string &remotePath) {
  * Takes parameters:
  * - username: the username to log in with
  * - password: the password to log in with
- * Returns void.
- * The function sends the USER and PASS commands to the server to log in.
+ * Returns true on success, false otherwise.
+ * The client pipelines the login with the session set-up when the server's features are cached.
+ * On success the credentials are kept so the client can open extra sessions for segmented downloads.
  * It catches any exceptions thrown by the FTPClient object and prints an error message.
  */
-void ServerController::login(const std::string& username, const std::string& password) {
+bool ServerController::login(const std::string& username, const std::string& password) {
     try {
-        client.user(username);
-        client.pass(password);
+        client.login(username, password);
+        std::lock_guard<std::mutex> lock(settingsMutex);
+        this->username = username;
+        this->password = password;
+        client.setSessionFactory([this]() { return openSession(); });
+        return true;
     } catch (const std::exception& ex) {
         std::cerr << "Login failed: " << ex.what() << std::endl;
+        return false;
+    }
+}
+
+/*
+ * openSession function
+ * Opens an additional, quiet session to the same server with the credentials of the last login.
+ * The session gets this session's direct I/O, pipeline depth, block mode and active mode settings.
+ * It runs on the threads of queued and segmented transfers, so the settings are copied
+ * under the settings lock first; connecting and logging in happen outside of it.
+ * Throws a runtime_error if the connection, the login or switching the mode fails.
+ * Returns the logged-in session.
+ */
+std::unique_ptr<FTPClient> ServerController::openSession() const {
+    std::unique_lock<std::mutex> lock(settingsMutex);
+    std::shared_ptr<DownloadCache> cache = downloadCache;
+    std::string user = username;
+    std::string pass = password;
+    bool direct = directIO;
+    unsigned depth = pipelineDepth;
+    bool block = blockMode;
+    bool active = activeMode;
+    lock.unlock();
+
+    auto session = std::make_unique<FTPClient>(serverAddress, serverPort, false);
+    session->setTls(tls);
+    session->setDownloadCache(cache);
+    session->setDirectIO(direct);
+    session->setPipelineDepth(depth);
+    session->login(user, pass);
+    if (block) {
+        session->setBlockMode(true);
+    }
+    if (active) {
+        session->setActiveMode(true);
     }
+    return session;
 }
 
 /*
  * listFiles function
  * Lists the files in the current directory on the server.
- * Returns void.
+ * With prefetching on, the listed files are then staged in the background.
+ * Returns true on success, false otherwise.
  */
-void ServerController::listFiles() {
+bool ServerController::listFiles() {
     try {
-        client.listFiles();
+        std::vector<FTPClient::ListEntry> entries = client.listFiles();
+        if (prefetcher) {
+            prefetcher->schedule(entries);
+        }
+        return true;
     } catch (const std::exception& ex) {
         std::cerr << "Failed to list files: " << ex.what() << std::endl;
+        return false;
     }
 }
 
@@ -76,51 +186,690 @@ void ServerController::listFiles() {
  * Takes parameters:
  * - localPath: the local path of the file to upload
  * - remotePath: the remote path where the file will be uploaded on the server
- * Returns void.
+ * Returns true on success, false otherwise.
  * The function catches any exceptions thrown by the FTPClient object and prints an error message.
  */
-void ServerController::uploadFile(const std::string& localPath, const std::string& remotePath) {
+bool ServerController::uploadFile(const std::string& localPath, const std::string& remotePath) {
     try {
         //upload the file
         client.uploadFile(localPath, remotePath);
+        return true;
+    } catch (const std::exception& ex) {
+        std::cerr << "Failed to upload file: " << ex.what() << std::endl;
+        return false;
+    }
+}
+
+/*
+ * uploadFileDelta function
+ * Uploads only the changed parts of a file that was uploaded before.
+ * Takes parameters:
+ * - localPath: the local path of the file to upload
+ * - remotePath: the remote path where the file will be uploaded on the server
+ * Returns true on success, false otherwise.
+ * The function catches any exceptions thrown by the FTPClient object and prints an error message.
+ */
+bool ServerController::uploadFileDelta(const std::string& localPath, const std::string& remotePath) {
+    try {
+        client.uploadFileDelta(localPath, remotePath);
+        return true;
     } catch (const std::exception& ex) {
         std::cerr << "Failed to upload file: " << ex.what() << std::endl;
+        return false;
     }
 }
 
+/*
+ * claimPrefetched function
+ * Takes a file the prefetcher staged, or is staging, instead of downloading it.
+ * Takes parameters:
+ * - remotePath: the file on the server
+ * - localPath: where in the drive directory to put it
+ * Returns true if the file is in place, false if it still has to be downloaded.
+ */
+bool ServerController::claimPrefetched(const std::string& remotePath, const std::string& localPath) {
+    if (!prefetcher) {
+        return false;
+    }
+    std::error_code error;
+    std::filesystem::create_directory("drive", error);
+    if (!prefetcher->claim(remotePath, "drive/" + localPath)) {
+        return false;
+    }
+    std::cout << "Served from the prefetch staging area: " << remotePath << std::endl;
+    return true;
+}
+
 /*
  * downloadFile function
  * Downloads a file from the server.
  * Takes parameters:
  * - remotePath: the remote path of the file to download
  * - localPath: the local path where the file will be saved
- * Returns void.
+ * Returns true on success, false otherwise.
  * The function catches any exceptions thrown by the FTPClient object and prints an error message.
  */
-void ServerController::downloadFile(const std::string& remotePath, const std::string& localPath) {
+bool ServerController::downloadFile(const std::string& remotePath, const std::string& localPath) {
 
     if (downloadFileValid(remotePath) == false) {
         std::cerr<<"Invalid path"<<std::endl;
-        return;
+        return false;
+    }
+    if (claimPrefetched(remotePath, localPath)) {
+        return true;
     }
 
     try {
         client.downloadFile(remotePath, localPath);
+        return true;
     } catch (const std::exception& ex) {
         std::cerr << "Failed to download file: " << ex.what() << std::endl;
+        return false;
+    }
+}
+
+/*
+ * openRemoteFile function
+ * Opens a remote file for reads at any offset, on sessions of its own.
+ * Takes parameters:
+ * - remotePath: the file on the server
+ * - cache: the block cache to read through
+ * Returns the file, or null if it cannot be opened; an error message is printed then.
+ */
+std::unique_ptr<RemoteFile> ServerController::openRemoteFile(const std::string& remotePath,
+                                                             std::shared_ptr<BlockCache> cache) {
+    try {
+        return std::make_unique<RemoteFile>([this]() { return openSession(); }, remotePath, std::move(cache));
+    } catch (const std::exception& ex) {
+        std::cerr << "Failed to open remote file: " << ex.what() << std::endl;
+        return nullptr;
+    }
+}
+
+/*
+ * readRemote function
+ * Reads a byte range of a remote file without downloading the rest of it.
+ * Takes parameters:
+ * - remotePath: the file on the server
+ * - offset: the first byte of the range
+ * - length: the number of bytes to read
+ * - localPath: where in the drive directory to save the range
+ * Returns true on success, false otherwise.
+ * The file stays open until another file is read, so further reads of it reuse its sessions
+ * and cached blocks.
+ * The function catches any exceptions thrown by the RemoteFile object and prints an error message.
+ */
+bool ServerController::readRemote(const std::string& remotePath, uint64_t offset, uint64_t length,
+                                  const std::string& localPath) {
+    if (downloadFileValid(remotePath) == false || downloadFileValid(localPath) == false) {
+        return false;
+    }
+    if (!remoteFile || remoteFilePath != remotePath) {
+        remoteFile.reset();
+        if (!blockCache) {
+            blockCache = std::make_shared<BlockCache>(BLOCK_CACHE_BYTES);
+        }
+        remoteFile = openRemoteFile(remotePath, blockCache);
+        if (!remoteFile) {
+            return false;
+        }
+        remoteFilePath = remotePath;
+    }
+
+    std::string fullLocalPath = "drive/" + localPath;
+    int fileFd = open(fullLocalPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fileFd < 0) {
+        std::cerr << "Failed to open local file: " << fullLocalPath << std::endl;
+        return false;
+    }
+    try {
+        std::vector<char> buffer(static_cast<size_t>(std::min<uint64_t>(length, RemoteFile::MAX_READAHEAD)));
+        uint64_t done = 0;
+        while (done < length) {
+            size_t wanted = static_cast<size_t>(std::min<uint64_t>(buffer.size(), length - done));
+            size_t bytesRead = remoteFile->pread(buffer.data(), wanted, offset + done);
+            if (bytesRead == 0) {
+                break;
+            }
+            if (write(fileFd, buffer.data(), bytesRead) != static_cast<ssize_t>(bytesRead)) {
+                throw std::runtime_error("Failed to write file data: " + fullLocalPath);
+            }
+            done += bytesRead;
+        }
+        close(fileFd);
+        std::cout << "Read " << done << " bytes at offset " << offset << " of " << remotePath << " ("
+                  << remoteFile->size() << " bytes)" << std::endl;
+        return true;
+    } catch (const std::exception& ex) {
+        close(fileFd);
+        // Sessions that failed were dropped, the file itself stays usable
+        std::cerr << "Failed to read remote file: " << ex.what() << std::endl;
+        return false;
+    }
+}
+
+/*
+ * downloadFiles function
+ * Downloads several files at once over the session's single control connection.
+ * Takes a parameter remotePaths listing the files; each is saved under the same name.
+ * Returns true if every file was downloaded, false otherwise.
+ * The function catches any exceptions thrown by the FTPClient object and prints an error message.
+ */
+bool ServerController::downloadFiles(const std::vector<std::string>& remotePaths) {
+    for (const std::string& remotePath : remotePaths) {
+        if (downloadFileValid(remotePath) == false) {
+            return false;
+        }
+    }
+
+    std::vector<std::string> remaining;
+    for (const std::string& remotePath : remotePaths) {
+        if (!claimPrefetched(remotePath, remotePath)) {
+            remaining.push_back(remotePath);
+        }
+    }
+    if (remaining.empty()) {
+        return true;
+    }
+
+    try {
+        return client.downloadFiles(remaining) == 0;
+    } catch (const std::exception& ex) {
+        std::cerr << "Failed to download files: " << ex.what() << std::endl;
+        return false;
+    }
+}
+
+/*
+ * downloadFromMirrors function
+ * Downloads one file striped across several servers holding identical copies.
+ * Every mirror is logged in to with the credentials of the last login.
+ * Takes parameters:
+ * - mirrors: the servers as "host" or "host:port", prefixed with ftps:// for explicit FTPS
+ * - remotePath: the file on the mirrors
+ * - localPath: the local path where the file will be saved
+ * Returns true on success, false otherwise.
+ * Ranges are spread over the mirrors by their measured throughput, and what each one
+ * contributed is printed at the end.
+ */
+bool ServerController::downloadFromMirrors(const std::vector<std::string>& mirrors, const std::string& remotePath,
+                                           const std::string& localPath) {
+    if (downloadFileValid(remotePath) == false || downloadFileValid(localPath) == false) {
+        return false;
+    }
+    if (username.empty()) {
+        std::cerr << "Log in before downloading from mirrors" << std::endl;
+        return false;
+    }
+
+    std::vector<SegmentedTransfer::Source> sources;
+    for (const std::string& mirror : mirrors) {
+        bool mirrorTls = isTlsAddress(mirror);
+        std::string host;
+        int port;
+        if (!splitAddress(mirror, host, port)) {
+            std::cerr << "Invalid mirror: " << mirror << std::endl;
+            return false;
+        }
+        SegmentedTransfer::Source source;
+        source.name = mirror;
+        source.streams = MIRROR_STREAMS;
+        // The mirror workers log in with copies of the credentials, not this session's members
+        source.factory = [host, port, mirrorTls, user = username, pass = password]() {
+            auto session = std::make_unique<FTPClient>(host, port, false);
+            session->setTls(mirrorTls);
+            session->login(user, pass);
+            return session;
+        };
+        sources.push_back(std::move(source));
+    }
+
+    try {
+        // The size is taken from the first mirror that answers, the others are checked against it
+        int64_t size = -1;
+        for (const SegmentedTransfer::Source& source : sources) {
+            try {
+                std::unique_ptr<FTPClient> session = source.factory();
+                size = session->remoteSize(remotePath);
+                session->logout();
+                if (size >= 0) {
+                    break;
+                }
+            } catch (const std::exception& ex) {
+                std::cerr << "Mirror " << source.name << " unavailable: " << ex.what() << std::endl;
+            }
+        }
+        if (size < 0) {
+            throw std::runtime_error("No mirror reports the size of " + remotePath);
+        }
+
+        std::filesystem::create_directories("drive");
+        std::string fullLocalPath = "drive/" + localPath;
+        DownloadCache::detach(fullLocalPath);
+        int fileFd = open(fullLocalPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fileFd < 0) {
+            throw std::runtime_error("Failed to create file: " + fullLocalPath);
+        }
+
+        std::shared_ptr<TransferProgress> progress = ProgressMonitor::instance().track(remotePath, size);
+        std::vector<SegmentedTransfer::SourceStats> stats;
+        try {
+            stats = SegmentedTransfer::download(sources, remotePath, fileFd, static_cast<uint64_t>(size),
+                                                progress.get());
+        } catch (const std::exception&) {
+            ProgressMonitor::instance().untrack(progress);
+            close(fileFd);
+            throw;
+        }
+        ProgressMonitor::instance().untrack(progress);
+        close(fileFd);
+
+        for (const SegmentedTransfer::SourceStats& source : stats) {
+            std::cout << "  " << source.name << ": " << source.bytes << " bytes";
+            if (source.seconds > 0) {
+                std::cout << " at " << static_cast<uint64_t>(source.bytes / source.seconds / 1024) << " KiB/s";
+            }
+            if (source.failures > 0) {
+                std::cout << ", " << source.failures << " failed ranges";
+            }
+            if (source.dropped) {
+                std::cout << ", dropped";
+            }
+            std::cout << std::endl;
+        }
+        std::cout << "File downloaded successfully: " << remotePath << std::endl;
+        return true;
+    } catch (const std::exception& ex) {
+        std::cerr << "Failed to download from mirrors: " << ex.what() << std::endl;
+        return false;
+    }
+}
+
+/*
+ * copyToServer function
+ * Copies a file from this server to another one directly between the servers (FXP).
+ * The other server is logged in to with the credentials of the last login.
+ * Takes parameters:
+ * - remotePath: the file on this server
+ * - server: the receiving server as "host" or "host:port"
+ * - targetPath: the path of the copy on the receiving server
+ * Returns true on success, false otherwise.
+ * Both ends get sessions of their own, so the data connection between the servers never
+ * disturbs this session's state; they are closed afterwards whatever the outcome.
+ */
+bool ServerController::copyToServer(const std::string& remotePath, const std::string& server,
+                                    const std::string& targetPath) {
+    if (downloadFileValid(remotePath) == false || downloadFileValid(targetPath) == false) {
+        return false;
+    }
+    if (username.empty()) {
+        std::cerr << "Log in before copying to another server" << std::endl;
+        return false;
+    }
+    std::string host;
+    int port;
+    if (!splitAddress(server, host, port)) {
+        std::cerr << "Invalid server: " << server << std::endl;
+        return false;
+    }
+
+    try {
+        std::unique_ptr<FTPClient> source = openSession();
+        // The receiving server talks stream mode, whatever this session uses
+        if (blockMode) {
+            source->setBlockMode(false);
+        }
+        FTPClient target(host, port, false);
+        target.setTls(isTlsAddress(server));
+        target.login(username, password);
+
+        source->transferTo(target, remotePath, targetPath);
+        source->logout();
+        target.logout();
+        std::cout << "File copied successfully: " << remotePath << " to " << server << " " << targetPath << std::endl;
+        return true;
+    } catch (const std::exception& ex) {
+        std::cerr << "Failed to copy file: " << ex.what() << std::endl;
+        return false;
+    }
+}
+
+/*
+ * uploadDirectory function
+ * Uploads a directory as a single streamed tar archive.
+ * Takes parameters:
+ * - localDir: the local directory to upload
+ * - remotePath: the remote path of the archive
+ * Returns true on success, false otherwise.
+ * The function catches any exceptions thrown by the FTPClient object and prints an error message.
+ */
+bool ServerController::uploadDirectory(const std::string& localDir, const std::string& remotePath) {
+    try {
+        client.uploadDirectoryArchive(localDir, remotePath);
+        return true;
+    } catch (const std::exception& ex) {
+        std::cerr << "Failed to upload directory: " << ex.what() << std::endl;
+        return false;
+    }
+}
+
+/*
+ * downloadDirectory function
+ * Downloads a tar archive and unpacks it into a local directory.
+ * Takes parameters:
+ * - remotePath: the remote path of the archive
+ * - localDir: the local directory to unpack into
+ * Returns true on success, false otherwise.
+ * The function catches any exceptions thrown by the FTPClient object and prints an error message.
+ */
+bool ServerController::downloadDirectory(const std::string& remotePath, const std::string& localDir) {
+
+    if (downloadFileValid(remotePath) == false) {
+        std::cerr<<"Invalid path"<<std::endl;
+        return false;
+    }
+
+    try {
+        client.downloadDirectoryArchive(remotePath, localDir);
+        return true;
+    } catch (const std::exception& ex) {
+        std::cerr << "Failed to download directory: " << ex.what() << std::endl;
+        return false;
+    }
+}
+
+/*
+ * pushChanged function
+ * Uploads every file under 'drive' that changed since it was last pushed.
+ * Each file is uploaded to the same relative path on the server.
+ * Returns true if every changed file was pushed, false otherwise.
+ * The function asks the drive index for the changed files, so only those are looked at
+ * instead of rehashing the whole tree, and records each successful upload in the index.
+ * The first push starts the index watcher, so later pushes only look at what changed since.
+ * It catches any exceptions thrown by the FTPClient object and prints an error message.
+ */
+bool ServerController::pushChanged() {
+    std::vector<std::string> changed;
+    try {
+        driveIndex.startWatching();
+        changed = driveIndex.changedFiles();
+    } catch (const std::exception& ex) {
+        std::cerr << "Failed to scan drive: " << ex.what() << std::endl;
+        return false;
+    }
+
+    if (changed.empty()) {
+        std::cout << "Nothing to push." << std::endl;
+        return true;
+    }
+
+    size_t pushed = 0;
+    for (const std::string& path : changed) {
+        try {
+            client.uploadFile(path, path);
+            driveIndex.markSynced(path);
+            ++pushed;
+        } catch (const std::exception& ex) {
+            std::cerr << "Failed to push " << path << ": " << ex.what() << std::endl;
+        }
+    }
+
+    try {
+        driveIndex.save();
+    } catch (const std::exception& ex) {
+        std::cerr << "Failed to save drive index: " << ex.what() << std::endl;
+    }
+
+    std::cout << "Pushed " << pushed << " of " << changed.size() << " changed files." << std::endl;
+    return pushed == changed.size();
+}
+
+/*
+ * setDirectIO function
+ * Selects whether downloads bypass the page cache.
+ * Takes a boolean parameter enabled.
+ * Returns void.
+ */
+void ServerController::setDirectIO(bool enabled) {
+    client.setDirectIO(enabled);
+    std::lock_guard<std::mutex> lock(settingsMutex);
+    directIO = enabled;
+}
+
+/*
+ * setPipelineDepth function
+ * Selects how many buffers separate the disk and network threads of uploads and downloads.
+ * Takes a parameter depth, 0 to run both on one thread.
+ * Returns void.
+ */
+void ServerController::setPipelineDepth(unsigned depth) {
+    client.setPipelineDepth(depth);
+    std::lock_guard<std::mutex> lock(settingsMutex);
+    pipelineDepth = depth;
+}
+
+/*
+ * setSegmentedUpload function
+ * Selects whether large uploads are stored as parallel ranges over extra sessions.
+ * Takes a boolean parameter enabled.
+ * Returns void.
+ */
+void ServerController::setSegmentedUpload(bool enabled) {
+    client.setSegmentedUpload(enabled);
+}
+
+/*
+ * setSegmentedDownload function
+ * Selects whether large downloads are fetched as parallel ranges over extra sessions.
+ * Takes a boolean parameter enabled.
+ * Returns void.
+ */
+void ServerController::setSegmentedDownload(bool enabled) {
+    client.setSegmentedDownload(enabled);
+}
+
+/*
+ * setTimeouts function
+ * Sets the connect, idle and stall timeouts of this session and of every session opened later.
+ * Takes a parameter timeouts with the values in milliseconds.
+ * Returns void.
+ */
+void ServerController::setTimeouts(const FTPClient::Timeouts& timeouts) {
+    FTPClient::setDefaultTimeouts(timeouts);
+    client.setTimeouts(timeouts);
+}
+
+/*
+ * submitTransfer function
+ * Queues an upload or download to run in the background on the scheduler's own sessions.
+ * Takes parameters:
+ * - upload: true for an upload of localPath to remotePath, false for a download of remotePath to localPath
+ * - localPath: the local file
+ * - remotePath: the file on the server
+ * - priority: "urgent", "normal" or "bulk"
+ * - deadlineSeconds: seconds from now the transfer should be done by, 0 for no deadline
+ * Returns true if the transfer was queued, false otherwise.
+ */
+bool ServerController::submitTransfer(bool upload, const std::string& localPath, const std::string& remotePath,
+                                      const std::string& priority, double deadlineSeconds) {
+    TransferScheduler::Priority priorityClass;
+    if (!TransferScheduler::parsePriority(priority, priorityClass)) {
+        std::cerr << "Unknown priority: " << priority << std::endl;
+        return false;
+    }
+    if (!upload && downloadFileValid(remotePath) == false) {
+        return false;
+    }
+    if (username.empty()) {
+        std::cerr << "Log in before queueing transfers" << std::endl;
+        return false;
+    }
+
+    if (!scheduler) {
+        scheduler = std::make_unique<TransferScheduler>([this]() { return openSession(); }, SCHEDULER_SESSIONS);
+    }
+    uint64_t id = scheduler->submit(upload, localPath, remotePath, priorityClass, deadlineSeconds);
+    std::cout << "Queued transfer " << id << " (" << priority << "): " << remotePath << std::endl;
+    return true;
+}
+
+/*
+ * waitTransfers function
+ * Waits until every queued transfer has finished.
+ * Returns void.
+ */
+void ServerController::waitTransfers() {
+    if (scheduler) {
+        scheduler->wait();
+    }
+}
+
+/*
+ * printTransferMetrics function
+ * Prints the queueing delay and deadline statistics of the queued transfers,
+ * the TLS session resumption rate when the server is reached over FTPS,
+ * and the hit rate of the download cache when it is enabled.
+ * Returns void.
+ */
+void ServerController::printTransferMetrics() {
+    if (!scheduler) {
+        std::cout << "No transfers queued yet" << std::endl;
+    } else {
+        scheduler->printMetrics(std::cout);
+    }
+    if (tls) {
+        TlsChannel::printStats(std::cout);
+    }
+    if (downloadCache) {
+        downloadCache->printStats(std::cout);
+    }
+    if (prefetcher) {
+        prefetcher->printStats(std::cout);
+    }
+    if (remoteFile) {
+        remoteFile->printStats(std::cout);
+        blockCache->printStats(std::cout);
+    }
+}
+
+/*
+ * openDownloadCache function
+ * Opens the download cache in FTP_CACHE_DIR, or in .ftpstate/cache when it is not set.
+ * Takes a parameter budgetBytes representing how many bytes of files the cache keeps.
+ * Returns the cache, or null if the directory cannot be created; an error message is printed then.
+ */
+std::shared_ptr<DownloadCache> ServerController::openDownloadCache(uint64_t budgetBytes) {
+    const char* fromEnv = std::getenv("FTP_CACHE_DIR");
+    try {
+        return std::make_shared<DownloadCache>(fromEnv && *fromEnv ? fromEnv : CACHE_FOLDER, budgetBytes);
+    } catch (const std::exception& ex) {
+        std::cerr << "Failed to open the download cache: " << ex.what() << std::endl;
+        return nullptr;
+    }
+}
+
+/*
+ * setPrefetch function
+ * Turns prefetching of listed files on or off. While on, every listing starts staging its
+ * files on PREFETCH_SESSIONS background sessions, and downloads of staged files complete
+ * from the staging area. A new setting drops the files staged so far.
+ * Takes a parameter budgetBytes representing how many bytes of files may be staged, 0 to turn it off.
+ * Returns true on success, false if the staging area cannot be created.
+ */
+bool ServerController::setPrefetch(uint64_t budgetBytes) {
+    prefetcher.reset();
+    if (budgetBytes == 0) {
+        return true;
+    }
+    try {
+        prefetcher = std::make_unique<Prefetcher>([this]() { return openSession(); }, STAGING_FOLDER, budgetBytes,
+                                                  PREFETCH_SESSIONS);
+        return true;
+    } catch (const std::exception& ex) {
+        std::cerr << "Failed to turn on prefetching: " << ex.what() << std::endl;
+        return false;
+    }
+}
+
+/*
+ * setDownloadCache function
+ * Selects the download cache of this session and of the sessions it opens later.
+ * Takes a parameter cache, which may be shared with other sessions, or null to turn caching off.
+ * Returns void.
+ */
+void ServerController::setDownloadCache(std::shared_ptr<DownloadCache> cache) {
+    client.setDownloadCache(cache);
+    std::lock_guard<std::mutex> lock(settingsMutex);
+    downloadCache = std::move(cache);
+}
+
+/*
+ * setTlsResumption function
+ * Selects whether TLS handshakes resume cached sessions, for every session of the process.
+ * Takes a boolean parameter enabled.
+ * Returns void.
+ */
+void ServerController::setTlsResumption(bool enabled) {
+    TlsChannel::setResumption(enabled);
+}
+
+/*
+ * setBlockMode function
+ * Selects whether transfers of this session share one data connection in block mode (MODE B).
+ * Takes a boolean parameter enabled.
+ * Returns true on success, false if the server does not support the mode.
+ * The function catches any exceptions thrown by the FTPClient object and prints an error message;
+ * the session then keeps its current mode.
+ */
+bool ServerController::setBlockMode(bool enabled) {
+    try {
+        client.setBlockMode(enabled);
+        std::lock_guard<std::mutex> lock(settingsMutex);
+        blockMode = enabled;
+        return true;
+    } catch (const std::exception& ex) {
+        std::cerr << "Failed to switch transfer mode: " << ex.what() << std::endl;
+        return false;
+    }
+}
+
+/*
+ * setActiveMode function
+ * Selects whether the server opens the data connections of this session (PORT/EPRT) instead of us (PASV).
+ * Takes a boolean parameter enabled.
+ * Returns true on success, false if no listening socket could be opened.
+ * The function catches any exceptions thrown by the FTPClient object and prints an error message;
+ * the session then stays passive.
+ */
+bool ServerController::setActiveMode(bool enabled) {
+    try {
+        client.setActiveMode(enabled);
+        std::lock_guard<std::mutex> lock(settingsMutex);
+        activeMode = enabled;
+        return true;
+    } catch (const std::exception& ex) {
+        std::cerr << "Failed to switch to active mode: " << ex.what() << std::endl;
+        return false;
     }
 }
 
 /*
  * logout function
  * Logs out the user from the server.
- * Returns void.
+ * Returns true on success, false otherwise.
+ * Waits for queued transfers first.
  * The function catches any exceptions thrown by the FTPClient object and prints an error message.
  */
-void ServerController::logout() {
+bool ServerController::logout() {
+    // Queued transfers are finished before the session goes away
+    scheduler.reset();
+    prefetcher.reset();
+    remoteFile.reset();
     try {
         client.logout();
+        return true;
     } catch (const std::exception& ex) {
         std::cerr << "Logout failed: " << ex.what() << std::endl;
+        return false;
     }
 }
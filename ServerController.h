@@ -2,7 +2,14 @@
     #define SERVERCONTROLLER_H
 
     #include "FTPClient.h"
+    #include "DriveIndex.h"
+    #include "TransferScheduler.h"
+    #include "RemoteFile.h"
+    #include "Prefetcher.h"
+    #include <memory>
+    #include <mutex>
     #include <string>
+    #include <vector>
     #include <stdexcept>
 
     class ServerController {
@@ -12,14 +19,64 @@
 
         static bool downloadFileValid(const std::string &remotePath);
 
-        void login(const std::string& username, const std::string& password);
-        void listFiles();
-        void uploadFile(const std::string& localPath, const std::string& remotePath);
-        void downloadFile(const std::string& remotePath, const std::string& localPath);
-        void logout();
+        bool login(const std::string& username, const std::string& password);
+        bool listFiles();
+        bool uploadFile(const std::string& localPath, const std::string& remotePath);
+        bool uploadFileDelta(const std::string& localPath, const std::string& remotePath);
+        bool downloadFile(const std::string& remotePath, const std::string& localPath);
+        bool downloadFiles(const std::vector<std::string>& remotePaths);
+        bool downloadFromMirrors(const std::vector<std::string>& mirrors, const std::string& remotePath,
+                                 const std::string& localPath);
+        bool readRemote(const std::string& remotePath, uint64_t offset, uint64_t length, const std::string& localPath);
+        std::unique_ptr<RemoteFile> openRemoteFile(const std::string& remotePath, std::shared_ptr<BlockCache> cache);
+        bool copyToServer(const std::string& remotePath, const std::string& server, const std::string& targetPath);
+        bool uploadDirectory(const std::string& localDir, const std::string& remotePath);
+        bool downloadDirectory(const std::string& remotePath, const std::string& localDir);
+        bool pushChanged();
+        void setDirectIO(bool enabled);
+        void setPipelineDepth(unsigned depth);
+        void setTimeouts(const FTPClient::Timeouts& timeouts);
+        void setTlsResumption(bool enabled);
+        bool setBlockMode(bool enabled);
+        bool setActiveMode(bool enabled);
+        void setSegmentedUpload(bool enabled);
+        void setSegmentedDownload(bool enabled);
+        bool submitTransfer(bool upload, const std::string& localPath, const std::string& remotePath,
+                            const std::string& priority, double deadlineSeconds);
+        void waitTransfers();
+        void printTransferMetrics();
+        void setDownloadCache(std::shared_ptr<DownloadCache> cache);
+        static std::shared_ptr<DownloadCache> openDownloadCache(uint64_t budgetBytes);
+        bool setPrefetch(uint64_t budgetBytes);
+        bool logout();
 
     private:
         FTPClient client;
+        DriveIndex driveIndex;
+        std::string serverAddress;
+        int serverPort;
+        bool tls;
+        // Guards the credentials and settings below: openSession reads them on worker threads
+        mutable std::mutex settingsMutex;
+        std::shared_ptr<DownloadCache> downloadCache;
+        std::string username;
+        std::string password;
+        // Settings of this session, given to every session opened for it
+        bool directIO = false;
+        unsigned pipelineDepth = 0;
+        bool blockMode = false;
+        bool activeMode = false;
+        std::shared_ptr<BlockCache> blockCache;
+        // The file of the last readRemote, kept open with its sessions for the next one
+        std::unique_ptr<RemoteFile> remoteFile;
+        std::string remoteFilePath;
+        // Stages the files of the last listing for the downloads expected to follow it
+        std::unique_ptr<Prefetcher> prefetcher;
+        // Declared last so queued transfers finish while the rest of the controller is still alive
+        std::unique_ptr<TransferScheduler> scheduler;
+
+        std::unique_ptr<FTPClient> openSession() const;
+        bool claimPrefetched(const std::string& remotePath, const std::string& localPath);
     };
 
     #endif
@@ -0,0 +1,606 @@
+#include "TarStream.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+
+const size_t TAR_BLOCK = 512;
+// Size of the blocks handed to the sink and of the inflate buffer
+const size_t TAR_BUFFER_SIZE = 256 * 1024;
+// Files up to this size are buffered and written by the worker pool
+const uint64_t SMALL_FILE_LIMIT = 1024 * 1024;
+// Upper bound on the file data waiting for the workers
+const size_t MAX_QUEUED_BYTES = 64 * 1024 * 1024;
+
+/*
+ * writeNumber function
+ * Writes a number into a tar header field.
+ * Uses zero-padded octal when it fits and the GNU base-256 encoding otherwise,
+ * which is what lets entries larger than 8 GB through.
+ */
+static void writeNumber(char* field, size_t width, uint64_t value) {
+    if (value >= (1ULL << (3 * (width - 1)))) {
+        std::memset(field, 0, width);
+        field[0] = static_cast<char>(0x80);
+        for (size_t i = width - 1; i > 0 && value > 0; --i) {
+            field[i] = static_cast<char>(value & 0xFF);
+            value >>= 8;
+        }
+        return;
+    }
+    std::snprintf(field, width, "%0*llo", static_cast<int>(width - 1), static_cast<unsigned long long>(value));
+}
+
+/*
+ * readNumber function
+ * Reads a number from a tar header field in either octal or base-256 encoding.
+ */
+static uint64_t readNumber(const char* field, size_t width) {
+    if (static_cast<unsigned char>(field[0]) & 0x80) {
+        uint64_t value = static_cast<unsigned char>(field[0]) & 0x7F;
+        for (size_t i = 1; i < width; ++i) {
+            value = (value << 8) | static_cast<unsigned char>(field[i]);
+        }
+        return value;
+    }
+    uint64_t value = 0;
+    for (size_t i = 0; i < width && field[i] != '\0' && field[i] != ' '; ++i) {
+        if (field[i] >= '0' && field[i] <= '7') {
+            value = (value << 3) | static_cast<uint64_t>(field[i] - '0');
+        }
+    }
+    return value;
+}
+
+/*
+ * headerChecksum function
+ * Computes the checksum of a tar header, counting the checksum field as spaces.
+ */
+static unsigned headerChecksum(const char* header) {
+    unsigned sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK; ++i) {
+        sum += (i >= 148 && i < 156) ? ' ' : static_cast<unsigned char>(header[i]);
+    }
+    return sum;
+}
+
+/*
+ * Constructor for the TarWriter class.
+ * Takes parameters:
+ * - sink: receives the archive bytes in large blocks
+ * - compress: gzip-compress the archive
+ * Throws a runtime_error if compression is requested but not available.
+ */
+TarWriter::TarWriter(Sink sink, bool compress) : sink(std::move(sink)), compress(compress), buffer(TAR_BUFFER_SIZE) {
+    if (compress) {
+#ifdef HAVE_ZLIB
+        // Level 1 keeps the compressor ahead of the network
+        if (deflateInit2(&zstream, 1, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw std::runtime_error("Failed to initialize compression");
+        }
+        compressed.resize(TAR_BUFFER_SIZE);
+#else
+        throw std::runtime_error("Compression is not available in this build");
+#endif
+    }
+}
+
+/*
+ * Destructor for the TarWriter class.
+ * Releases the compressor.
+ */
+TarWriter::~TarWriter() {
+#ifdef HAVE_ZLIB
+    if (compress) {
+        deflateEnd(&zstream);
+    }
+#endif
+}
+
+/*
+ * put function
+ * Appends bytes to the archive, handing full blocks to the sink.
+ * Returns void.
+ */
+void TarWriter::put(const char* data, size_t length) {
+    while (length > 0) {
+        if (used == buffer.size()) {
+            flush(false);
+        }
+        size_t n = std::min(length, buffer.size() - used);
+        std::memcpy(buffer.data() + used, data, n);
+        used += n;
+        data += n;
+        length -= n;
+    }
+}
+
+/*
+ * pad function
+ * Pads an entry of the given size up to the next block boundary.
+ * Returns void.
+ */
+void TarWriter::pad(uint64_t size) {
+    static const char zeros[TAR_BLOCK] = {};
+    size_t remainder = size % TAR_BLOCK;
+    if (remainder != 0) {
+        put(zeros, TAR_BLOCK - remainder);
+    }
+}
+
+/*
+ * flush function
+ * Hands the buffered archive bytes to the sink, compressing them if enabled.
+ * Takes a boolean parameter last which terminates the compressed stream.
+ * Returns void.
+ */
+void TarWriter::flush(bool last) {
+    if (!compress) {
+        if (used > 0) {
+            sink(buffer.data(), used);
+        }
+        used = 0;
+        return;
+    }
+
+#ifdef HAVE_ZLIB
+    zstream.next_in = reinterpret_cast<Bytef*>(buffer.data());
+    zstream.avail_in = static_cast<uInt>(used);
+    int result;
+    do {
+        zstream.next_out = reinterpret_cast<Bytef*>(compressed.data());
+        zstream.avail_out = static_cast<uInt>(compressed.size());
+        result = deflate(&zstream, last ? Z_FINISH : Z_NO_FLUSH);
+        if (result == Z_STREAM_ERROR) {
+            throw std::runtime_error("Compression failed");
+        }
+        size_t produced = compressed.size() - zstream.avail_out;
+        if (produced > 0) {
+            sink(compressed.data(), produced);
+        }
+    } while (zstream.avail_out == 0 || (last && result != Z_STREAM_END));
+#else
+    // Without zlib compress is never set, there is no stream to terminate
+    (void)last;
+#endif
+    used = 0;
+}
+
+/*
+ * writeHeader function
+ * Writes the ustar header of an entry.
+ * Names too long for the name field are split into prefix and name,
+ * or preceded by a GNU long name entry when no split fits.
+ * Returns void.
+ */
+void TarWriter::writeHeader(const std::string& name, uint64_t size, unsigned mode, int64_t mtime, char type) {
+    char header[TAR_BLOCK] = {};
+    std::string shortName = name;
+    std::string prefix;
+
+    if (name.size() > 100) {
+        // Split at the last slash that leaves at most 155 bytes of prefix
+        size_t split = name.rfind('/', 155);
+        if (split != std::string::npos && split > 0 && name.size() - split - 1 <= 100 && split + 1 < name.size()) {
+            prefix = name.substr(0, split);
+            shortName = name.substr(split + 1);
+        } else {
+            writeHeader("././@LongLink", name.size() + 1, 0644, 0, 'L');
+            put(name.c_str(), name.size() + 1);
+            pad(name.size() + 1);
+            shortName = name.substr(0, 100);
+        }
+    }
+
+    std::memcpy(header, shortName.data(), std::min<size_t>(shortName.size(), 100));
+    writeNumber(header + 100, 8, mode);
+    writeNumber(header + 108, 8, 0);
+    writeNumber(header + 116, 8, 0);
+    writeNumber(header + 124, 12, size);
+    writeNumber(header + 136, 12, static_cast<uint64_t>(mtime < 0 ? 0 : mtime));
+    header[156] = type;
+    std::memcpy(header + 257, "ustar", 6);
+    std::memcpy(header + 263, "00", 2);
+    std::memcpy(header + 345, prefix.data(), std::min<size_t>(prefix.size(), 155));
+
+    std::snprintf(header + 148, 8, "%06o", headerChecksum(header));
+    header[155] = ' ';
+
+    put(header, TAR_BLOCK);
+}
+
+/*
+ * addDirectory function
+ * Adds a directory entry to the archive.
+ * Takes a string parameter name representing the path inside the archive.
+ * Returns void.
+ */
+void TarWriter::addDirectory(const std::string& name) {
+    writeHeader(name.back() == '/' ? name : name + "/", 0, 0755, 0, '5');
+}
+
+/*
+ * addFile function
+ * Adds a regular file to the archive, reading it straight into the send buffer.
+ * Takes parameters:
+ * - fullPath: the file on disk
+ * - name: the path inside the archive
+ * Throws a runtime_error if the file cannot be read or shrinks while being archived.
+ * Returns void.
+ */
+void TarWriter::addFile(const std::string& fullPath, const std::string& name) {
+    int fd = open(fullPath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open file: " + fullPath);
+    }
+
+    struct stat st = {};
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        throw std::runtime_error("Failed to stat file: " + fullPath);
+    }
+
+    uint64_t size = static_cast<uint64_t>(st.st_size);
+    writeHeader(name, size, st.st_mode & 07777, st.st_mtime, '0');
+
+    // Read directly into the buffer, the size in the header is what gets archived
+    uint64_t copied = 0;
+    while (copied < size) {
+        if (used == buffer.size()) {
+            flush(false);
+        }
+        size_t space = std::min<uint64_t>(buffer.size() - used, size - copied);
+        ssize_t bytesRead = read(fd, buffer.data() + used, space);
+        if (bytesRead <= 0) {
+            close(fd);
+            throw std::runtime_error("File changed while archiving: " + fullPath);
+        }
+        used += bytesRead;
+        copied += bytesRead;
+    }
+    close(fd);
+
+    pad(size);
+    ++files;
+    bytes += size;
+}
+
+/*
+ * finish function
+ * Terminates the archive with two zero blocks and flushes everything to the sink.
+ * Returns void.
+ */
+void TarWriter::finish() {
+    static const char zeros[2 * TAR_BLOCK] = {};
+    put(zeros, sizeof(zeros));
+    flush(true);
+}
+
+/*
+ * Constructor for the TarReader class.
+ * Takes parameters:
+ * - destination: the directory the archive is unpacked into
+ * - compressed: the archive is gzip-compressed
+ * - workers: the number of threads writing small files
+ * Throws a runtime_error if decompression is requested but not available.
+ */
+TarReader::TarReader(const std::string& destination, bool compressed, unsigned workers)
+    : destination(destination), compressed(compressed) {
+    if (compressed) {
+#ifdef HAVE_ZLIB
+        if (inflateInit2(&zstream, 15 + 32) != Z_OK) {
+            throw std::runtime_error("Failed to initialize decompression");
+        }
+        inflated.resize(TAR_BUFFER_SIZE);
+#else
+        throw std::runtime_error("Compression is not available in this build");
+#endif
+    }
+
+    std::filesystem::create_directories(destination);
+
+    for (unsigned i = 0; i < std::max(1u, workers); ++i) {
+        this->workers.emplace_back(&TarReader::workerLoop, this);
+    }
+}
+
+/*
+ * Destructor for the TarReader class.
+ * Stops the workers and releases the decompressor.
+ */
+TarReader::~TarReader() {
+    stopWorkers();
+    if (entryFd >= 0) {
+        close(entryFd);
+    }
+#ifdef HAVE_ZLIB
+    if (compressed) {
+        inflateEnd(&zstream);
+    }
+#endif
+}
+
+/*
+ * feed function
+ * Hands received archive bytes to the reader.
+ * Takes parameters:
+ * - data: the received bytes
+ * - length: the number of bytes
+ * Throws a runtime_error if the archive is corrupt or a file cannot be written.
+ * Returns void.
+ */
+void TarReader::feed(const char* data, size_t length) {
+    if (!compressed) {
+        parse(data, length);
+        return;
+    }
+
+#ifdef HAVE_ZLIB
+    zstream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    zstream.avail_in = static_cast<uInt>(length);
+    while (zstream.avail_in > 0) {
+        zstream.next_out = reinterpret_cast<Bytef*>(inflated.data());
+        zstream.avail_out = static_cast<uInt>(inflated.size());
+        int result = inflate(&zstream, Z_NO_FLUSH);
+        if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+            throw std::runtime_error("Failed to decompress archive");
+        }
+        parse(inflated.data(), inflated.size() - zstream.avail_out);
+        if (result == Z_STREAM_END) {
+            break;
+        }
+    }
+#endif
+}
+
+/*
+ * parse function
+ * Runs the archive state machine over a block of uncompressed bytes.
+ * Returns void.
+ */
+void TarReader::parse(const char* data, size_t length) {
+    while (length > 0 && !ended) {
+        if (remaining > 0) {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(remaining, length));
+            if (entryFd >= 0) {
+                size_t written = 0;
+                while (written < n) {
+                    ssize_t w = write(entryFd, data + written, n - written);
+                    if (w < 0) {
+                        throw std::runtime_error("Failed to write file: " + entryPath);
+                    }
+                    written += w;
+                }
+            } else if (entryType != 'S') {
+                entryData.insert(entryData.end(), data, data + n);
+            }
+            data += n;
+            length -= n;
+            remaining -= n;
+            if (remaining == 0) {
+                endEntry();
+            }
+        } else if (padding > 0) {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(padding, length));
+            data += n;
+            length -= n;
+            padding -= n;
+        } else {
+            size_t n = std::min(TAR_BLOCK - headerUsed, length);
+            std::memcpy(header + headerUsed, data, n);
+            headerUsed += n;
+            data += n;
+            length -= n;
+            if (headerUsed == TAR_BLOCK) {
+                headerUsed = 0;
+                beginEntry();
+            }
+        }
+    }
+}
+
+/*
+ * beginEntry function
+ * Interprets a complete header block and prepares for the entry's contents.
+ * Throws a runtime_error on a corrupt header or a path escaping the destination.
+ * Returns void.
+ */
+void TarReader::beginEntry() {
+    bool empty = std::all_of(header, header + TAR_BLOCK, [](char c) { return c == '\0'; });
+    if (empty) {
+        ended = true;
+        return;
+    }
+
+    if (readNumber(header + 148, 8) != headerChecksum(header)) {
+        throw std::runtime_error("Corrupt archive header");
+    }
+
+    uint64_t size = readNumber(header + 124, 12);
+    entryType = header[156];
+    entryMode = static_cast<unsigned>(readNumber(header + 100, 8)) & 0777;
+    remaining = size;
+    padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+    entryData.clear();
+
+    if (!longName.empty()) {
+        entryPath = longName;
+        longName.clear();
+    } else {
+        entryPath.assign(header, strnlen(header, 100));
+        if (std::memcmp(header + 257, "ustar", 6) == 0 && header[345] != '\0') {
+            entryPath = std::string(header + 345, strnlen(header + 345, 155)) + "/" + entryPath;
+        }
+    }
+
+    if (entryType == 'L') {
+        // The next entry's name follows as the contents of this one
+        entryData.reserve(static_cast<size_t>(size));
+    } else if (entryType == '5' || entryType == '0' || entryType == '\0' || entryType == '7') {
+        // Normalize the path and refuse anything that leaves the destination
+        std::filesystem::path relative = std::filesystem::path(entryPath).lexically_normal();
+        if (relative.is_absolute() || relative.empty() || *relative.begin() == "..") {
+            throw std::runtime_error("Unsafe path in archive: " + entryPath);
+        }
+        entryPath = relative.generic_string();
+        if (!entryPath.empty() && entryPath.back() == '/') {
+            entryPath.pop_back();
+        }
+
+        if (entryType == '5') {
+            std::filesystem::create_directories(destination + "/" + entryPath);
+            createdDirs.insert(entryPath);
+            entryType = 'S';
+        } else {
+            ensureParent(entryPath);
+            ++files;
+            bytes += size;
+            if (size > SMALL_FILE_LIMIT) {
+                std::string fullPath = destination + "/" + entryPath;
+                entryFd = open(fullPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, entryMode ? entryMode : 0644);
+                if (entryFd < 0) {
+                    throw std::runtime_error("Failed to create file: " + fullPath);
+                }
+            } else {
+                entryData.reserve(static_cast<size_t>(size));
+            }
+            entryType = '0';
+        }
+    } else {
+        // Links, pax headers and devices are skipped
+        entryType = 'S';
+    }
+
+    if (remaining == 0) {
+        endEntry();
+    }
+}
+
+/*
+ * endEntry function
+ * Completes an entry once all of its contents arrived.
+ * Buffered files are queued for the workers, waiting while the queue is full.
+ * Throws a runtime_error if a worker failed.
+ * Returns void.
+ */
+void TarReader::endEntry() {
+    if (entryType == 'L') {
+        longName.assign(entryData.data(), strnlen(entryData.data(), entryData.size()));
+        return;
+    }
+    if (entryType != '0') {
+        return;
+    }
+
+    if (entryFd >= 0) {
+        close(entryFd);
+        entryFd = -1;
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    spaceAvailable.wait(lock, [this] { return queuedBytes < MAX_QUEUED_BYTES || !error.empty(); });
+    if (!error.empty()) {
+        throw std::runtime_error(error);
+    }
+    queuedBytes += entryData.size();
+    queue.push_back(Job{destination + "/" + entryPath, std::move(entryData), entryMode ? entryMode : 0644});
+    entryData = std::vector<char>();
+    workAvailable.notify_one();
+}
+
+/*
+ * ensureParent function
+ * Creates the parent directory of an entry unless it was already created.
+ * Returns void.
+ */
+void TarReader::ensureParent(const std::string& path) {
+    std::string parent = std::filesystem::path(path).parent_path().generic_string();
+    if (parent.empty() || createdDirs.count(parent) > 0) {
+        return;
+    }
+    std::filesystem::create_directories(destination + "/" + parent);
+    createdDirs.insert(parent);
+}
+
+/*
+ * workerLoop function
+ * Body of the worker threads, writes queued files until the reader closes.
+ * The first failure is recorded and reported by finish().
+ * Returns void.
+ */
+void TarReader::workerLoop() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            workAvailable.wait(lock, [this] { return !queue.empty() || closing; });
+            if (queue.empty()) {
+                return;
+            }
+            job = std::move(queue.front());
+            queue.pop_front();
+            queuedBytes -= job.data.size();
+        }
+        spaceAvailable.notify_one();
+
+        int fd = open(job.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, job.mode);
+        bool ok = fd >= 0;
+        size_t written = 0;
+        while (ok && written < job.data.size()) {
+            ssize_t w = write(fd, job.data.data() + written, job.data.size() - written);
+            ok = w >= 0;
+            written += ok ? w : 0;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        if (!ok) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (error.empty()) {
+                error = "Failed to write file: " + job.path;
+            }
+            spaceAvailable.notify_all();
+        }
+    }
+}
+
+/*
+ * stopWorkers function
+ * Lets the workers drain the queue and waits for them to exit.
+ * Returns void.
+ */
+void TarReader::stopWorkers() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+    }
+    workAvailable.notify_all();
+    for (std::thread& worker : workers) {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+    workers.clear();
+}
+
+/*
+ * finish function
+ * Waits for all files to be written once the archive has been received.
+ * Throws a runtime_error if the archive was truncated or a file could not be written.
+ * Returns void.
+ */
+void TarReader::finish() {
+    stopWorkers();
+    if (remaining > 0 || headerUsed > 0) {
+        throw std::runtime_error("Archive ended in the middle of an entry");
+    }
+    if (!error.empty()) {
+        throw std::runtime_error(error);
+    }
+}
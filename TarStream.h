@@ -0,0 +1,119 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/*
+ * TarWriter class
+ * Generates a ustar archive on the fly and hands it to a sink in large blocks,
+ * optionally gzip-compressed, so a directory can be streamed over a single
+ * data connection without building the archive in a temporary file.
+ */
+class TarWriter {
+public:
+    using Sink = std::function<void(const char*, size_t)>;
+
+    TarWriter(Sink sink, bool compress);
+    ~TarWriter();
+
+    void addDirectory(const std::string& name);
+    void addFile(const std::string& fullPath, const std::string& name);
+    void finish();
+
+    uint64_t fileCount() const { return files; }
+    uint64_t byteCount() const { return bytes; }
+
+private:
+    Sink sink;
+    bool compress;
+    std::vector<char> buffer;
+    size_t used = 0;
+    uint64_t files = 0;
+    uint64_t bytes = 0;
+#ifdef HAVE_ZLIB
+    z_stream zstream = {};
+    std::vector<char> compressed;
+#endif
+
+    void writeHeader(const std::string& name, uint64_t size, unsigned mode, int64_t mtime, char type);
+    void put(const char* data, size_t length);
+    void pad(uint64_t size);
+    void flush(bool last);
+};
+
+/*
+ * TarReader class
+ * Unpacks a ustar archive as it is received, optionally gzip-compressed.
+ * Small files are collected in memory and written by a pool of worker threads,
+ * large files are written straight through as their data arrives.
+ * Entries that would escape the destination directory are rejected.
+ */
+class TarReader {
+public:
+    TarReader(const std::string& destination, bool compressed, unsigned workers);
+    ~TarReader();
+
+    void feed(const char* data, size_t length);
+    void finish();
+
+    uint64_t fileCount() const { return files; }
+    uint64_t byteCount() const { return bytes; }
+
+private:
+    struct Job {
+        std::string path;
+        std::vector<char> data;
+        unsigned mode;
+    };
+
+    std::string destination;
+    bool compressed;
+    uint64_t files = 0;
+    uint64_t bytes = 0;
+#ifdef HAVE_ZLIB
+    z_stream zstream = {};
+    std::vector<char> inflated;
+#endif
+
+    // Parser state
+    char header[512];
+    size_t headerUsed = 0;
+    uint64_t remaining = 0;
+    uint64_t padding = 0;
+    bool ended = false;
+    char entryType = 0;
+    unsigned entryMode = 0644;
+    std::string entryPath;
+    std::string longName;
+    std::vector<char> entryData;
+    int entryFd = -1;
+    std::unordered_set<std::string> createdDirs;
+
+    // Worker pool
+    std::vector<std::thread> workers;
+    std::deque<Job> queue;
+    size_t queuedBytes = 0;
+    bool closing = false;
+    std::string error;
+    std::mutex mutex;
+    std::condition_variable workAvailable;
+    std::condition_variable spaceAvailable;
+
+    void parse(const char* data, size_t length);
+    void beginEntry();
+    void endEntry();
+    void ensureParent(const std::string& path);
+    void workerLoop();
+    void stopWorkers();
+};
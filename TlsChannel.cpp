@@ -0,0 +1,422 @@
+#include "TlsChannel.h"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+
+std::atomic<bool> TlsChannel::resumptionEnabled(true);
+std::atomic<uint64_t> TlsChannel::controlHandshakes(0);
+std::atomic<uint64_t> TlsChannel::controlResumed(0);
+std::atomic<uint64_t> TlsChannel::dataHandshakes(0);
+std::atomic<uint64_t> TlsChannel::dataResumed(0);
+
+/*
+ * stats function
+ * Returns how many handshakes ran so far and how many of them resumed a session.
+ */
+TlsChannel::Stats TlsChannel::stats() {
+    Stats current;
+    current.controlHandshakes = controlHandshakes;
+    current.controlResumed = controlResumed;
+    current.dataHandshakes = dataHandshakes;
+    current.dataResumed = dataResumed;
+    return current;
+}
+
+/*
+ * printStats function
+ * Prints how many control and data channel handshakes ran and the share that resumed a session.
+ * Returns void.
+ */
+void TlsChannel::printStats(std::ostream& out) {
+    Stats current = stats();
+    auto rate = [](uint64_t resumed, uint64_t handshakes) {
+        return handshakes ? 100.0 * static_cast<double>(resumed) / static_cast<double>(handshakes) : 0.0;
+    };
+    out << "[tls] resumption=" << (resumptionEnabled ? "on" : "off")
+        << " control_handshakes=" << current.controlHandshakes << " control_resumed=" << current.controlResumed
+        << " (" << rate(current.controlResumed, current.controlHandshakes) << "%)"
+        << " data_handshakes=" << current.dataHandshakes << " data_resumed=" << current.dataResumed
+        << " (" << rate(current.dataResumed, current.dataHandshakes) << "%)" << std::endl;
+}
+
+/*
+ * setResumption function
+ * Selects whether handshakes resume cached sessions, e.g. to measure what resumption saves.
+ * Servers that insist on data channels resuming the control session refuse transfers while it is off.
+ * Takes a boolean parameter enabled.
+ * Returns void.
+ */
+void TlsChannel::setResumption(bool enabled) {
+    resumptionEnabled = enabled;
+}
+
+#ifdef HAVE_OPENSSL
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+/*
+ * lastError function
+ * Returns the most recent OpenSSL error as text and clears the error queue.
+ */
+static std::string lastError() {
+    unsigned long code = ERR_get_error();
+    ERR_clear_error();
+    if (code == 0) {
+        return "unknown error";
+    }
+    char text[256];
+    ERR_error_string_n(code, text, sizeof(text));
+    return text;
+}
+
+// Sessions received from each server, by "host:port", newest last; the cache owns them
+static std::unordered_map<std::string, std::deque<SSL_SESSION*>> sessionCache;
+static std::mutex sessionCacheMutex;
+// Sessions kept per server; a TLS 1.3 server hands out two or more per handshake
+const size_t CACHED_SESSIONS = 8;
+
+/*
+ * storeSession function
+ * Called by OpenSSL for every session a server hands out, after a full handshake and
+ * for every TLS 1.3 ticket. Keeps the newest CACHED_SESSIONS per server for later connections.
+ * Returns 1 when the cache took ownership of the session, 0 otherwise.
+ */
+int TlsChannel::storeSession(SSL* ssl, SSL_SESSION* session) {
+    auto* channel = static_cast<TlsChannel*>(SSL_get_app_data(ssl));
+    if (!channel || !SSL_SESSION_is_resumable(session)) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(sessionCacheMutex);
+    std::deque<SSL_SESSION*>& cached = sessionCache[channel->cacheKey];
+    cached.push_back(session);
+    if (cached.size() > CACHED_SESSIONS) {
+        SSL_SESSION_free(cached.front());
+        cached.pop_front();
+    }
+    return 1;
+}
+
+/*
+ * takeSession function
+ * Returns the newest cached session of a server, or null if there is none.
+ * TLS 1.3 tickets are meant to be used once and servers may refuse a second use,
+ * so they leave the cache; TLS 1.2 sessions stay for every later connection.
+ * The caller owns the returned reference.
+ */
+static SSL_SESSION* takeSession(const std::string& cacheKey) {
+    std::lock_guard<std::mutex> lock(sessionCacheMutex);
+    auto found = sessionCache.find(cacheKey);
+    if (found == sessionCache.end() || found->second.empty()) {
+        return nullptr;
+    }
+    SSL_SESSION* session = found->second.back();
+    if (SSL_SESSION_get_protocol_version(session) == TLS1_3_VERSION) {
+        found->second.pop_back();
+    } else {
+        SSL_SESSION_up_ref(session);
+    }
+    return session;
+}
+
+/*
+ * context function
+ * Returns the TLS client context shared by every channel, created on first use.
+ * Servers are verified against the system's trusted certificates, plus the file
+ * named by FTP_TLS_CA_FILE, e.g. for a server with a private CA.
+ * Returns null if the context cannot be created.
+ */
+SSL_CTX* TlsChannel::context() {
+    static SSL_CTX* shared = [] {
+        SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+        if (!ctx) {
+            return ctx;
+        }
+        SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+        SSL_CTX_set_default_verify_paths(ctx);
+        const char* caFile = std::getenv("FTP_TLS_CA_FILE");
+        if (caFile && *caFile) {
+            SSL_CTX_load_verify_locations(ctx, caFile, nullptr);
+        }
+        // Servers often close data connections without close_notify; the end of a
+        // transfer is confirmed by the 226 on the control channel instead
+        SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+        // Sessions are collected by storeSession, OpenSSL's own cache is for servers
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx, storeSession);
+        return ctx;
+    }();
+    return shared;
+}
+
+/*
+ * Constructor for the TlsChannel class.
+ * Runs the TLS handshake on a connected socket and verifies the server's certificate.
+ * Takes parameters:
+ * - socket: the connected socket, it stays owned by the caller
+ * - host: the name or IP address the certificate must be issued for
+ * - port: the port of the server, sessions are cached per host and port
+ * - session: a channel whose session is resumed, e.g. the control channel for a data channel;
+ *   if null, the last cached session of the server is resumed
+ * - kernelOffload: hand the keys to kernel TLS after the handshake when the kernel supports it
+ * Throws a runtime_error if the handshake or the verification fails.
+ */
+TlsChannel::TlsChannel(int socket, const std::string& host, int port, const TlsChannel* session, bool kernelOffload)
+    : cacheKey(host + ":" + std::to_string(port)) {
+    SSL_CTX* ctx = context();
+    if (!ctx || !(ssl = SSL_new(ctx))) {
+        throw std::runtime_error("Failed to set up TLS: " + lastError());
+    }
+    if (kernelOffload) {
+        SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+    }
+    SSL_set_fd(ssl, socket);
+
+    // Certificates name a host either by DNS name or by IP address
+    in_addr address;
+    if (inet_pton(AF_INET, host.c_str(), &address) == 1) {
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host.c_str());
+    } else {
+        SSL_set_tlsext_host_name(ssl, host.c_str());
+        SSL_set1_host(ssl, host.c_str());
+    }
+
+    SSL_set_app_data(ssl, this);
+    if (resumptionEnabled) {
+        // Over TLS 1.2 servers check that a data channel continues the very session of the
+        // control channel; TLS 1.3 sessions are tickets, any fresh one from the server will do
+        SSL_SESSION* resumed = nullptr;
+        if (session && SSL_version(session->ssl) != TLS1_3_VERSION) {
+            resumed = SSL_get1_session(session->ssl);
+        } else {
+            resumed = takeSession(cacheKey);
+        }
+        if (!resumed && session) {
+            resumed = SSL_get1_session(session->ssl);
+        }
+        if (resumed) {
+            SSL_set_session(ssl, resumed);
+            SSL_SESSION_free(resumed);
+        }
+    }
+
+    ERR_clear_error();
+    int returned = SSL_connect(ssl);
+    if (returned != 1) {
+        std::string reason;
+        int error = SSL_get_error(ssl, returned);
+        long verified = SSL_get_verify_result(ssl);
+        if (verified != X509_V_OK) {
+            reason = std::string("certificate rejected: ") + X509_verify_cert_error_string(verified);
+        } else if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+            reason = "timed out";
+        } else if (error == SSL_ERROR_SYSCALL && ERR_peek_error() == 0) {
+            reason = errno ? std::strerror(errno) : "connection closed";
+        } else {
+            reason = lastError();
+        }
+        ERR_clear_error();
+        SSL_free(ssl);
+        throw std::runtime_error("TLS handshake failed: " + reason);
+    }
+
+    bool reused = SSL_session_reused(ssl) == 1;
+    if (session) {
+        ++dataHandshakes;
+        dataResumed += reused;
+    } else {
+        ++controlHandshakes;
+        controlResumed += reused;
+    }
+}
+
+/*
+ * Destructor for the TlsChannel class.
+ * Frees the TLS state; the socket is closed by its owner.
+ */
+TlsChannel::~TlsChannel() {
+    SSL_free(ssl);
+}
+
+/*
+ * result function
+ * Turns the return value of an SSL call into that of the matching socket call.
+ * A blocking socket only wants more data when its SO_RCVTIMEO/SO_SNDTIMEO expired,
+ * which is reported as EAGAIN like a stalled recv or send.
+ * Returns the byte count, 0 at the end of the stream, or -1 with errno set.
+ */
+ssize_t TlsChannel::result(int returned) {
+    if (returned > 0) {
+        return returned;
+    }
+    int savedErrno = errno;
+    switch (SSL_get_error(ssl, returned)) {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            break;
+        case SSL_ERROR_SYSCALL:
+            errno = savedErrno ? savedErrno : ECONNRESET;
+            break;
+        default:
+            errno = EPROTO;
+            break;
+    }
+    ERR_clear_error();
+    return -1;
+}
+
+/*
+ * send function
+ * Sends data as TLS records, written straight to the socket when the kernel encrypts.
+ * Returns the number of bytes sent, or -1 with errno set.
+ */
+ssize_t TlsChannel::send(const char* data, size_t length) {
+    ERR_clear_error();
+    size_t written = 0;
+    int returned = SSL_write_ex(ssl, data, length, &written);
+    return returned == 1 ? static_cast<ssize_t>(written) : result(returned);
+}
+
+/*
+ * recv function
+ * Receives decrypted data.
+ * Returns the number of bytes received, 0 once the server closed the channel, or -1 with errno set.
+ */
+ssize_t TlsChannel::recv(char* data, size_t length) {
+    ERR_clear_error();
+    size_t received = 0;
+    int returned = SSL_read_ex(ssl, data, length, &received);
+    return returned == 1 ? static_cast<ssize_t>(received) : result(returned);
+}
+
+/*
+ * sendFile function
+ * Sends a byte range of a file with sendfile, encrypted by the kernel.
+ * Only valid while kernelSend() is true.
+ * Returns the number of bytes sent, or -1 with errno set.
+ */
+ssize_t TlsChannel::sendFile(int fileFd, uint64_t offset, size_t length) {
+    ERR_clear_error();
+    ossl_ssize_t sent = SSL_sendfile(ssl, fileFd, static_cast<off_t>(offset), length, 0);
+    return sent >= 0 ? static_cast<ssize_t>(sent) : result(-1);
+}
+
+/*
+ * pending function
+ * Returns the number of decrypted bytes buffered in user space, which poll on the socket cannot see.
+ */
+size_t TlsChannel::pending() const {
+    return static_cast<size_t>(SSL_pending(ssl));
+}
+
+/*
+ * kernelSend function
+ * Returns true if the kernel encrypts what is sent on this channel.
+ */
+bool TlsChannel::kernelSend() const {
+    return BIO_get_ktls_send(SSL_get_wbio(ssl));
+}
+
+/*
+ * kernelReceive function
+ * Returns true if the kernel decrypts what is received on this channel.
+ */
+bool TlsChannel::kernelReceive() const {
+    return BIO_get_ktls_recv(SSL_get_rbio(ssl));
+}
+
+/*
+ * description function
+ * Returns the protocol, cipher and resumption state of the channel, e.g. for verbose output.
+ */
+std::string TlsChannel::description() const {
+    return std::string(SSL_get_version(ssl)) + " " + SSL_get_cipher_name(ssl) +
+           (SSL_session_reused(ssl) ? ", resumed" : "") +
+           ", kernel send " + (kernelSend() ? "on" : "off") + ", kernel receive " + (kernelReceive() ? "on" : "off");
+}
+
+/*
+ * shutdown function
+ * Sends close_notify so the server can tell a complete upload from a truncated one.
+ * Does not wait for the server's close_notify.
+ * Returns void.
+ */
+void TlsChannel::shutdown() {
+    ERR_clear_error();
+    SSL_shutdown(ssl);
+    ERR_clear_error();
+}
+
+/*
+ * available function
+ * Returns true if the client was built with TLS support.
+ */
+bool TlsChannel::available() {
+    return true;
+}
+
+#else
+
+TlsChannel::TlsChannel(int, const std::string&, int, const TlsChannel*, bool) {
+    throw std::runtime_error("TLS is not available, the client was built without OpenSSL");
+}
+
+TlsChannel::~TlsChannel() = default;
+
+ssize_t TlsChannel::result(int) {
+    errno = EPROTO;
+    return -1;
+}
+
+ssize_t TlsChannel::send(const char*, size_t) {
+    return result(0);
+}
+
+ssize_t TlsChannel::recv(char*, size_t) {
+    return result(0);
+}
+
+ssize_t TlsChannel::sendFile(int, uint64_t, size_t) {
+    return result(0);
+}
+
+size_t TlsChannel::pending() const {
+    return 0;
+}
+
+ssl_ctx_st* TlsChannel::context() {
+    return nullptr;
+}
+
+int TlsChannel::storeSession(ssl_st*, ssl_session_st*) {
+    return 0;
+}
+
+bool TlsChannel::kernelSend() const {
+    return false;
+}
+
+bool TlsChannel::kernelReceive() const {
+    return false;
+}
+
+std::string TlsChannel::description() const {
+    return "";
+}
+
+void TlsChannel::shutdown() {}
+
+bool TlsChannel::available() {
+    return false;
+}
+
+#endif
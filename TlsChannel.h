@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <sys/types.h>
+
+struct ssl_st;
+struct ssl_ctx_st;
+struct ssl_session_st;
+
+/*
+ * TlsChannel class
+ * Runs TLS over a connected socket for explicit FTPS (AUTH TLS, PROT P).
+ * Every handshake resumes a session the same server handed out before, so only the
+ * first connection to a server pays for a full handshake. Sessions are kept per server
+ * in a cache shared by every connection of the process, so data channels and the extra
+ * sessions of segmented downloads and the transfer scheduler all resume. Over TLS 1.2
+ * a data channel resumes the session of its control channel, which servers use to
+ * check that both belong to the same client.
+ * When the kernel supports it the negotiated keys are handed to kernel TLS, so records
+ * are encrypted and decrypted in the kernel and files can be sent with sendfile;
+ * otherwise OpenSSL does it in user space.
+ * Errors of send and recv are reported like those of the socket calls, through errno,
+ * so the callers handle stalls and resets the same way with and without TLS.
+ * Without OpenSSL at build time the constructor throws.
+ */
+class TlsChannel {
+public:
+    // Handshakes since start, and how many of them resumed a session
+    struct Stats {
+        uint64_t controlHandshakes = 0;
+        uint64_t controlResumed = 0;
+        uint64_t dataHandshakes = 0;
+        uint64_t dataResumed = 0;
+    };
+
+    TlsChannel(int socket, const std::string& host, int port, const TlsChannel* session, bool kernelOffload);
+    ~TlsChannel();
+
+    TlsChannel(const TlsChannel&) = delete;
+    TlsChannel& operator=(const TlsChannel&) = delete;
+
+    ssize_t send(const char* data, size_t length);
+    ssize_t recv(char* data, size_t length);
+    ssize_t sendFile(int fileFd, uint64_t offset, size_t length);
+    size_t pending() const;
+    bool kernelSend() const;
+    bool kernelReceive() const;
+    std::string description() const;
+    void shutdown();
+
+    static bool available();
+    static Stats stats();
+    static void printStats(std::ostream& out);
+    static void setResumption(bool enabled);
+
+private:
+    ssl_st* ssl = nullptr;
+    std::string cacheKey;
+
+    static std::atomic<bool> resumptionEnabled;
+    static std::atomic<uint64_t> controlHandshakes;
+    static std::atomic<uint64_t> controlResumed;
+    static std::atomic<uint64_t> dataHandshakes;
+    static std::atomic<uint64_t> dataResumed;
+
+    ssize_t result(int returned);
+    static ssl_ctx_st* context();
+    static int storeSession(ssl_st* ssl, ssl_session_st* session);
+};
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * TransferProgress class
+ * Progress counters of a single transfer.
+ * The byte counter is updated with a relaxed add once per buffer, so segmented transfers
+ * can share it, and sits on its own cache line so the renderer reading it never slows the copy loop.
+ */
+class TransferProgress {
+public:
+    TransferProgress(const std::string& name, uint64_t total)
+        : totalBytes(total), name(name), start(std::chrono::steady_clock::now()) {}
+
+    void add(uint64_t n) { bytes.fetch_add(n, std::memory_order_relaxed); }
+    void setTotal(uint64_t total) { totalBytes.store(total, std::memory_order_relaxed); }
+
+    uint64_t done() const { return bytes.load(std::memory_order_relaxed); }
+    uint64_t total() const { return totalBytes.load(std::memory_order_relaxed); }
+    const std::string& label() const { return name; }
+    std::chrono::steady_clock::time_point started() const { return start; }
+
+private:
+    alignas(64) std::atomic<uint64_t> bytes{0};
+    alignas(64) std::atomic<uint64_t> totalBytes;
+    std::string name;
+    std::chrono::steady_clock::time_point start;
+};
+
+/*
+ * ProgressMonitor class
+ * Registry of the running transfers and the low-frequency thread that renders them.
+ * Renders either a status line on stderr or one JSON object per transfer and tick
+ * to a file, so no output ever happens inside the copy loops.
+ */
+class ProgressMonitor {
+public:
+    enum class Mode { Off, Human, Json };
+
+    static ProgressMonitor& instance();
+    ~ProgressMonitor();
+
+    std::shared_ptr<TransferProgress> track(const std::string& name, uint64_t total);
+    void untrack(const std::shared_ptr<TransferProgress>& progress);
+    void setMode(Mode mode, const std::string& jsonPath = "");
+
+private:
+    struct Sample {
+        uint64_t bytes = 0;
+        std::chrono::steady_clock::time_point time;
+        double rate = 0;
+    };
+    struct Finished {
+        std::shared_ptr<TransferProgress> progress;
+        std::chrono::steady_clock::time_point end;
+    };
+
+    ProgressMonitor() = default;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<std::shared_ptr<TransferProgress>> active;
+    std::unordered_map<const TransferProgress*, Sample> samples;
+    std::vector<Finished> finished;
+    Mode mode = Mode::Off;
+    std::ofstream jsonStream;
+    bool lineDrawn = false;
+    bool stopping = false;
+    std::thread renderer;
+
+    void renderLoop();
+    void render();
+    void writeFinished();
+    std::ostream& jsonOut();
+};
+
+/*
+ * ProgressScope class
+ * Registers a transfer with the monitor for the lifetime of the scope
+ * and publishes it through the given slot.
+ */
+class ProgressScope {
+public:
+    ProgressScope(std::shared_ptr<TransferProgress>& slot, const std::string& name, uint64_t total);
+    ~ProgressScope();
+
+    ProgressScope(const ProgressScope&) = delete;
+    ProgressScope& operator=(const ProgressScope&) = delete;
+
+private:
+    std::shared_ptr<TransferProgress>& slot;
+};
@@ -0,0 +1,322 @@
+#include "TransferScheduler.h"
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+// Longest a paced transfer waits for the others before moving its next buffer anyway,
+// so a transfer stalled by the server cannot hold everything else back
+const std::chrono::milliseconds PACING_WAIT(20);
+
+/*
+ * Constructor for the TransferScheduler class.
+ * Takes parameters:
+ * - factory: opens a new logged-in session for each worker
+ * - sessions: the number of transfers run at the same time
+ */
+TransferScheduler::TransferScheduler(FTPClient::SessionFactory factory, unsigned sessions)
+    : factory(std::move(factory)), sessions(std::max(1u, sessions)) {}
+
+/*
+ * Destructor for the TransferScheduler class.
+ * Lets the workers finish every queued transfer, then joins them.
+ */
+TransferScheduler::~TransferScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+/*
+ * parsePriority function
+ * Maps "urgent", "normal" or "bulk" to a priority class.
+ * Returns true if the name is known, false otherwise.
+ */
+bool TransferScheduler::parsePriority(const std::string& name, Priority& priority) {
+    if (name == "urgent") {
+        priority = Priority::Urgent;
+    } else if (name == "normal") {
+        priority = Priority::Normal;
+    } else if (name == "bulk") {
+        priority = Priority::Bulk;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * priorityName function
+ * Returns the name of a priority class.
+ */
+const char* TransferScheduler::priorityName(Priority priority) {
+    switch (priority) {
+        case Priority::Urgent:
+            return "urgent";
+        case Priority::Normal:
+            return "normal";
+        default:
+            return "bulk";
+    }
+}
+
+/*
+ * weight function
+ * Returns the bandwidth share of a priority class relative to bulk transfers.
+ */
+double TransferScheduler::weight(Priority priority) {
+    switch (priority) {
+        case Priority::Urgent:
+            return 8;
+        case Priority::Normal:
+            return 3;
+        default:
+            return 1;
+    }
+}
+
+/*
+ * submit function
+ * Queues a transfer and returns right away.
+ * Takes parameters:
+ * - upload: true to upload localPath to remotePath, false to download remotePath to localPath
+ * - localPath: the local file
+ * - remotePath: the file on the server
+ * - priority: the priority class of the transfer
+ * - deadlineSeconds: seconds from now the transfer should be done by, 0 for no deadline
+ * Returns the id of the transfer.
+ */
+uint64_t TransferScheduler::submit(bool upload, const std::string& localPath, const std::string& remotePath,
+                                   Priority priority, double deadlineSeconds) {
+    Job job;
+    job.upload = upload;
+    job.localPath = localPath;
+    job.remotePath = remotePath;
+    job.priority = priority;
+    job.submitted = Clock::now();
+    if (deadlineSeconds > 0) {
+        job.hasDeadline = true;
+        job.deadline = job.submitted + std::chrono::duration_cast<Clock::duration>(
+                                           std::chrono::duration<double>(deadlineSeconds));
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    job.id = nextId++;
+    ++metrics[static_cast<unsigned>(priority)].submitted;
+    queue.push_back(std::move(job));
+
+    // Sessions are opened on demand, up to the configured number
+    if (workers.size() < sessions && workers.size() < queue.size() + running) {
+        workers.emplace_back(&TransferScheduler::workerLoop, this);
+    }
+    changed.notify_one();
+    return nextId - 1;
+}
+
+/*
+ * wait function
+ * Blocks until every submitted transfer has finished.
+ * Returns void.
+ */
+void TransferScheduler::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this] { return queue.empty() && running == 0; });
+}
+
+/*
+ * pickNext function
+ * Chooses the queued transfer to run next. Must be called with the mutex held.
+ * Transfers are ordered by effective priority class, then by deadline, then by submission.
+ * Returns the index of the transfer in the queue.
+ */
+size_t TransferScheduler::pickNext(Clock::time_point now) const {
+    auto key = [now](const Job& job) {
+        unsigned priority = static_cast<unsigned>(job.priority);
+        if (job.hasDeadline && job.deadline - now <= DEADLINE_PROMOTION) {
+            priority = static_cast<unsigned>(Priority::Urgent);
+        }
+        Clock::time_point deadline = job.hasDeadline ? job.deadline : Clock::time_point::max();
+        return std::make_tuple(priority, deadline, job.id);
+    };
+
+    size_t best = 0;
+    for (size_t i = 1; i < queue.size(); ++i) {
+        if (key(queue[i]) < key(queue[best])) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+/*
+ * workerLoop function
+ * Body of a worker thread: runs queued transfers on its own session until the scheduler stops.
+ * A session that fails is dropped and a new one is opened for the next transfer.
+ * Returns void.
+ */
+void TransferScheduler::workerLoop() {
+    std::unique_ptr<FTPClient> session;
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] { return !queue.empty() || stopping; });
+            if (queue.empty()) {
+                break;
+            }
+            size_t index = pickNext(Clock::now());
+            job = std::move(queue[index]);
+            queue.erase(queue.begin() + static_cast<std::ptrdiff_t>(index));
+            ++running;
+        }
+
+        Clock::time_point started = Clock::now();
+        bool ok = false;
+        try {
+            if (!session) {
+                session = factory();
+            }
+            ok = execute(*session, job);
+        } catch (const std::exception& ex) {
+            std::cerr << "Transfer " << job.id << " failed: " << ex.what() << std::endl;
+            session.reset();
+        }
+        Clock::time_point finished = Clock::now();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        ClassMetrics& classMetrics = metrics[static_cast<unsigned>(job.priority)];
+        double queueDelay = std::chrono::duration<double>(started - job.submitted).count();
+        classMetrics.totalQueueDelay += queueDelay;
+        classMetrics.maxQueueDelay = std::max(classMetrics.maxQueueDelay, queueDelay);
+        if (ok) {
+            ++classMetrics.completed;
+        } else {
+            ++classMetrics.failed;
+        }
+        if (job.hasDeadline && finished > job.deadline) {
+            ++classMetrics.deadlineMisses;
+            std::cerr << "Transfer " << job.id << " missed its deadline: " << job.remotePath << std::endl;
+        }
+        --running;
+        changed.notify_all();
+    }
+
+    if (session) {
+        try {
+            session->logout();
+        } catch (const std::exception&) {
+            // The transfers are done, a failed QUIT does not matter
+        }
+    }
+}
+
+/*
+ * execute function
+ * Runs one transfer on a session, paced against the other running transfers.
+ * Throws a runtime_error if the transfer fails.
+ * Returns true on success.
+ */
+bool TransferScheduler::execute(FTPClient& session, const Job& job) {
+    joinShare(job.id, job.priority);
+    session.setPacer([this, id = job.id](uint64_t bytes) { pace(id, bytes); });
+    try {
+        if (job.upload) {
+            session.uploadFile(job.localPath, job.remotePath);
+        } else {
+            session.downloadFile(job.remotePath, job.localPath);
+        }
+    } catch (const std::exception&) {
+        session.setPacer(nullptr);
+        leaveShare(job.id);
+        throw;
+    }
+    session.setPacer(nullptr);
+    leaveShare(job.id);
+    return true;
+}
+
+/*
+ * joinShare function
+ * Adds a running transfer to the bandwidth shares.
+ * It starts level with the slowest running transfer so it neither waits for nor starves the others.
+ * Returns void.
+ */
+void TransferScheduler::joinShare(uint64_t id, Priority priority) {
+    std::lock_guard<std::mutex> lock(paceMutex);
+    double slowest = 0;
+    bool first = true;
+    for (const auto& entry : shares) {
+        if (first || entry.second.virtualBytes < slowest) {
+            slowest = entry.second.virtualBytes;
+            first = false;
+        }
+    }
+    shares[id] = Share{weight(priority), slowest};
+}
+
+/*
+ * leaveShare function
+ * Removes a finished transfer from the bandwidth shares and wakes the transfers it held back.
+ * Returns void.
+ */
+void TransferScheduler::leaveShare(uint64_t id) {
+    {
+        std::lock_guard<std::mutex> lock(paceMutex);
+        shares.erase(id);
+    }
+    paced.notify_all();
+}
+
+/*
+ * pace function
+ * Called by a transfer after every buffer it moved.
+ * Holds the transfer back while its weighted byte count is more than PACING_QUANTUM ahead
+ * of the slowest running transfer, so each one gets bandwidth in proportion to its weight.
+ * Takes parameters:
+ * - id: the transfer
+ * - bytes: the number of bytes just moved
+ * Returns void.
+ */
+void TransferScheduler::pace(uint64_t id, uint64_t bytes) {
+    std::unique_lock<std::mutex> lock(paceMutex);
+    auto found = shares.find(id);
+    if (found == shares.end()) {
+        return;
+    }
+    // Elements of an unordered_map keep their address when other elements are added
+    Share& share = found->second;
+    share.virtualBytes += static_cast<double>(bytes) / share.weight;
+    paced.notify_all();
+
+    paced.wait_for(lock, PACING_WAIT, [this, &share] {
+        double slowest = std::numeric_limits<double>::max();
+        for (const auto& entry : shares) {
+            slowest = std::min(slowest, entry.second.virtualBytes);
+        }
+        return share.virtualBytes <= slowest + PACING_QUANTUM;
+    });
+}
+
+/*
+ * printMetrics function
+ * Prints per priority class how many transfers ran, failed and missed their deadline,
+ * and how long they waited in the queue.
+ * Returns void.
+ */
+void TransferScheduler::printMetrics(std::ostream& out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    out << "[scheduler] queued=" << queue.size() << " running=" << running << std::endl;
+    for (unsigned i = 0; i < PRIORITY_COUNT; ++i) {
+        const ClassMetrics& classMetrics = metrics[i];
+        uint64_t started = classMetrics.completed + classMetrics.failed;
+        out << "[scheduler] " << priorityName(static_cast<Priority>(i)) << " submitted=" << classMetrics.submitted
+            << " completed=" << classMetrics.completed << " failed=" << classMetrics.failed
+            << " deadline_misses=" << classMetrics.deadlineMisses
+            << " queue_delay_avg=" << (started ? classMetrics.totalQueueDelay / started : 0) << "s"
+            << " queue_delay_max=" << classMetrics.maxQueueDelay << "s" << std::endl;
+    }
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "FTPClient.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * TransferScheduler class
+ * Runs submitted uploads and downloads in the background on a small pool of sessions.
+ * Transfers are picked by priority class, then by earliest deadline, then in submission
+ * order; a transfer close to its deadline is treated as urgent whatever its class.
+ * Running transfers share the bandwidth by weight: each one is paced so that its bytes
+ * divided by its weight never run far ahead of the others, which lets an urgent
+ * transfer take most of the link from bulk ones while they run side by side.
+ */
+class TransferScheduler {
+public:
+    enum class Priority { Urgent, Normal, Bulk };
+
+    static constexpr unsigned PRIORITY_COUNT = 3;
+    // Transfers this close to their deadline are picked as if they were urgent
+    static constexpr std::chrono::seconds DEADLINE_PROMOTION{5};
+    // How far, in weighted bytes, a transfer may run ahead of the slowest one
+    static constexpr uint64_t PACING_QUANTUM = 256 * 1024;
+
+    TransferScheduler(FTPClient::SessionFactory factory, unsigned sessions);
+    ~TransferScheduler();
+
+    TransferScheduler(const TransferScheduler&) = delete;
+    TransferScheduler& operator=(const TransferScheduler&) = delete;
+
+    uint64_t submit(bool upload, const std::string& localPath, const std::string& remotePath, Priority priority,
+                    double deadlineSeconds = 0);
+    void wait();
+    void printMetrics(std::ostream& out);
+
+    static bool parsePriority(const std::string& name, Priority& priority);
+    static const char* priorityName(Priority priority);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Job {
+        uint64_t id = 0;
+        bool upload = false;
+        std::string localPath;
+        std::string remotePath;
+        Priority priority = Priority::Normal;
+        bool hasDeadline = false;
+        Clock::time_point deadline;
+        Clock::time_point submitted;
+    };
+
+    struct ClassMetrics {
+        uint64_t submitted = 0;
+        uint64_t completed = 0;
+        uint64_t failed = 0;
+        uint64_t deadlineMisses = 0;
+        double totalQueueDelay = 0;
+        double maxQueueDelay = 0;
+    };
+
+    struct Share {
+        double weight = 1;
+        double virtualBytes = 0;
+    };
+
+    FTPClient::SessionFactory factory;
+    unsigned sessions;
+
+    std::vector<Job> queue;
+    uint64_t nextId = 1;
+    unsigned running = 0;
+    bool stopping = false;
+    ClassMetrics metrics[PRIORITY_COUNT];
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<std::thread> workers;
+
+    std::unordered_map<uint64_t, Share> shares;
+    std::mutex paceMutex;
+    std::condition_variable paced;
+
+    static double weight(Priority priority);
+    size_t pickNext(Clock::time_point now) const;
+    void workerLoop();
+    bool execute(FTPClient& session, const Job& job);
+    void pace(uint64_t id, uint64_t bytes);
+    void joinShare(uint64_t id, Priority priority);
+    void leaveShare(uint64_t id);
+};
@@ -4,32 +4,223 @@
 #include <vector>
 
 #include "ServerController.h"
+#include "TransferProgress.h"
+#include "BatchRunner.h"
+#include "Benchmark.h"
+#include <csignal>
+#include <cstdlib>
+#include <fstream>
 
-std::vector<std::string> getTokens(const std::string& str) {
-    std::vector<std::string> tokens;
-    size_t start = 0;
+/*
+ * setProgressMode function
+ * Handles the progress command: "progress off", "progress on" for a status line,
+ * or "progress json [file]" for machine-readable records on stdout or in a file.
+ */
+void setProgressMode(const std::vector<std::string>& tokens) {
+    try {
+        if (tokens[1] == "off") {
+            ProgressMonitor::instance().setMode(ProgressMonitor::Mode::Off);
+        } else if (tokens[1] == "on") {
+            ProgressMonitor::instance().setMode(ProgressMonitor::Mode::Human);
+        } else if (tokens[1] == "json") {
+            ProgressMonitor::instance().setMode(ProgressMonitor::Mode::Json, tokens.size() == 3 ? tokens[2] : "-");
+        } else {
+            std::cout << "Usage: progress off|on|json [file]" << std::endl;
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+    }
+}
+
+/*
+ * queueTransfer function
+ * Handles the queue command, which runs a transfer in the background:
+ *   queue stor <local> <remote> [urgent|normal|bulk] [deadline seconds]
+ *   queue retr <remote> <local> [urgent|normal|bulk] [deadline seconds]
+ */
+void queueTransfer(ServerController& client, const std::vector<std::string>& tokens) {
+    bool upload = tokens[1] == "stor";
+    const std::string& localPath = upload ? tokens[2] : tokens[3];
+    const std::string& remotePath = upload ? tokens[3] : tokens[2];
+    std::string priority = tokens.size() >= 5 ? tokens[4] : "normal";
+
+    double deadline = 0;
+    if (tokens.size() == 6) {
+        try {
+            deadline = std::stod(tokens[5]);
+        } catch (const std::exception&) {
+            std::cout << "Invalid deadline: " << tokens[5] << std::endl;
+            return;
+        }
+    }
+    client.submitTransfer(upload, localPath, remotePath, priority, deadline);
+}
+
+/*
+ * setTimeouts function
+ * Handles the timeouts command: "timeouts <connect> <idle> <stall>" in seconds.
+ * connect bounds establishing a connection, idle waiting for a server reply,
+ * stall a data transfer that stops making progress.
+ */
+void setTimeouts(ServerController& client, const std::vector<std::string>& tokens) {
+    FTPClient::Timeouts timeouts;
+    try {
+        timeouts.connectMs = static_cast<int>(std::stod(tokens[1]) * 1000);
+        timeouts.idleMs = static_cast<int>(std::stod(tokens[2]) * 1000);
+        timeouts.stallMs = static_cast<int>(std::stod(tokens[3]) * 1000);
+    } catch (const std::exception&) {
+        std::cout << "Usage: timeouts <connect> <idle> <stall> (seconds)" << std::endl;
+        return;
+    }
+    if (timeouts.connectMs <= 0 || timeouts.idleMs <= 0 || timeouts.stallMs <= 0) {
+        std::cout << "Timeouts must be positive" << std::endl;
+        return;
+    }
+    client.setTimeouts(timeouts);
+}
+
+/*
+ * setPipelineDepth function
+ * Handles the pipeline command: "pipeline <depth>" sets the number of 1 MiB buffers
+ * between the disk and network threads of uploads and downloads, "pipeline 0" turns it off.
+ */
+void setPipelineDepth(ServerController& client, const std::vector<std::string>& tokens) {
+    unsigned long depth = 0;
+    try {
+        depth = std::stoul(tokens[1]);
+    } catch (const std::exception&) {
+        std::cout << "Usage: pipeline <depth> (0 to turn off)" << std::endl;
+        return;
+    }
+    client.setPipelineDepth(static_cast<unsigned>(depth));
+}
 
-    while (start < str.length()) {
-        while (start < str.length() && std::isspace(str[start])) {
-            ++start; // Skip whitespace characters
+/*
+ * readRemote function
+ * Handles the pread command: "pread <remote> <offset> <length> <local>" saves that many
+ * bytes of the remote file, starting at offset, without downloading the rest of it.
+ */
+void readRemote(ServerController& client, const std::vector<std::string>& tokens) {
+    unsigned long long offset = 0, length = 0;
+    try {
+        offset = std::stoull(tokens[2]);
+        length = std::stoull(tokens[3]);
+    } catch (const std::exception&) {
+        std::cout << "Usage: pread <remote> <offset> <length> <local>" << std::endl;
+        return;
+    }
+    client.readRemote(tokens[1], offset, length, tokens[4]);
+}
+
+/*
+ * setDownloadCache function
+ * Handles the cache command: "cache <MiB>" serves unchanged files from a local cache
+ * keeping up to that many MiB of files, "cache off" downloads every file again.
+ */
+void setDownloadCache(ServerController& client, const std::vector<std::string>& tokens) {
+    unsigned long long budget = 0;
+    if (tokens[1] != "off") {
+        try {
+            budget = std::stoull(tokens[1]);
+        } catch (const std::exception&) {
+            std::cout << "Usage: cache <MiB> | cache off" << std::endl;
+            return;
         }
+    }
+    client.setDownloadCache(budget ? ServerController::openDownloadCache(budget * 1024 * 1024) : nullptr);
+}
 
-        size_t end = start;
-        while (end < str.length() && !std::isspace(str[end])) {
-            ++end; // Find the next space or end of the string
+/*
+ * setPrefetch function
+ * Handles the prefetch command: "prefetch <MiB>" stages the files of every listing in the
+ * background, up to that many MiB at a time, so fetching them afterwards completes locally;
+ * "prefetch off" turns it off.
+ */
+void setPrefetch(ServerController& client, const std::vector<std::string>& tokens) {
+    unsigned long long budget = 0;
+    if (tokens[1] != "off") {
+        try {
+            budget = std::stoull(tokens[1]);
+        } catch (const std::exception&) {
+            std::cout << "Usage: prefetch <MiB> | prefetch off" << std::endl;
+            return;
         }
+    }
+    client.setPrefetch(budget * 1024 * 1024);
+}
 
-        if (start < end) {
-            tokens.push_back(str.substr(start, end - start));
+/*
+ * runBatch function
+ * Runs the client non-interactively:
+ *   ftp --batch <server> <port> <username> <password> [script] [--jobs N] [--cache MiB] [--prefetch MiB]
+ * The script holds one command per line and is read from stdin when omitted or "-".
+ * A password of "-" is taken from the FTP_PASSWORD environment variable instead.
+ * With --cache every session serves unchanged files from one shared download cache.
+ * With --prefetch every session stages the files of its listings for the downloads after them.
+ * Returns the process exit code.
+ */
+int runBatch(int argc, char* argv[]) {
+    std::vector<std::string> args(argv + 2, argv + argc);
+    unsigned jobs = 4;
+    unsigned long long cacheMiB = 0;
+    unsigned long long prefetchMiB = 0;
+
+    for (size_t i = 0; i + 1 < args.size();) {
+        if (args[i] == "--jobs") {
+            jobs = static_cast<unsigned>(std::stoul(args[i + 1]));
+        } else if (args[i] == "--cache") {
+            cacheMiB = std::stoull(args[i + 1]);
+        } else if (args[i] == "--prefetch") {
+            prefetchMiB = std::stoull(args[i + 1]);
+        } else {
+            ++i;
+            continue;
         }
-        start = end;
+        args.erase(args.begin() + i, args.begin() + i + 2);
+    }
+
+    if (args.size() < 4 || args.size() > 5) {
+        std::cerr << "Usage: ftp --batch <server> <port> <username> <password> [script] [--jobs N] [--cache MiB]"
+                  << " [--prefetch MiB]" << std::endl;
+        return 2;
+    }
+
+    std::string password = args[3];
+    if (password == "-") {
+        const char* fromEnv = std::getenv("FTP_PASSWORD");
+        password = fromEnv ? fromEnv : "";
+    }
+
+    BatchRunner runner(args[0], std::stoi(args[1]), args[2], password, jobs);
+    if (cacheMiB > 0) {
+        runner.setDownloadCache(ServerController::openDownloadCache(cacheMiB * 1024 * 1024));
     }
+    runner.setPrefetch(prefetchMiB * 1024 * 1024);
 
-    return tokens;
+    if (args.size() == 5 && args[4] != "-") {
+        std::ifstream script(args[4]);
+        if (!script.is_open()) {
+            std::cerr << "Failed to open script: " << args[4] << std::endl;
+            return 2;
+        }
+        return runner.run(script);
+    }
+    return runner.run(std::cin);
 }
 
+int main(int argc, char* argv[]) {
+    // A peer that went away must surface as a failed send, not kill the process
+    signal(SIGPIPE, SIG_IGN);
+
+    if (argc > 1 && std::string(argv[1]) == "--batch") {
+        try {
+            return runBatch(argc, argv);
+        } catch (const std::exception& ex) {
+            std::cerr << ex.what() << std::endl;
+            return 2;
+        }
+    }
 
-int main() {
     std::string serverAddress;
     int serverPort;
     std::cout << "Enter the server address: ";
@@ -64,13 +255,62 @@ int main() {
 
             if (tokens[0] == "list") {
                 client.listFiles();
+            } else if (tokens[0] == "storall" && tokens.size() == 3) {
+                client.uploadDirectory(tokens[1], tokens[2]);
+            } else if (tokens[0] == "retrall" && tokens.size() == 3) {
+                client.downloadDirectory(tokens[1], tokens[2]);
+            } else if (tokens[0] == "push" && tokens.size() == 1) {
+                client.pushChanged();
+            } else if (tokens[0] == "directio" && tokens.size() == 2 && (tokens[1] == "on" || tokens[1] == "off")) {
+                client.setDirectIO(tokens[1] == "on");
+            } else if (tokens[0] == "pipeline" && tokens.size() == 2) {
+                setPipelineDepth(client, tokens);
+            } else if (tokens[0] == "tlsresume" && tokens.size() == 2 && (tokens[1] == "on" || tokens[1] == "off")) {
+                client.setTlsResumption(tokens[1] == "on");
+            } else if (tokens[0] == "blockmode" && tokens.size() == 2 && (tokens[1] == "on" || tokens[1] == "off")) {
+                client.setBlockMode(tokens[1] == "on");
+            } else if (tokens[0] == "cache" && tokens.size() == 2) {
+                setDownloadCache(client, tokens);
+            } else if (tokens[0] == "prefetch" && tokens.size() == 2) {
+                setPrefetch(client, tokens);
+            } else if (tokens[0] == "activemode" && tokens.size() == 2 && (tokens[1] == "on" || tokens[1] == "off")) {
+                client.setActiveMode(tokens[1] == "on");
+            } else if (tokens[0] == "segmented" && tokens.size() == 2 && (tokens[1] == "on" || tokens[1] == "off")) {
+                client.setSegmentedUpload(tokens[1] == "on");
+                client.setSegmentedDownload(tokens[1] == "on");
+            } else if (tokens[0] == "bench" && tokens.size() >= 3) {
+                Benchmark::runCommand(client, tokens);
+            } else if (tokens[0] == "readbench" && tokens.size() >= 4 && tokens.size() <= 5) {
+                Benchmark::runReadCommand(client, tokens);
+            } else if (tokens[0] == "timeouts" && tokens.size() == 4) {
+                setTimeouts(client, tokens);
+            } else if (tokens[0] == "progress" && tokens.size() >= 2 && tokens.size() <= 3) {
+                setProgressMode(tokens);
             } else if (tokens[0] == "exit") {
                 client.logout();
                 break;
             } else if (tokens[0] == "stor" && tokens.size() == 3) {
                 client.uploadFile(tokens[1], tokens[2]);
+            } else if (tokens[0] == "delta" && tokens.size() == 3) {
+                client.uploadFileDelta(tokens[1], tokens[2]);
             } else if (tokens[0] == "retr" && tokens.size() == 3) {
                 client.downloadFile(tokens[1], tokens[2]);
+            } else if (tokens[0] == "pread" && tokens.size() == 5) {
+                readRemote(client, tokens);
+            } else if (tokens[0] == "queue" && tokens.size() >= 4 && tokens.size() <= 6 &&
+                       (tokens[1] == "stor" || tokens[1] == "retr")) {
+                queueTransfer(client, tokens);
+            } else if (tokens[0] == "wait" && tokens.size() == 1) {
+                client.waitTransfers();
+            } else if (tokens[0] == "metrics" && tokens.size() == 1) {
+                client.printTransferMetrics();
+            } else if (tokens[0] == "mirror" && tokens.size() >= 4) {
+                client.downloadFromMirrors(std::vector<std::string>(tokens.begin() + 3, tokens.end()), tokens[1],
+                                           tokens[2]);
+            } else if (tokens[0] == "fxp" && tokens.size() == 4) {
+                client.copyToServer(tokens[1], tokens[2], tokens[3]);
+            } else if (tokens[0] == "mget" && tokens.size() >= 2) {
+                client.downloadFiles(std::vector<std::string>(tokens.begin() + 1, tokens.end()));
             } else {
                 std::cout << "Invalid command or incorrect arguments." << std::endl;
             }
@@ -0,0 +1,161 @@
+#include "../FTPClient.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <thread>
+
+/*
+ * Allocation-counting test for the control channel.
+ * A stand-in server on loopback answers every command; the client sends SIZE and
+ * pipelined SIZE + MDTM queries in a loop. After a warm-up, which lets the session's
+ * buffers reach their working size, further commands must not allocate at all.
+ * Only allocations made on the client's thread are counted.
+ */
+
+static std::atomic<uint64_t> allocations{0};
+static thread_local bool counting = false;
+
+void* operator new(size_t size) {
+    if (counting) {
+        ++allocations;
+    }
+    void* memory = std::malloc(size ? size : 1);
+    if (!memory) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    std::free(memory);
+}
+
+// Commands sent before counting starts, and commands counted afterwards
+const int WARMUP_COMMANDS = 100;
+const int COUNTED_COMMANDS = 10000;
+
+/*
+ * serve function
+ * Answers the greeting and every command line on one connection until the client leaves.
+ * Takes a parameter listener representing the listening socket.
+ * Returns void.
+ */
+static void serve(int listener) {
+    int connection = accept(listener, nullptr, nullptr);
+    if (connection < 0) {
+        return;
+    }
+    int noDelay = 1;
+    setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    const char greeting[] = "220 ready\r\n";
+    send(connection, greeting, sizeof(greeting) - 1, 0);
+
+    // The answers to pipelined commands go out together, like the commands came in
+    char buffer[4096];
+    char answers[4096];
+    size_t filled = 0;
+    while (true) {
+        ssize_t bytesRead = recv(connection, buffer + filled, sizeof(buffer) - filled, 0);
+        if (bytesRead <= 0) {
+            break;
+        }
+        filled += static_cast<size_t>(bytesRead);
+        char* lineStart = buffer;
+        char* newline;
+        size_t answered = 0;
+        while ((newline = static_cast<char*>(memchr(lineStart, '\n', buffer + filled - lineStart))) != nullptr) {
+            const char* answer = "200 ok\r\n";
+            if (strncmp(lineStart, "SIZE", 4) == 0) {
+                answer = "213 1234\r\n";
+            } else if (strncmp(lineStart, "MDTM", 4) == 0) {
+                answer = "213 20260101000000\r\n";
+            } else if (strncmp(lineStart, "QUIT", 4) == 0) {
+                answer = "221 bye\r\n";
+            }
+            if (answered + strlen(answer) > sizeof(answers)) {
+                send(connection, answers, answered, 0);
+                answered = 0;
+            }
+            memcpy(answers + answered, answer, strlen(answer));
+            answered += strlen(answer);
+            lineStart = newline + 1;
+        }
+        send(connection, answers, answered, 0);
+        filled = static_cast<size_t>(buffer + filled - lineStart);
+        memmove(buffer, lineStart, filled);
+    }
+    close(connection);
+}
+
+int main() {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(listener, 1) != 0 || getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+        std::perror("listen");
+        return 2;
+    }
+    std::thread server(serve, listener);
+
+    int failures = 0;
+    {
+        FTPClient client("127.0.0.1", ntohs(address.sin_port), false);
+        const std::string remotePath = "some/remote/file.bin";
+        int64_t size = 0;
+        time_t modified = 0;
+
+        for (int i = 0; i < WARMUP_COMMANDS; ++i) {
+            client.remoteSize(remotePath);
+            client.remoteStat(remotePath, size, modified);
+        }
+
+        counting = true;
+        for (int i = 0; i < COUNTED_COMMANDS; ++i) {
+            size = client.remoteSize(remotePath);
+            if (size != 1234) {
+                ++failures;
+            }
+        }
+        uint64_t sizeAllocations = allocations.exchange(0);
+        for (int i = 0; i < COUNTED_COMMANDS; ++i) {
+            if (!client.remoteStat(remotePath, size, modified) || size != 1234) {
+                ++failures;
+            }
+        }
+        uint64_t statAllocations = allocations.exchange(0);
+        counting = false;
+
+        std::printf("SIZE: %llu allocations in %d commands\n", static_cast<unsigned long long>(sizeAllocations),
+                    COUNTED_COMMANDS);
+        std::printf("SIZE+MDTM: %llu allocations in %d command pairs\n",
+                    static_cast<unsigned long long>(statAllocations), COUNTED_COMMANDS);
+        if (sizeAllocations != 0 || statAllocations != 0) {
+            std::printf("FAIL: control channel commands allocate in steady state\n");
+            ++failures;
+        }
+        client.logout();
+    }
+    server.join();
+    close(listener);
+
+    if (failures != 0) {
+        std::printf("FAIL: %d failures\n", failures);
+        return 1;
+    }
+    std::printf("PASS\n");
+    return 0;
+}
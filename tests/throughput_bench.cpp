@@ -0,0 +1,792 @@
+#include "../FTPClient.h"
+#include "../Benchmark.h"
+#include "../TransferProgress.h"
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+/*
+ * Throughput regression harness for the download copy loops.
+ * A loopback server, forked before anything else runs, serves sparse files with sendfile.
+ * The client downloads them over a matrix of file sizes, concurrent sessions and buffer
+ * modes (splice, a pipelined writer thread, direct I/O), and records for every case
+ * MB/s, p50/p99 per-file latency, CPU time and the number of I/O calls the client made.
+ * With the server in its own process, the process CPU time and the counted calls are
+ * the client's alone. Each case runs several times and keeps the best value of each
+ * measurement, see measure.
+ * Uploads of many small files are measured the same way, once one STOR per file ("stor")
+ * and once as a single tar archive ("storall"), and their files/s compared.
+ * A few download cases run a second time with the progress renderer writing JSON records,
+ * and the throughput lost to progress reporting is printed.
+ * Usage: throughput_bench [--full] [--runs N] [--tolerance F] [--baseline file] [--save file]
+ * --full adds a 10 GB file to the matrix. With a baseline, the run fails when a case
+ * lost more than the tolerance in MB/s, or needs that many more calls per file, and still
+ * does when it is measured again. CPU time is recorded but not compared: on a shared
+ * machine it varies by a factor of two between otherwise identical runs.
+ */
+
+// I/O calls made through libc by the client, see the wrappers below
+static std::atomic<uint64_t> ioCalls{0};
+
+/*
+ * realFunction function
+ * Looks up the libc definition hidden by one of the counting wrappers below.
+ */
+template <typename Function>
+static Function realFunction(const char* name) {
+    return reinterpret_cast<Function>(dlsym(RTLD_NEXT, name));
+}
+
+// ftpcore is linked into this executable, so its calls reach these definitions first
+extern "C" {
+ssize_t read(int fd, void* buffer, size_t count) {
+    static auto real = realFunction<ssize_t (*)(int, void*, size_t)>("read");
+    ++ioCalls;
+    return real(fd, buffer, count);
+}
+
+ssize_t write(int fd, const void* buffer, size_t count) {
+    static auto real = realFunction<ssize_t (*)(int, const void*, size_t)>("write");
+    ++ioCalls;
+    return real(fd, buffer, count);
+}
+
+ssize_t pwrite(int fd, const void* buffer, size_t count, off_t offset) {
+    static auto real = realFunction<ssize_t (*)(int, const void*, size_t, off_t)>("pwrite");
+    ++ioCalls;
+    return real(fd, buffer, count, offset);
+}
+
+ssize_t recv(int fd, void* buffer, size_t length, int flags) {
+    static auto real = realFunction<ssize_t (*)(int, void*, size_t, int)>("recv");
+    ++ioCalls;
+    return real(fd, buffer, length, flags);
+}
+
+ssize_t send(int fd, const void* buffer, size_t length, int flags) {
+    static auto real = realFunction<ssize_t (*)(int, const void*, size_t, int)>("send");
+    ++ioCalls;
+    return real(fd, buffer, length, flags);
+}
+
+int poll(pollfd* fds, nfds_t count, int timeoutMs) {
+    static auto real = realFunction<int (*)(pollfd*, nfds_t, int)>("poll");
+    ++ioCalls;
+    return real(fds, count, timeoutMs);
+}
+
+ssize_t splice(int in, loff_t* inOffset, int out, loff_t* outOffset, size_t length, unsigned int flags) {
+    static auto real = realFunction<ssize_t (*)(int, loff_t*, int, loff_t*, size_t, unsigned int)>("splice");
+    ++ioCalls;
+    return real(in, inOffset, out, outOffset, length, flags);
+}
+}
+
+// Bytes of the files of one case together, at least one file each
+const uint64_t CASE_BYTES = 256ULL * 1024 * 1024;
+const unsigned MAX_FILES = 400;
+const unsigned SESSION_COUNTS[] = {1, 4};
+const uint64_t QUICK_SIZES[] = {1024, 1024 * 1024, 64ULL * 1024 * 1024};
+const uint64_t FULL_SIZE = 10ULL * 1024 * 1024 * 1024;
+const char* const MODES[] = {"splice", "pipelined", "direct"};
+// Small-file uploads, one STOR per file against one archive, over a single session
+const uint64_t UPLOAD_SIZES[] = {1024, 64 * 1024};
+const char* const UPLOAD_MODES[] = {"stor", "storall"};
+// Download cases also measured with progress rendered, many small files and a few large ones
+const uint64_t PROGRESS_SIZES[] = {1024, 64ULL * 1024 * 1024};
+// Throughput progress reporting may cost at most
+const double PROGRESS_OVERHEAD = 0.01;
+// Ring slots of the pipelined mode
+const unsigned PIPELINE_DEPTH = 4;
+// How often a case that looks regressed is measured again before it counts
+const unsigned CONFIRM_ROUNDS = 2;
+
+/*
+ * remoteName function
+ * Returns the name the server gives the file of the given size.
+ */
+static std::string remoteName(uint64_t size) {
+    return "f" + std::to_string(size) + ".bin";
+}
+
+/*
+ * uploadDirectory function
+ * Returns the directory under 'drive' holding the upload files of the given size.
+ */
+static std::string uploadDirectory(uint64_t size) {
+    return "upload" + std::to_string(size);
+}
+
+/*
+ * sizeLabel function
+ * Returns a size in the largest whole unit, e.g. 64MB.
+ */
+static std::string sizeLabel(uint64_t size) {
+    const char* units[] = {"B", "KB", "MB", "GB"};
+    int unit = 0;
+    while (unit < 3 && size >= 1024 && size % 1024 == 0) {
+        size /= 1024;
+        ++unit;
+    }
+    return std::to_string(size) + units[unit];
+}
+
+/*
+ * sendReply function
+ * Sends one reply line on a control connection.
+ */
+static void sendReply(int connection, const std::string& line) {
+    std::string message = line + "\r\n";
+    send(connection, message.data(), message.size(), MSG_NOSIGNAL);
+}
+
+/*
+ * serveSession function
+ * Answers one client session: login, FEAT, TYPE, SIZE, MDTM, PASV, RETR and STOR.
+ * Uploads are received and dropped; RNFR, RNTO and DELE only answer success.
+ * Takes parameters:
+ * - connection: the accepted control connection
+ * - root: the directory holding the served files
+ * Returns void.
+ */
+static void serveSession(int connection, const std::string& root) {
+    int noDelay = 1;
+    setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    sendReply(connection, "220 ready");
+
+    int passive = -1;
+    std::string buffered;
+    char chunk[4096];
+    while (true) {
+        size_t newline = buffered.find('\n');
+        if (newline == std::string::npos) {
+            ssize_t bytesRead = recv(connection, chunk, sizeof(chunk), 0);
+            if (bytesRead <= 0) {
+                break;
+            }
+            buffered.append(chunk, static_cast<size_t>(bytesRead));
+            continue;
+        }
+        std::string line = buffered.substr(0, newline);
+        buffered.erase(0, newline + 1);
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        std::string verb = line.substr(0, line.find(' '));
+        std::string argument = line.size() > verb.size() ? line.substr(verb.size() + 1) : "";
+        std::string path = root + "/" + argument;
+
+        if (verb == "USER") {
+            sendReply(connection, "331 password please");
+        } else if (verb == "PASS") {
+            sendReply(connection, "230 logged in");
+        } else if (verb == "FEAT") {
+            sendReply(connection, "211-Features:\r\n SIZE\r\n MDTM\r\n REST STREAM\r\n211 End");
+        } else if (verb == "SIZE" || verb == "MDTM") {
+            struct stat fileStat = {};
+            if (stat(path.c_str(), &fileStat) != 0) {
+                sendReply(connection, "550 no such file");
+            } else {
+                sendReply(connection, verb == "SIZE" ? "213 " + std::to_string(fileStat.st_size) : "213 20260101000000");
+            }
+        } else if (verb == "PASV") {
+            // One data port for the whole session: a new one per transfer would leave so many
+            // closed connections in TIME_WAIT that the ephemeral ports run out within a run
+            sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            socklen_t length = sizeof(address);
+            if (passive < 0) {
+                passive = socket(AF_INET, SOCK_STREAM, 0);
+                bind(passive, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+                listen(passive, 1);
+            }
+            getsockname(passive, reinterpret_cast<sockaddr*>(&address), &length);
+            unsigned port = ntohs(address.sin_port);
+            sendReply(connection, "227 Entering Passive Mode (127,0,0,1," + std::to_string(port / 256) + "," +
+                                      std::to_string(port % 256) + ")");
+        } else if (verb == "RETR") {
+            int fileFd = open(path.c_str(), O_RDONLY);
+            if (fileFd < 0 || passive < 0) {
+                sendReply(connection, "550 cannot send");
+                if (fileFd >= 0) {
+                    close(fileFd);
+                }
+                continue;
+            }
+            sendReply(connection, "150 sending");
+            int data = accept(passive, nullptr, nullptr);
+            struct stat fileStat = {};
+            fstat(fileFd, &fileStat);
+            off_t offset = 0;
+            bool complete = data >= 0;
+            while (complete && offset < fileStat.st_size) {
+                ssize_t sent = sendfile(data, fileFd, &offset, static_cast<size_t>(fileStat.st_size - offset));
+                complete = sent > 0;
+            }
+            close(fileFd);
+            if (data >= 0) {
+                close(data);
+            }
+            sendReply(connection, complete ? "226 done" : "426 aborted");
+        } else if (verb == "STOR") {
+            if (passive < 0) {
+                sendReply(connection, "425 no data connection");
+                continue;
+            }
+            sendReply(connection, "150 receiving");
+            int data = accept(passive, nullptr, nullptr);
+            char sink[64 * 1024];
+            ssize_t received = data >= 0 ? 1 : -1;
+            while (received > 0) {
+                received = recv(data, sink, sizeof(sink), 0);
+            }
+            if (data >= 0) {
+                close(data);
+            }
+            sendReply(connection, received == 0 ? "226 done" : "426 aborted");
+        } else if (verb == "RNFR") {
+            sendReply(connection, "350 ready for RNTO");
+        } else if (verb == "RNTO" || verb == "DELE") {
+            sendReply(connection, "250 ok");
+        } else if (verb == "QUIT") {
+            sendReply(connection, "221 bye");
+            break;
+        } else if (verb == "TYPE" || verb == "OPTS") {
+            sendReply(connection, "200 ok");
+        } else {
+            sendReply(connection, "502 not implemented");
+        }
+    }
+    if (passive >= 0) {
+        close(passive);
+    }
+    close(connection);
+}
+
+/*
+ * serve function
+ * Accepts sessions until the process is killed, each on a thread of its own.
+ * Takes parameters:
+ * - listener: the listening control socket
+ * - root: the directory holding the served files
+ * Returns void.
+ */
+[[noreturn]] static void serve(int listener, const std::string& root) {
+    while (true) {
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection >= 0) {
+            std::thread(serveSession, connection, root).detach();
+        }
+    }
+}
+
+// One cell of the matrix and what it measured
+struct Case {
+    uint64_t size = 0;
+    unsigned files = 0;
+    unsigned sessions = 0;
+    std::string mode;
+    bool progress = false;
+    bool ok = true;
+    double seconds = 0;
+    double p50Ms = 0;
+    double p99Ms = 0;
+    double cpuSeconds = 0;
+    uint64_t calls = 0;
+
+    std::string name() const {
+        return sizeLabel(size) + " x" + std::to_string(files) + ", " + std::to_string(sessions) +
+               (sessions == 1 ? " session, " : " sessions, ") + mode + (progress ? ", progress" : "");
+    }
+    double mbPerSecond() const {
+        return seconds > 0 ? static_cast<double>(size) * files / 1e6 / seconds : 0;
+    }
+    double cpuPerMb() const {
+        return cpuSeconds / (static_cast<double>(size) * files / 1e6);
+    }
+    double filesPerSecond() const {
+        return seconds > 0 ? files / seconds : 0;
+    }
+    double callsPerFile() const {
+        return static_cast<double>(calls) / files;
+    }
+    bool upload() const {
+        return mode == "stor" || mode == "storall";
+    }
+};
+
+/*
+ * processCpuSeconds function
+ * Returns the user and system CPU time used by this process so far.
+ */
+static double processCpuSeconds() {
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+/*
+ * percentile function
+ * Returns the value below which the given fraction of the values fall (nearest rank).
+ */
+static double percentile(std::vector<double> values, double fraction) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t rank = static_cast<size_t>(fraction * (values.size() - 1) + 0.5);
+    return values[std::min(rank, values.size() - 1)];
+}
+
+/*
+ * runCase function
+ * Downloads or uploads the files of one case once and fills in its measurements.
+ * Every session logs in and is set up before the clock starts, and logs out after it stopped.
+ * An archive upload sends all files at once, so it has one latency, that of the whole archive.
+ * Takes parameters:
+ * - port: the control port of the loopback server
+ * - measured: the case to run, receives the results
+ * Returns void.
+ */
+static void runCase(int port, Case& measured) {
+    std::mutex mutex;
+    std::condition_variable changed;
+    unsigned ready = 0;
+    unsigned finished = 0;
+    bool started = false;
+    bool measuredEnd = false;
+    std::atomic<unsigned> nextFile{0};
+    std::vector<double> latencies;
+    bool failed = false;
+
+    auto session = [&](unsigned index) {
+        std::unique_ptr<FTPClient> client;
+        try {
+            client = std::make_unique<FTPClient>("127.0.0.1", port, false);
+            client->login("bench", "bench");
+            client->setDirectIO(measured.mode == "direct");
+            client->setPipelineDepth(measured.mode == "pipelined" ? PIPELINE_DEPTH : 0);
+        } catch (const std::exception& ex) {
+            std::fprintf(stderr, "Session %u failed to start: %s\n", index, ex.what());
+            client.reset();
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        failed = failed || !client;
+        ++ready;
+        changed.notify_all();
+        changed.wait(lock, [&] { return started; });
+        lock.unlock();
+
+        std::vector<double> own;
+        std::string localName = "bench" + std::to_string(index) + ".bin";
+        unsigned transfers = measured.mode == "storall" ? 1 : measured.files;
+        for (unsigned file = nextFile++; client && file < transfers; file = nextFile++) {
+            auto start = std::chrono::steady_clock::now();
+            try {
+                if (measured.mode == "storall") {
+                    client->uploadDirectoryArchive(uploadDirectory(measured.size), "upload.tar");
+                } else if (measured.mode == "stor") {
+                    client->uploadFile(uploadDirectory(measured.size) + "/" + std::to_string(file) + ".bin",
+                                       std::to_string(file) + ".bin");
+                } else {
+                    client->downloadFile(remoteName(measured.size), localName);
+                }
+            } catch (const std::exception& ex) {
+                std::fprintf(stderr, "Transfer failed: %s\n", ex.what());
+                lock.lock();
+                failed = true;
+                lock.unlock();
+                break;
+            }
+            own.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+            if (!measured.upload()) {
+                std::remove(("drive/" + localName).c_str());
+            }
+        }
+
+        lock.lock();
+        latencies.insert(latencies.end(), own.begin(), own.end());
+        ++finished;
+        changed.notify_all();
+        changed.wait(lock, [&] { return measuredEnd; });
+        lock.unlock();
+        if (client) {
+            try {
+                client->logout();
+            } catch (const std::exception&) {
+                // The measurement is taken, a failed QUIT does not matter
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < measured.sessions; ++i) {
+        threads.emplace_back(session, i);
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&] { return ready == measured.sessions; });
+    double cpuBefore = processCpuSeconds();
+    uint64_t callsBefore = ioCalls;
+    auto start = std::chrono::steady_clock::now();
+    started = true;
+    changed.notify_all();
+
+    changed.wait(lock, [&] { return finished == measured.sessions; });
+    measured.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    measured.calls = ioCalls - callsBefore;
+    measured.cpuSeconds = processCpuSeconds() - cpuBefore;
+    measured.p50Ms = percentile(latencies, 0.5);
+    measured.p99Ms = percentile(latencies, 0.99);
+    measured.ok = !failed && latencies.size() == (measured.mode == "storall" ? 1 : measured.files);
+    measuredEnd = true;
+    changed.notify_all();
+    lock.unlock();
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+/*
+ * toJson function
+ * Returns the measurements of a case as one JSON object.
+ */
+static std::string toJson(const Case& measured) {
+    std::ostringstream json;
+    json << "{\"case\":\"" << measured.name() << "\",\"size\":" << measured.size << ",\"files\":" << measured.files
+         << ",\"sessions\":" << measured.sessions << ",\"mode\":\"" << measured.mode
+         << "\",\"progress\":" << (measured.progress ? "true" : "false") << ",\"ok\":" << (measured.ok ? "true" : "false") << ",\"seconds\":" << measured.seconds
+         << ",\"mb_per_s\":" << measured.mbPerSecond() << ",\"files_per_s\":" << measured.filesPerSecond()
+         << ",\"p50_ms\":" << measured.p50Ms
+         << ",\"p99_ms\":" << measured.p99Ms << ",\"cpu_s\":" << measured.cpuSeconds
+         << ",\"cpu_s_per_mb\":" << measured.cpuPerMb() << ",\"io_calls\":" << measured.calls
+         << ",\"io_calls_per_file\":" << measured.callsPerFile() << "}";
+    return json.str();
+}
+
+/*
+ * jsonNumber function
+ * Reads a number field from one JSON object written by toJson.
+ * Returns true if the field was found, false otherwise.
+ */
+static bool jsonNumber(const std::string& json, const std::string& key, double& value) {
+    size_t position = json.find("\"" + key + "\":");
+    if (position == std::string::npos) {
+        return false;
+    }
+    value = std::strtod(json.c_str() + position + key.size() + 3, nullptr);
+    return true;
+}
+
+/*
+ * measure function
+ * Runs a case the given number of times, keeping the best value of each measurement:
+ * the highest MB/s (with the latencies of that run), the least CPU time and the fewest calls.
+ * Other load on the machine only ever makes a run worse, so the best values are the stable ones.
+ * Takes parameters:
+ * - port: the control port of the loopback server
+ * - best: the case to run, holding the results of earlier runs if it has any
+ * - runs: how many more times to run it
+ * Returns void.
+ */
+static void measure(int port, Case& best, unsigned runs) {
+    bool first = best.seconds == 0;
+    for (unsigned run = 0; run < runs && best.ok; ++run) {
+        Case measured = best;
+
+        // Quiet the per-file messages of the client while the clock runs
+        std::streambuf* output = std::cout.rdbuf(nullptr);
+        if (measured.progress) {
+            ProgressMonitor::instance().setMode(ProgressMonitor::Mode::Json, "/dev/null");
+        }
+        runCase(port, measured);
+        ProgressMonitor::instance().setMode(ProgressMonitor::Mode::Off);
+        std::cout.rdbuf(output);
+        std::cout.clear();
+
+        if (!measured.ok || first) {
+            best = measured;
+            first = false;
+            continue;
+        }
+        double cpuSeconds = std::min(best.cpuSeconds, measured.cpuSeconds);
+        uint64_t calls = std::min(best.calls, measured.calls);
+        if (measured.mbPerSecond() > best.mbPerSecond()) {
+            best = measured;
+        }
+        best.cpuSeconds = cpuSeconds;
+        best.calls = calls;
+    }
+}
+
+/*
+ * withinBaseline function
+ * Checks a case against the case of the same name in a saved result.
+ * Takes parameters:
+ * - measured: the case just measured
+ * - baseline: the lines of the saved result, one case per line
+ * - tolerance: the allowed relative loss
+ * - report: whether to print what regressed
+ * Returns false if the case regressed, true otherwise, also when the baseline does not have it.
+ */
+static bool withinBaseline(const Case& measured, const std::vector<std::string>& baseline, double tolerance,
+                           bool report) {
+    std::string key = "\"case\":\"" + measured.name() + "\"";
+    auto line = std::find_if(baseline.begin(), baseline.end(),
+                             [&key](const std::string& candidate) { return candidate.find(key) != std::string::npos; });
+    double mbPerSecond = 0, callsPerFile = 0;
+    if (line == baseline.end() || !jsonNumber(*line, "mb_per_s", mbPerSecond) ||
+        !jsonNumber(*line, "io_calls_per_file", callsPerFile)) {
+        if (report) {
+            std::printf("%-46s not in the baseline\n", measured.name().c_str());
+        }
+        return true;
+    }
+
+    bool ok = true;
+    if (measured.mbPerSecond() < mbPerSecond * (1 - tolerance)) {
+        ok = false;
+        if (report) {
+            std::printf("%-46s throughput regressed: %.1f MB/s, baseline %.1f MB/s\n", measured.name().c_str(),
+                        measured.mbPerSecond(), mbPerSecond);
+        }
+    }
+    if (measured.callsPerFile() > callsPerFile * (1 + tolerance)) {
+        ok = false;
+        if (report) {
+            std::printf("%-46s I/O calls regressed: %.1f per file, baseline %.1f\n", measured.name().c_str(),
+                        measured.callsPerFile(), callsPerFile);
+        }
+    }
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    bool full = false;
+    unsigned runs = 5;
+    double tolerance = Benchmark::TOLERANCE;
+    std::string baselinePath, savePath;
+    for (int i = 1; i < argc; ++i) {
+        std::string option = argv[i];
+        if (option == "--full") {
+            full = true;
+        } else if (option == "--runs" && i + 1 < argc) {
+            runs = static_cast<unsigned>(std::max(1, std::atoi(argv[++i])));
+        } else if (option == "--tolerance" && i + 1 < argc) {
+            tolerance = std::atof(argv[++i]);
+        } else if (option == "--baseline" && i + 1 < argc) {
+            baselinePath = std::filesystem::absolute(argv[++i]).string();
+        } else if (option == "--save" && i + 1 < argc) {
+            savePath = std::filesystem::absolute(argv[++i]).string();
+        } else {
+            std::fprintf(stderr, "Usage: %s [--full] [--runs N] [--tolerance F] [--baseline file] [--save file]\n",
+                         argv[0]);
+            return 2;
+        }
+    }
+
+    std::vector<std::string> baseline;
+    if (!baselinePath.empty()) {
+        std::ifstream file(baselinePath);
+        if (!file.is_open()) {
+            std::fprintf(stderr, "Failed to read baseline: %s\n", baselinePath.c_str());
+            return 2;
+        }
+        for (std::string line; std::getline(file, line);) {
+            baseline.push_back(line);
+        }
+    }
+
+    // Both ends work in a directory of their own, removed at the end
+    std::string directoryTemplate = (std::filesystem::temp_directory_path() / "throughput_bench.XXXXXX").string();
+    if (!mkdtemp(directoryTemplate.data())) {
+        std::perror("mkdtemp");
+        return 2;
+    }
+    const std::string directory = directoryTemplate;
+    const std::string root = directory + "/served";
+    std::filesystem::create_directories(root);
+
+    std::vector<uint64_t> sizes(std::begin(QUICK_SIZES), std::end(QUICK_SIZES));
+    if (full) {
+        sizes.push_back(FULL_SIZE);
+    }
+    for (uint64_t size : sizes) {
+        // Sparse, so even the largest file costs no disk space on the server side
+        int fd = open((root + "/" + remoteName(size)).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            std::perror("create served file");
+            return 2;
+        }
+        close(fd);
+    }
+    for (uint64_t size : UPLOAD_SIZES) {
+        std::string uploads = directory + "/drive/" + uploadDirectory(size);
+        std::filesystem::create_directories(uploads);
+        for (unsigned file = 0; file < MAX_FILES; ++file) {
+            int fd = open((uploads + "/" + std::to_string(file) + ".bin").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0 || ftruncate(fd, static_cast<off_t>(size)) != 0) {
+                std::perror("create upload file");
+                return 2;
+            }
+            close(fd);
+        }
+    }
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(listener, 16) != 0 || getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+        std::perror("listen");
+        return 2;
+    }
+    pid_t server = fork();
+    if (server < 0) {
+        std::perror("fork");
+        return 2;
+    }
+    if (server == 0) {
+        serve(listener, root);
+    }
+    close(listener);
+    int port = ntohs(address.sin_port);
+
+    std::filesystem::current_path(directory);
+    std::vector<Case> cases;
+    for (uint64_t size : sizes) {
+        unsigned files = static_cast<unsigned>(std::min<uint64_t>(MAX_FILES, std::max<uint64_t>(1, CASE_BYTES / size)));
+        for (unsigned sessions : SESSION_COUNTS) {
+            // A session without a file of its own would only repeat the case before
+            if (sessions > files) {
+                continue;
+            }
+            for (const char* mode : MODES) {
+                Case measured;
+                measured.size = size;
+                measured.files = files;
+                measured.sessions = sessions;
+                measured.mode = mode;
+                measure(port, measured, size == FULL_SIZE ? 1 : runs);
+                std::printf("%s\n", toJson(measured).c_str());
+                std::fflush(stdout);
+                cases.push_back(measured);
+            }
+        }
+    }
+    for (uint64_t size : PROGRESS_SIZES) {
+        // Runs with and without progress alternate, so both meet the same load on the machine
+        Case plain;
+        plain.size = size;
+        plain.files = static_cast<unsigned>(std::min<uint64_t>(MAX_FILES, std::max<uint64_t>(1, CASE_BYTES / size)));
+        plain.sessions = 1;
+        plain.mode = "splice";
+        Case reported = plain;
+        reported.progress = true;
+        for (unsigned run = 0; run < 2 * runs; ++run) {
+            measure(port, plain, 1);
+            measure(port, reported, 1);
+        }
+        std::printf("%s\n", toJson(reported).c_str());
+        double overhead = plain.mbPerSecond() > 0 ? 1 - reported.mbPerSecond() / plain.mbPerSecond() : 0;
+        std::printf("%s x%u progress overhead: %.1f MB/s without, %.1f MB/s with JSON progress (%.2f%%, %s %.0f%%)\n",
+                    sizeLabel(size).c_str(), plain.files, plain.mbPerSecond(), reported.mbPerSecond(),
+                    overhead * 100, overhead <= PROGRESS_OVERHEAD ? "within" : "above", PROGRESS_OVERHEAD * 100);
+        std::fflush(stdout);
+        cases.push_back(reported);
+    }
+    for (uint64_t size : UPLOAD_SIZES) {
+        double filesPerSecond[2] = {};
+        for (size_t mode = 0; mode < 2; ++mode) {
+            Case measured;
+            measured.size = size;
+            measured.files = MAX_FILES;
+            measured.sessions = 1;
+            measured.mode = UPLOAD_MODES[mode];
+            measure(port, measured, runs);
+            std::printf("%s\n", toJson(measured).c_str());
+            std::fflush(stdout);
+            filesPerSecond[mode] = measured.filesPerSecond();
+            cases.push_back(measured);
+        }
+        std::printf("%s x%u uploads: %.0f files/s per file, %.0f files/s as one archive (%.1fx)\n",
+                    sizeLabel(size).c_str(), MAX_FILES, filesPerSecond[0], filesPerSecond[1],
+                    filesPerSecond[0] > 0 ? filesPerSecond[1] / filesPerSecond[0] : 0);
+        std::fflush(stdout);
+    }
+
+    // A case that looks regressed may only have met other load, it must stay behind when measured again
+    for (unsigned round = 0; round < CONFIRM_ROUNDS && !baseline.empty(); ++round) {
+        for (Case& measured : cases) {
+            if (measured.ok && measured.size != FULL_SIZE && !withinBaseline(measured, baseline, tolerance, false)) {
+                measure(port, measured, runs);
+                std::printf("again: %s\n", toJson(measured).c_str());
+                std::fflush(stdout);
+            }
+        }
+    }
+
+    kill(server, SIGKILL);
+    waitpid(server, nullptr, 0);
+    std::filesystem::current_path("/");
+    std::error_code ec;
+    std::filesystem::remove_all(directory, ec);
+
+    bool ok = true;
+    for (const Case& measured : cases) {
+        if (!measured.ok) {
+            std::printf("%-46s transfers failed\n", measured.name().c_str());
+            ok = false;
+        }
+    }
+    if (!savePath.empty()) {
+        std::ofstream out(savePath, std::ios::trunc);
+        out << "{\"cases\":[\n";
+        for (size_t i = 0; i < cases.size(); ++i) {
+            out << toJson(cases[i]) << (i + 1 < cases.size() ? ",\n" : "\n");
+        }
+        out << "]}\n";
+        if (!out) {
+            std::fprintf(stderr, "Failed to save result: %s\n", savePath.c_str());
+            ok = false;
+        }
+    }
+    bool regressed = false;
+    for (const Case& measured : cases) {
+        regressed = !withinBaseline(measured, baseline, tolerance, !baseline.empty()) || regressed;
+    }
+    if (regressed) {
+        std::printf("FAIL: regressed against %s\n", baselinePath.c_str());
+        ok = false;
+    }
+    if (ok) {
+        std::printf("PASS\n");
+    }
+    return ok ? 0 : 1;
+}